@@ -0,0 +1,715 @@
+#pragma once
+#include <stdint.h>
+#include <bit>
+#include <map>
+#include <ostream>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+#include "BBBBBrainDumbed.h"
+
+using namespace std;
+
+/*
+	Static control-flow recovery for ROM images.
+	Code is walked from P = 0 and from every IRQ vector stored with mtv, tracking each register as known bits, so targets built with ldi.16 resolve.
+	The walk is a worklist fixpoint over instruction addresses: states only ever lose known bits when paths merge, so it terminates.
+	IRQ handlers are assumed to return with the interrupted state intact; jumps through values it cannot pin down are reported, not followed.
+*/
+class KnownValue
+{
+public:
+	uint16_t value = 0;
+	uint16_t known = 0;	//bits of value that are known
+	KnownValue();
+	KnownValue(uint16_t _value);
+	bool isConstant() const;
+	uint16_t minimum() const;
+	uint16_t maximum() const;
+	KnownValue rotateRight(uint8_t n) const;
+	KnownValue rotateLeft(uint8_t n) const;
+	KnownValue add(uint16_t addend) const;
+	KnownValue insert(KnownValue field, uint16_t mask, uint8_t position) const;
+	KnownValue meet(const KnownValue& rhs) const;
+	bool operator==(const KnownValue& rhs) const = default;
+};
+
+class AbstractState
+{
+public:
+	KnownValue R[8];	//A B D E F G K P, in op1/op2 order
+	KnownValue H, L, V;
+	int8_t OP1 = -1, OP2 = -1, I = -1, J = -1, C = -1, M = -1;	//-1 when unknown
+	static AbstractState reset();
+	bool meet(const AbstractState& rhs);
+	bool operator==(const AbstractState& rhs) const = default;
+};
+
+class AnalyzedInstruction
+{
+public:
+	uint8_t opcode = 0;
+	vector<uint16_t> successors;
+	bool unresolvedJump = false;
+	bool writesRom = false;	//a store provably hits ROM
+	bool mayWriteRom = false;	//a store address could not be kept out of ROM
+	bool leavesRom = false;	//control goes to an address that is not ROM code
+	uint16_t romWriteFirst = 0, romWriteLast = 0;
+};
+
+class AnalyzedBlock
+{
+public:
+	uint16_t address = 0, end = 0;	//[address, end) in bits
+	size_t instructions = 0;
+	vector<uint16_t> successors;
+	bool entry = false;
+	bool unresolvedJump = false;
+	bool writesRom = false;
+	bool mayWriteRom = false;
+	bool leavesRom = false;
+};
+
+class Analyzer
+{
+public:
+	bool resetAtEntry = true;	//P = 0 is entered with the power-on register state
+	set<uint16_t> entryPoints;
+	map<uint16_t, AnalyzedInstruction> code;
+	map<uint16_t, AnalyzedBlock> blocks;
+	vector<pair<uint16_t, uint16_t>> romWrites;	//[first, last] bits some store may hit
+	vector<pair<uint16_t, uint16_t>> noSmcRegions;	//[first, last] bits of reachable code no store can reach
+	Analyzer(Memory& _memory);
+	~Analyzer();
+	void analyze();
+	bool isCode(uint16_t address);
+	void report(wostream& out);
+private:
+	Memory& memory;
+	BBBBBrainDumbed* scratch;
+	unordered_map<uint16_t, AbstractState> states;
+	bool concrete(uint8_t opcode, AbstractState& state);
+	void clobber(uint8_t opcode, AbstractState& state);
+	void access(uint8_t opcode, AbstractState& state, AnalyzedInstruction& info);
+	void step(uint16_t address, AbstractState state, AnalyzedInstruction& info, vector<pair<uint16_t, AbstractState>>& successors);
+	void buildBlocks();
+	void buildRegions();
+};
+
+KnownValue::KnownValue()
+{
+}
+
+KnownValue::KnownValue(uint16_t _value)
+{
+	value = _value;
+	known = 0xffff;
+}
+
+bool KnownValue::isConstant() const
+{
+	return known == 0xffff;
+}
+
+uint16_t KnownValue::minimum() const
+{
+	return value & known;
+}
+
+uint16_t KnownValue::maximum() const
+{
+	return value | ~known;
+}
+
+KnownValue KnownValue::rotateRight(uint8_t n) const
+{
+	KnownValue output;
+	output.value = rotr(value, n);
+	output.known = rotr(known, n);
+	return output;
+}
+
+KnownValue KnownValue::rotateLeft(uint8_t n) const
+{
+	KnownValue output;
+	output.value = rotl(value, n);
+	output.known = rotl(known, n);
+	return output;
+}
+
+KnownValue KnownValue::add(uint16_t addend) const	//carries out of unknown bits make the bits above them unknown until a carry is known to stop
+{
+	uint16_t one = value & known, zero = ~value & known;
+	uint16_t sumMax = (uint16_t)(~zero + addend), sumMin = (uint16_t)(one + addend);
+	uint16_t carryZero = ~(sumMax ^ ~zero ^ addend), carryOne = sumMin ^ one ^ addend;
+	KnownValue output;
+	output.known = known & (carryZero | carryOne);
+	output.value = sumMin & output.known;
+	return output;
+}
+
+KnownValue KnownValue::insert(KnownValue field, uint16_t mask, uint8_t position) const	//what ldi/mov.1/mov.4 do: replace the masked low bits of the rotated register
+{
+	KnownValue output = rotateRight(position);
+	output.value = (output.value & ~mask) | (field.value & mask);
+	output.known = (output.known & ~mask) | (field.known & mask);
+	return output.rotateLeft(position);
+}
+
+KnownValue KnownValue::meet(const KnownValue& rhs) const
+{
+	KnownValue output;
+	output.known = known & rhs.known & ~(value ^ rhs.value);
+	output.value = value & output.known;
+	return output;
+}
+
+AbstractState AbstractState::reset()	//BBBBBrainDumbed's constructor state
+{
+	AbstractState output;
+	for (size_t i = 0; i < 8; i++)
+	{
+		output.R[i] = KnownValue(0);
+	}
+	output.H = output.L = output.V = KnownValue(0);
+	output.OP1 = output.OP2 = output.I = output.J = output.C = output.M = 0;
+	return output;
+}
+
+bool AbstractState::meet(const AbstractState& rhs)	//true if anything became less known
+{
+	AbstractState old = *this;
+	for (size_t i = 0; i < 8; i++)
+	{
+		R[i] = R[i].meet(rhs.R[i]);
+	}
+	H = H.meet(rhs.H);
+	L = L.meet(rhs.L);
+	V = V.meet(rhs.V);
+	int8_t* fields[] = { &OP1, &OP2, &I, &J, &C, &M };
+	const int8_t* others[] = { &rhs.OP1, &rhs.OP2, &rhs.I, &rhs.J, &rhs.C, &rhs.M };
+	for (size_t i = 0; i < 6; i++)
+	{
+		if (*fields[i] != *others[i])
+		{
+			*fields[i] = -1;
+		}
+	}
+	return !(old == *this);
+}
+
+Analyzer::Analyzer(Memory& _memory) : memory(_memory)
+{
+	scratch = new BBBBBrainDumbed();
+}
+
+Analyzer::~Analyzer()
+{
+	delete scratch;
+}
+
+bool Analyzer::concrete(uint8_t opcode, AbstractState& state)	//run the opcode on the scratch core when everything it reads is known
+{
+	uint32_t e = isa[opcode].effects;
+	if (((e & (readOp1 | writeOp1)) && state.OP1 < 0) || ((e & (readOp2 | writeOp2)) && state.OP2 < 0)
+		|| ((e & readOp1) && !state.R[state.OP1].isConstant()) || ((e & readOp2) && !state.R[state.OP2].isConstant())
+		|| ((e & readI) && state.I < 0) || ((e & readJ) && state.J < 0) || ((e & readC) && state.C < 0)
+		|| ((e & readHLVM) && (!state.H.isConstant() || !state.L.isConstant() || !state.V.isConstant() || state.M < 0)))
+	{
+		return false;
+	}
+	if ((opcode == 46 || opcode == 63) && (state.R[state.OP2].rotateRight(state.I).value & (opcode == 46 ? 0xf : 0xffff)) == 0)	//div.4 and divs.16 do not guard against zero
+	{
+		return false;
+	}
+	BBBBBrainDumbed& s = *scratch;
+	uint16_t* registers[] = { &s.A, &s.B, &s.D, &s.E, &s.F, &s.G, &s.K, &s.P };
+	for (size_t i = 0; i < 8; i++)
+	{
+		*registers[i] = state.R[i].value;
+	}
+	s.OP1 = registers[max(state.OP1, (int8_t)0)];
+	s.OP2 = registers[max(state.OP2, (int8_t)0)];
+	s.I = max(state.I, (int8_t)0);
+	s.J = max(state.J, (int8_t)0);
+	s.C = state.C > 0;
+	s.M = state.M > 0;
+	s.H = state.H.value;
+	s.L = state.L.value;
+	s.V = state.V.value;
+	s.inst = opcode;
+	s.operate();
+	if (e & writeOp1)
+	{
+		state.R[state.OP1] = KnownValue(*s.OP1);
+	}
+	if (e & writeOp2)
+	{
+		state.R[state.OP2] = KnownValue(*s.OP2);
+	}
+	if (e & writeI)
+	{
+		state.I = s.I;
+	}
+	if (e & writeJ)
+	{
+		state.J = s.J;
+	}
+	if (e & writeC)
+	{
+		state.C = s.C;
+	}
+	if (e & writeHL)
+	{
+		state.H = KnownValue(s.H);
+		state.L = KnownValue(s.L);
+	}
+	return true;
+}
+
+void Analyzer::clobber(uint8_t opcode, AbstractState& state)	//forget whatever the opcode may have written, keeping the bits ldi/mov insert
+{
+	uint32_t e = isa[opcode].effects;
+	if (e & writeOp1)
+	{
+		if (state.OP1 < 0)
+		{
+			for (size_t i = 0; i < 8; i++)
+			{
+				state.R[i] = KnownValue();
+			}
+		}
+		else if (state.I >= 0 && opcode >= 64 && opcode <= 79)	//ldi.4
+		{
+			state.R[state.OP1] = state.R[state.OP1].insert(KnownValue(opcode & 0xf), 0xf, state.I);
+		}
+		else if (state.I >= 0 && (opcode == 126 || opcode == 127))	//ldi.1
+		{
+			state.R[state.OP1] = state.R[state.OP1].insert(KnownValue(opcode & 0x1), 0x1, state.I);
+		}
+		else if (state.I >= 0 && state.OP2 >= 0 && (opcode == 16 || opcode == 32))	//mov.1, mov.4
+		{
+			state.R[state.OP1] = state.R[state.OP1].insert(state.R[state.OP2].rotateRight(state.I), opcode == 16 ? 0x1 : 0xf, state.I);
+		}
+		else if (state.OP2 >= 0 && opcode == 48)	//mov.16
+		{
+			state.R[state.OP1] = state.R[state.OP2];
+		}
+		else
+		{
+			state.R[state.OP1] = KnownValue();
+		}
+	}
+	if (e & writeOp2)
+	{
+		if (state.OP2 < 0)
+		{
+			for (size_t i = 0; i < 8; i++)
+			{
+				state.R[i] = KnownValue();
+			}
+		}
+		else
+		{
+			state.R[state.OP2] = KnownValue();
+		}
+	}
+	if (e & writeI)
+	{
+		state.I = (state.I >= 0 && isa[opcode].advanceI) ? (state.I + isa[opcode].advanceI) & 0xf : -1;
+	}
+	if (e & writeJ)
+	{
+		state.J = -1;
+	}
+	if (e & writeC)
+	{
+		state.C = -1;
+	}
+	if (e & writeHL)
+	{
+		state.H = state.L = KnownValue();
+	}
+}
+
+void Analyzer::access(uint8_t opcode, AbstractState& state, AnalyzedInstruction& info)	//ldr/str in all widths
+{
+	uint8_t width = isa[opcode].advanceJ ? isa[opcode].advanceJ : 16;
+	uint8_t kind = (opcode - (opcode >= 112 ? 112 : opcode >= 96 ? 96 : 80)) % 6;	//ldr ldri ldrd str stri strd
+	KnownValue pointer;
+	if (state.OP2 >= 0 && state.I >= 0)
+	{
+		pointer = state.R[state.OP2].rotateRight(state.I);
+	}
+	if (kind == 2 || kind == 5)
+	{
+		pointer = pointer.add((uint16_t)-width);
+	}
+	if (kind >= 3)
+	{
+		uint32_t first = pointer.minimum(), last = (uint32_t)pointer.maximum() + width - 1;
+		if (last > 0xffff)	//may wrap around into the bottom of ROM
+		{
+			first = 0;
+		}
+		if (first <= 0x7fff)
+		{
+			bool definite = pointer.isConstant() && last <= 0x7fff;
+			bool seen = info.writesRom || info.mayWriteRom;	//the same store is revisited with less known state
+			info.romWriteFirst = seen ? min<uint16_t>(info.romWriteFirst, (uint16_t)first) : (uint16_t)first;
+			info.romWriteLast = (uint16_t)min<uint32_t>(seen ? max<uint32_t>(info.romWriteLast, last) : last, 0x7fff);
+			info.writesRom |= definite;
+			info.mayWriteRom |= !definite;
+		}
+	}
+	else
+	{
+		if (state.OP1 < 0)
+		{
+			for (size_t i = 0; i < 8; i++)
+			{
+				state.R[i] = KnownValue();
+			}
+		}
+		else if (width < 16 && state.J >= 0)
+		{
+			state.R[state.OP1] = state.R[state.OP1].insert(KnownValue(), width == 1 ? 0x1 : 0xf, state.J);
+		}
+		else
+		{
+			state.R[state.OP1] = KnownValue();
+		}
+	}
+	if (kind == 1 || kind == 2 || kind == 4 || kind == 5)
+	{
+		if (state.OP2 < 0)
+		{
+			for (size_t i = 0; i < 8; i++)
+			{
+				state.R[i] = KnownValue();
+			}
+		}
+		else
+		{
+			state.R[state.OP2] = state.I >= 0 ? (kind == 1 || kind == 4 ? pointer.add(width) : pointer).rotateLeft(state.I) : KnownValue();
+		}
+	}
+	if (width < 16)
+	{
+		state.J = state.J >= 0 ? (state.J + width) & 0xf : -1;
+	}
+}
+
+void Analyzer::step(uint16_t address, AbstractState state, AnalyzedInstruction& info, vector<pair<uint16_t, AbstractState>>& successors)
+{
+	uint8_t opcode = memory.fetch(address);
+	uint16_t next = address + 7;
+	info.opcode = opcode;
+	state.R[7] = KnownValue(next);
+	if (opcode <= 7)
+	{
+		state.OP1 = opcode;
+	}
+	else if (opcode <= 15)
+	{
+		state.OP2 = opcode - 8;
+	}
+	else if (opcode >= 118 && opcode <= 123)	//bcc bccr bz bzr bn bnr
+	{
+		int8_t taken = -1;
+		if (opcode <= 119)
+		{
+			taken = state.C < 0 ? -1 : !state.C;
+		}
+		else if (state.OP1 >= 0 && opcode <= 121)
+		{
+			KnownValue& value = state.R[state.OP1];
+			taken = value.isConstant() ? value.value == 0 : (value.value & value.known) ? 0 : -1;
+		}
+		else if (state.OP1 >= 0 && state.I >= 0)
+		{
+			KnownValue sign = state.R[state.OP1].rotateRight(state.I);
+			taken = (sign.known & 0x8000) ? (sign.value & 0x8000) != 0 : -1;
+		}
+		if (taken != 0)
+		{
+			AbstractState target = state;
+			KnownValue destination;
+			if (state.OP2 >= 0 && state.I >= 0)
+			{
+				destination = state.R[state.OP2].rotateRight(state.I);
+			}
+			if (opcode & 0x1)	//the r forms leave the return address in the op2 register
+			{
+				if (state.OP2 >= 0)
+				{
+					target.R[state.OP2] = state.I >= 0 ? KnownValue(next).rotateLeft(state.I) : KnownValue();
+				}
+				else
+				{
+					for (size_t i = 0; i < 8; i++)
+					{
+						target.R[i] = KnownValue();
+					}
+				}
+			}
+			if (destination.isConstant())
+			{
+				target.R[7] = destination;
+				successors.push_back(make_pair(destination.value, target));
+			}
+			else
+			{
+				info.unresolvedJump = true;
+			}
+		}
+		if (taken != 1)
+		{
+			successors.push_back(make_pair(next, state));
+		}
+		return;
+	}
+	else if (isa[opcode].effects & accessesMemory)
+	{
+		access(opcode, state, info);
+	}
+	else if (opcode == 105 || opcode == 106)
+	{
+		state.M = opcode == 106;
+	}
+	else if (opcode == 109)	//mtv: the IRQ vector
+	{
+		KnownValue irqVector;
+		if (state.OP1 >= 0 && state.I >= 0)
+		{
+			irqVector = state.R[state.OP1].rotateRight(state.I);
+		}
+		state.V = irqVector;
+		if (irqVector.isConstant())
+		{
+			info.leavesRom |= irqVector.value > Memory::fetchLimit;
+			if (entryPoints.insert(irqVector.value).second && irqVector.value <= Memory::fetchLimit)
+			{
+				AbstractState irq;
+				irq.M = 0;
+				irq.R[7] = irqVector;
+				successors.push_back(make_pair(irqVector.value, irq));
+			}
+		}
+		else
+		{
+			info.unresolvedJump = true;
+		}
+	}
+	else if (!concrete(opcode, state))
+	{
+		clobber(opcode, state);
+	}
+	if (state.R[7] == KnownValue(next))
+	{
+		successors.push_back(make_pair(next, state));
+	}
+	else if (state.R[7].isConstant())
+	{
+		successors.push_back(make_pair(state.R[7].value, state));
+	}
+	else
+	{
+		info.unresolvedJump = true;
+		if (state.OP1 < 0 || state.OP2 < 0)	//an unknown destination register may or may not have been P
+		{
+			state.R[7] = KnownValue(next);
+			successors.push_back(make_pair(next, state));
+		}
+	}
+}
+
+void Analyzer::analyze()
+{
+	code.clear();
+	blocks.clear();
+	states.clear();
+	entryPoints.clear();
+	entryPoints.insert(0);
+	vector<uint16_t> worklist;
+	set<uint16_t> queued;
+	AbstractState entry = resetAtEntry ? AbstractState::reset() : AbstractState();
+	entry.R[7] = KnownValue(0);
+	states[0] = entry;
+	worklist.push_back(0);
+	queued.insert(0);
+	while (!worklist.empty())
+	{
+		uint16_t address = worklist.back();
+		worklist.pop_back();
+		queued.erase(address);
+		AnalyzedInstruction& info = code[address];
+		vector<pair<uint16_t, AbstractState>> successors;
+		step(address, states[address], info, successors);
+		for (auto& j : successors)
+		{
+			if (find(info.successors.begin(), info.successors.end(), j.first) == info.successors.end())
+			{
+				info.successors.push_back(j.first);
+			}
+			if (j.first > Memory::fetchLimit)
+			{
+				info.leavesRom = true;
+				continue;
+			}
+			auto k = states.find(j.first);
+			bool changed = true;
+			if (k == states.end())
+			{
+				states[j.first] = j.second;
+			}
+			else
+			{
+				changed = k->second.meet(j.second);
+			}
+			if (changed && queued.insert(j.first).second)
+			{
+				worklist.push_back(j.first);
+			}
+		}
+	}
+	buildBlocks();
+	buildRegions();
+}
+
+void Analyzer::buildBlocks()	//straight-line runs where every instruction but the first has the previous one as its only predecessor
+{
+	map<uint16_t, size_t> predecessors;
+	for (auto& j : code)
+	{
+		for (uint16_t k : j.second.successors)
+		{
+			predecessors[k]++;
+		}
+	}
+	auto leader = [&](uint16_t address) {
+		return entryPoints.count(address) || predecessors[address] != 1;
+	};
+	set<uint16_t> covered;
+	for (auto& j : code)
+	{
+		uint16_t address = j.first;
+		if (covered.count(address))
+		{
+			continue;
+		}
+		bool head = leader(address);
+		if (!head)	//single predecessor: a block starts here only if that predecessor is not a plain fall-through
+		{
+			head = true;
+			auto previous = code.find(address - 7);
+			if (previous != code.end() && previous->second.successors.size() == 1 && previous->second.successors[0] == address)
+			{
+				head = false;
+			}
+		}
+		if (!head)
+		{
+			continue;
+		}
+		AnalyzedBlock block;
+		block.address = address;
+		block.entry = entryPoints.count(address) != 0;
+		while (true)
+		{
+			AnalyzedInstruction& info = code[address];
+			covered.insert(address);
+			block.instructions++;
+			block.unresolvedJump |= info.unresolvedJump;
+			block.writesRom |= info.writesRom;
+			block.mayWriteRom |= info.mayWriteRom;
+			block.leavesRom |= info.leavesRom;
+			uint16_t next = address + 7;
+			if (info.successors.size() != 1 || info.successors[0] != next || !code.count(next) || leader(next))
+			{
+				block.end = next;
+				block.successors = info.successors;
+				break;
+			}
+			address = next;
+		}
+		blocks[block.address] = block;
+	}
+}
+
+void Analyzer::buildRegions()	//reachable code minus every bit a store may write
+{
+	romWrites.clear();
+	noSmcRegions.clear();
+	vector<bool> written(0x8000), reachable(0x8000);
+	for (auto& j : code)
+	{
+		if (j.second.writesRom || j.second.mayWriteRom)
+		{
+			romWrites.push_back(make_pair(j.second.romWriteFirst, j.second.romWriteLast));
+			for (uint32_t k = j.second.romWriteFirst; k <= j.second.romWriteLast; k++)
+			{
+				written[k] = true;
+			}
+		}
+		for (uint32_t k = j.first; k < j.first + 7u && k <= 0x7fff; k++)
+		{
+			reachable[k] = true;
+		}
+	}
+	for (uint32_t k = 0; k < 0x8000; k++)
+	{
+		if (reachable[k] && !written[k])
+		{
+			if (!noSmcRegions.empty() && noSmcRegions.back().second == k - 1)
+			{
+				noSmcRegions.back().second = (uint16_t)k;
+			}
+			else
+			{
+				noSmcRegions.push_back(make_pair((uint16_t)k, (uint16_t)k));
+			}
+		}
+	}
+}
+
+bool Analyzer::isCode(uint16_t address)
+{
+	return code.count(address) != 0;
+}
+
+void Analyzer::report(wostream& out)
+{
+	auto flags = out.flags();
+	out << hex;
+	out << L"entry points:";
+	for (uint16_t j : entryPoints)
+	{
+		out << L" 0x" << j;
+	}
+	out << endl << L"blocks: " << dec << blocks.size() << L" instructions: " << code.size() << hex << endl;
+	for (auto& j : blocks)
+	{
+		AnalyzedBlock& block = j.second;
+		out << L"0x" << block.address << L"-0x" << block.end << L" " << dec << block.instructions << hex << L" ->";
+		for (uint16_t k : block.successors)
+		{
+			out << L" 0x" << k;
+		}
+		out << (block.entry ? L" entry" : L"") << (block.unresolvedJump ? L" unresolved" : L"") << (block.writesRom ? L" writes-rom" : L"")
+			<< (block.mayWriteRom ? L" may-write-rom" : L"") << (block.leavesRom ? L" leaves-rom" : L"") << endl;
+	}
+	out << L"rom writes:";
+	for (auto& j : romWrites)
+	{
+		out << L" 0x" << j.first << L"-0x" << j.second;
+	}
+	out << endl << L"no-smc regions:";
+	for (auto& j : noSmcRegions)
+	{
+		out << L" 0x" << j.first << L"-0x" << j.second;
+	}
+	out << endl;
+	out.flags(flags);
+}
\ No newline at end of file
@@ -0,0 +1,318 @@
+#pragma once
+#include <stdint.h>
+#include <chrono>
+#include <cwchar>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <Windows.h>
+#include <Psapi.h>
+#else
+#include <sys/resource.h>
+#endif // _WIN32
+
+#include "IncludeCache.h"
+#include "Parser.h"
+#include "Tokenizer.h"
+#include "Trace.h"
+
+using namespace std;
+
+class AssemblerBenchmarkResult	//one scenario, times in milliseconds
+{
+public:
+	wstring scenario;
+	size_t files = 0;
+	size_t lines = 0;	//as written, before macros and repeats expand
+	size_t characters = 0;
+	size_t tokens = 0;
+	size_t bits = 0;
+	double tokenize = 0;	//Tokenizer::tokenize over every file, folding included
+	double fold = 0;	//the lowercase fold alone, run as a separate pass over the same text
+	double parse = 0;	//Parser::parse up to fixup resolution, includes spliced from IncludeCache
+	double fixup = 0;
+	double total = 0;	//the whole Parser::parse call, tick analysis included
+	size_t peakBytes = 0;	//of the process, after the scenario
+};
+
+/*
+	Throughput benchmark for the assembler on generated sources, each scenario a bit over 100k lines at scale 1.
+	mixed is plain code with forward label references, macros a chain of nested macro invocations, defines long dependent define expressions,
+	data big ed tables and includes a wide tree of include files.
+	Files are written to a scratch directory and read back before timing, so disk is not measured.
+	Tokenization runs over every file first, then IncludeCache is warmed and the main file is parsed; the parse and fixup phases come from the parser's Trace spans.
+*/
+class AssemblerBenchmark
+{
+public:
+	wstring directory;
+	size_t scale = 1;
+	AssemblerBenchmark(wstring _directory, size_t _scale);
+	~AssemblerBenchmark();
+	vector<AssemblerBenchmarkResult> run();	//throws what Tokenizer and Parser throw, which would be a bug in a generator
+	static void report(const vector<AssemblerBenchmarkResult>& results, wostream& out);
+	static size_t peakMemory();	//peak working set on Windows, maximum resident set elsewhere
+private:
+	vector<wstring> files;	//of the scenario being generated, the main file first
+	size_t lines = 0;
+	wstring write(wstring name, const wstring& text);	//returns the full path with forward slashes, usable in an include
+	void generateMixed();
+	void generateMacros();
+	void generateDefines();
+	void generateData();
+	void generateIncludes();
+	AssemblerBenchmarkResult measure(wstring scenario);
+};
+
+AssemblerBenchmark::AssemblerBenchmark(wstring _directory, size_t _scale) : directory(_directory), scale(_scale ? _scale : 1)
+{
+}
+
+AssemblerBenchmark::~AssemblerBenchmark()
+{
+}
+
+vector<AssemblerBenchmarkResult> AssemblerBenchmark::run()
+{
+	vector<AssemblerBenchmarkResult> output;
+	filesystem::create_directories(filesystem::path(directory));
+	void (AssemblerBenchmark::*generators[])() = { &AssemblerBenchmark::generateMixed, &AssemblerBenchmark::generateMacros, &AssemblerBenchmark::generateDefines, &AssemblerBenchmark::generateData, &AssemblerBenchmark::generateIncludes };
+	const wchar_t* names[] = { L"mixed", L"macros", L"defines", L"data", L"includes" };
+	for (size_t i = 0; i < size(generators); i++)
+	{
+		files.clear();
+		lines = 0;
+		(this->*generators[i])();
+		output.push_back(measure(names[i]));
+	}
+	error_code ignored;
+	filesystem::remove_all(filesystem::path(directory), ignored);
+	return output;
+}
+
+wstring AssemblerBenchmark::write(wstring name, const wstring& text)
+{
+	wstring filepath = (filesystem::absolute(filesystem::path(directory)) / name).generic_wstring();	//backslashes would be escapes inside an include's quotes
+	basic_ofstream<wchar_t> ofs;
+	ofs.open(filepath, ios_base::out | ios_base::trunc);
+	if (ofs.fail())
+	{
+		throw runtime_error("failed to write benchmark source");
+	}
+	ofs << text;
+	ofs.close();
+	for (wchar_t c : text)
+	{
+		lines += c == L'\n';
+	}
+	return filepath;
+}
+
+void AssemblerBenchmark::generateMixed()	//8 lines per block: a label, register moves, arithmetic and a forward ldi.16
+{
+	wstringstream text;
+	for (size_t i = 0; i < 12800 * scale; i++)
+	{
+		text << L"L" << i << L":\n";
+		text << L"\top1 " << L"abde"[i & 3] << L"\n";
+		text << L"\tldi.16 L" << i + 1 << L"\n";
+		text << L"\top2 " << L"abde"[(i >> 2) & 3] << L" clc adc.16\n";
+		text << L"\tldi.4 (" << i << L" * 3) & 0xf\n";
+		text << L"\tldi.1 " << (i & 1) << L"\n";
+		text << L"\tstri.4 ldri.4\n";
+		text << L"\tnop\n";
+	}
+	text << L"L" << 12800 * scale << L":\n";
+	files.insert(files.begin(), write(L"mixed.asm", text.str()));
+}
+
+void AssemblerBenchmark::generateMacros()	//each invocation expands through 4 levels, every level passing its argument down and using it in an expression
+{
+	const size_t depth = 4;	//shallow, so 100k invocation lines still parse in about a second
+	wstringstream text;
+	text << L"macro M0 (x)\n\top1 a\n\tldi.4 x & 0xf\n\tnop\nendmacro\n";
+	for (size_t i = 1; i < depth; i++)	//an argument is one token followed by a separator
+	{
+		text << L"macro M" << i << L" (x)\n\top2 b\n\tM" << i - 1 << L" (x) ,\n\tldi.4 (x * " << i << L" + " << i << L") & 0xf\nendmacro\n";
+	}
+	for (size_t i = 0; i < 100000 * scale; i++)
+	{
+		text << L"\tM" << depth - 1 << L" (" << (i & 0xff) << L") ,\n";
+	}
+	files.insert(files.begin(), write(L"macros.asm", text.str()));
+}
+
+void AssemblerBenchmark::generateDefines()	//every define reads two earlier ones, every use line three
+{
+	const size_t count = 20000 * scale;
+	wstringstream text;
+	text << L"define D0 1\n";
+	for (size_t i = 1; i < count; i++)
+	{
+		text << L"define D" << i << L" ((D" << i - 1 << L" * 5 + " << i << L") % 65521 ^ (D" << i / 2 << L" << 1)) & 0xffff\n";
+	}
+	for (size_t i = 0; i < 4 * count; i++)
+	{
+		size_t j = (i * 7919) % count;
+		text << L"\tldi.16 (D" << j << L" + D" << j / 3 << L" - D" << j / 7 << L") & 0xffff\n";
+	}
+	files.insert(files.begin(), write(L"defines.asm", text.str()));
+}
+
+void AssemblerBenchmark::generateData()	//tables of 256 rows of eight 16-bit values, each table ending with a label expression
+{
+	wstringstream text;
+	uint32_t value = 1;
+	for (size_t i = 0; i < 400 * scale; i++)
+	{
+		text << L"T" << i << L":\n\ted 16\n";
+		for (size_t j = 0; j < 256; j++)
+		{
+			text << L"\t";
+			for (size_t k = 0; k < 8; k++)
+			{
+				value = value * 1103515245 + 12345;
+				text << L"0x" << hex << ((value >> 8) & 0xffff) << dec << L" ";
+			}
+			text << L"\n";
+		}
+		text << L"\tT" << i << L" >> 4\n\tenddata\n";
+	}
+	files.insert(files.begin(), write(L"data.asm", text.str()));
+}
+
+void AssemblerBenchmark::generateIncludes()	//8 wide and 3 deep, 585 files; the 512 leaves hold the code
+{
+	const size_t fanout = 8, depth = 3;
+	size_t leaf = 0;
+	auto generate = [&](auto& self, wstring name, size_t level) -> wstring {
+		wstringstream text;
+		text << name << L":\n";
+		if (level == depth)
+		{
+			for (size_t i = 0; i < 48 * scale; i++)
+			{
+				text << L"\top1 " << L"abde"[i & 3] << L" ldi.16 " << name << L" + " << i << L"\n\top2 b clc adc.16\n\tldi.4 " << (leaf + i) % 16 << L"\n\tnop\n";
+			}
+			leaf++;
+		}
+		else
+		{
+			for (size_t i = 0; i < fanout; i++)
+			{
+				text << L"include \"" << self(self, name + L"_" + to_wstring(i), level + 1) << L"\"\n";
+			}
+		}
+		wstring filepath = write(name + L".asm", text.str());
+		files.push_back(filepath);
+		return filepath;
+	};
+	generate(generate, L"inc", 0);	//lowercase, the tokenizer folds the quoted path
+	rotate(files.begin(), files.end() - 1, files.end());	//the root was written last
+}
+
+AssemblerBenchmarkResult AssemblerBenchmark::measure(wstring scenario)
+{
+	AssemblerBenchmarkResult output;
+	output.scenario = scenario;
+	output.files = files.size();
+	output.lines = lines;
+	vector<wstring> texts;
+	for (auto& i : files)
+	{
+		basic_ifstream<wchar_t> ifs;
+		ifs.open(i, ios_base::binary | ios_base::in);
+		istreambuf_iterator<wchar_t> ifsbegin(ifs), ifsend;
+		texts.push_back(wstring(ifsbegin, ifsend));
+		output.characters += texts.back().size();
+	}
+	auto start = chrono::steady_clock::now();
+	for (auto& i : texts)
+	{
+		wstring text(i);
+		CharacterScanner scanner(text.data(), text.size());
+		scanner.fold(0, text.size());
+	}
+	output.fold = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	SourceBuffer source;
+	vector<Token> tokens;
+	start = chrono::steady_clock::now();
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		SourceBuffer scratch;
+		vector<Token> fileTokens = Tokenizer::tokenize(i ? scratch : source, texts[i], files[i]);
+		output.tokens += fileTokens.size();
+		if (!i)
+		{
+			tokens = move(fileTokens);
+		}
+	}
+	output.tokenize = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	IncludeCache::shared().clear();
+	for (size_t i = 1; i < files.size(); i++)
+	{
+		IncludeCache::shared().read(files[i]);
+	}
+	Trace trace;
+	{
+		Parser parser(source, move(tokens), files[0]);
+		parser.trace = &trace;
+		start = chrono::steady_clock::now();
+		output.bits = parser.parse().size();
+		output.total = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	}
+	for (auto& i : trace.events)
+	{
+		if (!wcscmp(i.name, L"parse"))
+		{
+			output.parse += i.value / 1000;
+		}
+		else if (!wcscmp(i.name, L"fixup"))
+		{
+			output.fixup += i.value / 1000;
+		}
+	}
+	IncludeCache::shared().clear();
+	output.peakBytes = peakMemory();
+	return output;
+}
+
+void AssemblerBenchmark::report(const vector<AssemblerBenchmarkResult>& results, wostream& out)
+{
+	out << L"scenario\tfiles\tlines\ttokens\tbits\ttokenize ms\tfold ms\tparse ms\tfixup ms\ttotal ms\tMtokens/s\tMbits/s\tklines/s\tpeak MB" << endl;
+	out << fixed << setprecision(2);
+	for (auto& i : results)
+	{
+		double seconds = (i.tokenize + i.total) / 1000;
+		out << i.scenario << L"\t" << i.files << L"\t" << i.lines << L"\t" << i.tokens << L"\t" << i.bits << L"\t"
+			<< i.tokenize << L"\t" << i.fold << L"\t" << i.parse << L"\t" << i.fixup << L"\t" << i.total << L"\t"
+			<< (i.tokenize > 0 ? i.tokens / i.tokenize / 1000 : 0) << L"\t" << (i.total > 0 ? i.bits / i.total / 1000 : 0) << L"\t"
+			<< (seconds > 0 ? i.lines / seconds / 1000 : 0) << L"\t" << i.peakBytes / 1048576.0 << endl;
+	}
+	out.unsetf(ios_base::floatfield);
+}
+
+size_t AssemblerBenchmark::peakMemory()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+	{
+		return 0;
+	}
+	return counters.PeakWorkingSetSize;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+	{
+		return 0;
+	}
+	return (size_t)usage.ru_maxrss * 1024;	//kilobytes on Linux
+#endif // _WIN32
+}
\ No newline at end of file
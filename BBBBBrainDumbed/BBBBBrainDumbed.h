@@ -2,8 +2,14 @@
 #include <stdint.h>
 #include <bit>
 #include <bitset>
+#include <cstring>
 #include <vector>
 #include <stdexcept>
+#include <unordered_map>
+#include <algorithm>
+
+#include "BitBuffer.h"
+#include "Instructions.h"
 
 #ifdef __clang__
 #define rotr _rotr
@@ -16,17 +22,26 @@ using namespace std;
 class Memory
 {
 public:
-	bitset<0x8000> ROM;
+	BitBuffer ROM;	//0x8000 bits, handed over by bakeRom
 	bitset<0x4000> RAM;
 	bitset<0x2000> NVRAM;
 	bitset<0x100> VREG;
 	bitset<0x5> AREG;
 	bitset<0x5> controllerInput0;
 	bitset<0x5> controllerInput1;
+	size_t writeCount = 0;	//bumped on every write so the CPU can tell memory is unchanged
+	size_t romGeneration = 0;	//bumped on every ROM write, decoded blocks older than this are stale
+	static constexpr uint16_t fetchLimit = 0x8000 - 7;	//last ROM address whose whole opcode is in ROM
+	static constexpr uint16_t fusedSpan = 7 * 5;	//bits a superinstruction decision looks at, including one opcode of lookahead
+	uint8_t decoded[0x8000];	//opcode starting at each ROM bit, 0xff until first fetched
+	uint8_t fused[0x8000];	//superinstruction starting at each ROM bit, 0xff until first looked up
 	Memory();
 	~Memory();
-	void bakeRom(vector<bool> input);
+	void bakeRom(BitBuffer&& input);
+	void patchRom(const BitBuffer& image, size_t begin, size_t end);
 	uint16_t mapAddress(uint16_t input);
+	uint8_t fetch(uint16_t address);
+	void invalidate(uint16_t address);
 	bool read(uint16_t address);
 	uint8_t read4(uint16_t address);
 	uint8_t read7(uint16_t address);
@@ -40,24 +55,46 @@ private:
 
 };
 
-Memory::Memory()
+Memory::Memory() : ROM(0x8000)
 {
+	memset(decoded, 0xff, sizeof(decoded));
+	memset(fused, 0xff, sizeof(fused));
 }
 
 Memory::~Memory()
 {
 }
 
-void Memory::bakeRom(vector<bool> input)
+void Memory::bakeRom(BitBuffer&& input)	//takes the assembler's words as they are, the rest of ROM reads 0
 {
 	if (input.size() > 0x8000)
 	{
 		throw out_of_range("Input is too large.");
 	}
-	for (size_t i = 0; i < input.size(); i++)
+	input.resize(0x8000);
+	ROM = move(input);
+	memset(decoded, 0xff, sizeof(decoded));
+	memset(fused, 0xff, sizeof(fused));
+	romGeneration++;
+}
+
+void Memory::patchRom(const BitBuffer& image, size_t begin, size_t end)	//copy bits [begin, end) of an assembled image over the running ROM, a word at a time
+{
+	if (end > 0x8000 || image.size() < end)
 	{
-		ROM[i] = input[i];
+		throw out_of_range("Patch is outside ROM.");
 	}
+	for (size_t i = begin; i < end; i += 64)
+	{
+		size_t width = min<size_t>(64, end - i);
+		ROM.write(i, image.read(i, width), width);
+	}
+	size_t first = begin >= 6 ? begin - 6 : 0;
+	memset(&decoded[first], 0xff, end - first);
+	first = begin >= fusedSpan - 1 ? begin - (fusedSpan - 1) : 0;
+	memset(&fused[first], 0xff, end - first);
+	writeCount++;
+	romGeneration++;
 }
 
 uint16_t Memory::mapAddress(uint16_t input)
@@ -84,6 +121,27 @@ uint16_t Memory::mapAddress(uint16_t input)
 	return output;
 }
 
+uint8_t Memory::fetch(uint16_t address)
+{
+	if (address <= fetchLimit)
+	{
+		if (decoded[address] == 0xff)
+		{
+			decoded[address] = read7(address);
+		}
+		return decoded[address];
+	}
+	return read7(address);
+}
+
+void Memory::invalidate(uint16_t address)	//drop every cached opcode and superinstruction that covers a ROM bit
+{
+	uint16_t begin = address >= 6 ? address - 6 : 0;
+	memset(&decoded[begin], 0xff, address - begin + 1);
+	begin = address >= fusedSpan - 1 ? address - (fusedSpan - 1) : 0;
+	memset(&fused[begin], 0xff, address - begin + 1);
+}
+
 bool Memory::read(uint16_t address)
 {
 	uint16_t i = mapAddress(address);
@@ -141,6 +199,10 @@ uint8_t Memory::read4(uint16_t address)
 
 uint8_t Memory::read7(uint16_t address)
 {
+	if (address <= fetchLimit)	//all of it in ROM
+	{
+		return (uint8_t)ROM.read(address, 7);
+	}
 	uint8_t out = 0;
 	for (uint8_t i = 0; i < 7; i++)
 	{
@@ -161,10 +223,13 @@ uint16_t Memory::read16(uint16_t address)
 
 void Memory::write(uint16_t address, bool value)
 {
+	writeCount++;
 	uint16_t i = mapAddress(address);
 	if (i <= 0x7fff)
 	{
-		ROM[i] = value;
+		ROM.set(i, value);
+		invalidate(i);
+		romGeneration++;
 	}
 	else if (i <= 0xbfff)
 	{
@@ -225,6 +290,52 @@ void Memory::write16(uint16_t address, uint16_t value) {
 	}
 }
 
+/*
+	Architectural state compared by idle-loop detection. T1-T3 and inst are scratch and always written before use, so they are left out.
+*/
+class IdleLoopState
+{
+public:
+	uint16_t A = 0, B = 0, D = 0, E = 0, F = 0, G = 0, K = 0, P = 0, V = 0, H = 0, L = 0;
+	uint16_t *OP1 = nullptr, *OP2 = nullptr;
+	uint8_t I = 0, J = 0;
+	bool C = false, M = false;
+	bool operator==(const IdleLoopState& rhs) const = default;
+};
+
+/*
+	Superinstructions are runs of opcodes the predecoder executes as one step:
+		ldi16	ldi.4 x4 (what the ldi.16 directive emits)
+		select	op1 X op2 Y
+		copy16	op2 X ldri.16 op2 Y stri.16
+	A run is only taken as a whole when no IRQ can be accepted in between and the tick budget covers every constituent,
+	otherwise the opcodes are interpreted one at a time, so ticks and IRQ checks are exactly those of the plain interpreter.
+*/
+enum class Superinstruction : uint8_t
+{
+	none,
+	ldi16,
+	select,
+	copy16,
+};
+
+/*
+	Decoded basic block for the block-chaining interpreter.
+	A block runs from its entry to the first branch, clm/sem or wait, so only its last opcode can change M or have a variable cost.
+	exit[] caches the blocks last seen at the two most recent exit addresses, so a hot loop goes from block to block without a lookup.
+*/
+class Block
+{
+public:
+	static constexpr size_t maxLength = 64;
+	uint16_t address = 0;
+	size_t generation = SIZE_MAX;	//Memory::romGeneration the opcodes were decoded at
+	vector<uint8_t> opcodes;
+	size_t headTicks = 0;	//ticks of every opcode but the last
+	uint16_t exitAddress[2] = {};
+	Block* exit[2] = {};
+};
+
 class BBBBBrainDumbed
 {
 public:
@@ -233,12 +344,40 @@ public:
 	uint16_t *OP1 = &A, *OP2 = &A;
 	uint8_t I = 0, J = 0, inst = 0;
 	bool C = false, M = false, IRQ = false;
+	size_t instructionCount = 0, irqCount = 0;	//running totals for metrics, never reset by the core
+	bool idleLoopSkip = true;
+	size_t idleTicksSkipped = 0;
+	bool superinstructions = true;
+	bool fusionStatistics = false;	//count executed opcode sequences instead of fusing
+	bool blockChaining = false;	//run decoded blocks instead of single opcodes, takes precedence over superinstructions
+	size_t blocksBuilt = 0;
+	unordered_map<uint32_t, uint64_t> sequenceCounts;	//key: length << 28 | opcodes, 7 bits each, oldest first
 	Memory memory;
 	BBBBBrainDumbed();
 	~BBBBBrainDumbed();
+	void reset();
 	size_t execute(size_t count, bool isInit);
+	uint8_t operate();
 	void checkIRQ();
+	IdleLoopState captureIdleState();
+	uint16_t* registerPointer(uint8_t index);
+	Superinstruction fuse(uint16_t address);
+	vector<pair<uint32_t, uint64_t>> fusionCandidates(size_t top);
 private:
+	bool branched = false;
+	uint32_t history = 0;
+	size_t historyLength = 0;
+	uint16_t historyNext = 0;
+	bool runSuperinstruction(Superinstruction s, size_t count, size_t& tick, size_t& inst_count);
+	void countSequence(uint16_t address);
+	unordered_map<uint16_t, Block> blocks;	//element addresses are stable, Block::exit points into here
+	Block* lookupBlock(uint16_t address);
+	void buildBlock(Block& block, uint16_t address);
+	bool runBlocks(size_t count, size_t& tick, size_t& inst_count);
+	IdleLoopState idleState;
+	bool idleValid = false;
+	size_t idleTick = 0, idleInstCount = 0, idleIrqCount = 0, idleWriteCount = 0;
+	size_t skipIdleLoop(size_t count, size_t tick, size_t& inst_count);
 
 };
 
@@ -250,10 +389,30 @@ BBBBBrainDumbed::~BBBBBrainDumbed()
 {
 }
 
+void BBBBBrainDumbed::reset()	//registers, RAM and decoded blocks back to power-on, ROM and NVRAM kept; used when a reassembly moved code
+{
+	T3 = 0;
+	A = B = D = E = F = G = K = P = T1 = T2 = V = H = L = 0;
+	OP1 = OP2 = &A;
+	I = J = inst = 0;
+	C = M = IRQ = false;
+	memory.RAM.reset();
+	memory.VREG.reset();
+	memory.AREG.reset();
+	memory.writeCount++;
+	branched = false;
+	history = 0;
+	historyLength = 0;
+	historyNext = 0;
+	blocks.clear();
+	idleValid = false;
+}
+
 size_t BBBBBrainDumbed::execute(size_t count, bool isInit)
 {
 	size_t tick = 0;
 	size_t inst_count = 0;
+	idleValid = false;	//host may have changed memory or IRQ since the last call
 	if (isInit)
 	{
 		tick++;
@@ -261,976 +420,947 @@ size_t BBBBBrainDumbed::execute(size_t count, bool isInit)
 	}
 	while (count > tick)
 	{
-		inst = memory.read7(P);
-		P += 7;
-		switch (inst)
+		if (fusionStatistics)
 		{
-		case 0:
-			OP1 = &A;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 1:
-			OP1 = &B;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 2:
-			OP1 = &D;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 3:
-			OP1 = &E;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 4:
-			OP1 = &F;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 5:
-			OP1 = &G;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 6:
-			OP1 = &K;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 7:
-			OP1 = &P;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 8:
-			OP2 = &A;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 9:
-			OP2 = &B;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 10:
-			OP2 = &D;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 11:
-			OP2 = &E;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 12:
-			OP2 = &F;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 13:
-			OP2 = &G;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 14:
-			OP2 = &K;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 15:
-			OP2 = &P;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 16:	//mov.1
-			T1 = rotr(*OP1, I);
-			T2 = rotr(*OP2, I);
-			T1 = (T1 & 0xfffe) | (T2 & 0x1);
-			*OP1 = rotl(T1, I);
-			I = (I + 1) & 0xf;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 17:
-			T1 = rotr(*OP1, I);
-			T2 = rotr(*OP2, I);
-			T1 = (T1 & 0xfffe) | (~T2 & 0x1);
-			*OP1 = rotl(T1, I);
-			I = (I + 1) & 0xf;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 18:
-			T1 = rotr(*OP1, I);
-			T2 = rotr(*OP2, I);
-			T1 = T1 | (T2 & 0x1);
-			*OP1 = rotl(T1, I);
-			I = (I + 1) & 0xf;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 19:
-			T1 = rotr(*OP1, I);
-			T2 = rotr(*OP2, I);
-			T1 = T1 & (T2 | 0xfffe);
-			*OP1 = rotl(T1, I);
-			I = (I + 1) & 0xf;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 20:
-			T1 = rotr(*OP1, I);
-			T2 = rotr(*OP2, I);
-			T1 = (T1 & 0xfffe) | ((T1 ^ T2) & 0x1);
-			*OP1 = rotl(T1, I);
-			I = (I + 1) & 0xf;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 21:
-			T1 = rotr(*OP1, I);
-			T2 = rotr(*OP2, I);
-			T1 = T1 << (T2 & 0xf);
-			*OP1 = rotl(T1, I);
-			tick += 32;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 22:
-			T1 = rotr(*OP1, I);
-			T2 = rotr(*OP2, I);
-			T1 = T1 >> (T2 & 0xf);
-			*OP1 = rotl(T1, I);
-			tick += 32;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 23:
-			T1 = rotr(*OP1, I);
-			T2 = rotr(*OP2, I);
-			T1 = (uint16_t)(((int16_t)T1) >> (T2 & 0xf));
-			*OP1 = rotl(T1, I);
-			tick += 32;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 24:
-			T1 = rotr(*OP2, I);
-			*OP1 = rotl(*OP1, T1 & 0xf);
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 25:
-			T1 = rotr(*OP2, I);
-			*OP1 = rotr(*OP1, T1 & 0xf);
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 26:	//adc.1
-			T1 = rotr(*OP1, I);
-			T2 = rotr(*OP2, I);
-			T2 = (T1 & 0x1) + (T2 & 0x1) + C;
-			T1 = (T1 & 0xfffe) | (T2 & 0x1);
-			C = (T2 >> 1) & 0x1;
-			*OP1 = rotl(T1, I);
-			I = (I + 1) & 0xf;
-			tick += 32;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 27:
-			T1 = rotr(*OP1, I);
-			T2 = rotr(*OP2, I);
-			T2 = (T1 & 0x1) - (T2 & 0x1) - C;
-			T1 = (T1 & 0xfffe) | (T2 & 0x1);
-			C = (T2 >> 1) & 0x1;
-			*OP1 = rotl(T1, I);
-			I = (I + 1) & 0xf;
-			tick += 32;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 28:
-			T1 = rotr(*OP2, I);
-			T2 = (T1 & 0xf) + 1;
-			T1 = (T1 & 0xfff0) | (T2 & 0xf);
-			C = (T2 >> 4) & 0x1;
-			*OP1 = rotl(T1, I);
-			I = (I + 1) & 0xf;
-			tick += 31;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 29:
-			T1 = rotr(*OP2, I);
-			T3 = T1 + 1;
-			T1 = T3 & 0xffff;
-			C = (T3 >> 16) & 0x1;
-			*OP1 = rotl(T1, I);
-			I = (I + 1) & 0xf;
-			tick += 34;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 30:
-			T1 = rotr(*OP2, I);
-			T2 = (T1 & 0xf) - 1;
-			T1 = (T1 & 0xfff0) | (T2 & 0xf);
-			C = (T2 >> 4) & 0x1;
-			*OP1 = rotl(T1, I);
-			I = (I + 1) & 0xf;
-			tick += 31;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 31:
-			T1 = rotr(*OP2, I);
-			T3 = T1 - 1;
-			T1 = T3 & 0xffff;
-			C = (T3 >> 16) & 0x1;
-			*OP1 = rotl(T1, I);
-			I = (I + 1) & 0xf;
-			tick += 34;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 32:	//mov.4
-			T1 = rotr(*OP1, I);
-			T2 = rotr(*OP2, I);
-			T1 = (T1 & 0xfff0) | (T2 & 0xf);
-			*OP1 = rotl(T1, I);
-			I = (I + 4) & 0xf;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 33:
-			T1 = rotr(*OP1, I);
-			T2 = rotr(*OP2, I);
-			T1 = (T1 & 0xfff0) | (~T2 & 0xf);
-			*OP1 = rotl(T1, I);
-			I = (I + 4) & 0xf;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 34:
-			T1 = rotr(*OP1, I);
-			T2 = rotr(*OP2, I);
-			T1 = T1 | (T2 & 0xf);
-			*OP1 = rotl(T1, I);
-			I = (I + 4) & 0xf;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 35:
-			T1 = rotr(*OP1, I);
-			T2 = rotr(*OP2, I);
-			T1 = T1 & (T2 | 0xfff0);
-			*OP1 = rotl(T1, I);
-			I = (I + 4) & 0xf;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 36:
-			T1 = rotr(*OP1, I);
-			T2 = rotr(*OP2, I);
-			T1 = (T1 & 0xfff0) | ((T1 ^ T2) & 0xf);
-			*OP1 = rotl(T1, I);
-			I = (I + 4) & 0xf;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 37:
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 38:
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 39:
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 40:
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 41:
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 42:	//adc.4
-			T1 = rotr(*OP1, I);
-			T2 = rotr(*OP2, I);
-			T2 = (T1 & 0xf) + (T2 & 0xf) + C;
-			T1 = (T1 & 0xfff0) | (T2 & 0xf);
-			C = (T2 >> 4) & 0x1;
-			*OP1 = rotl(T1, I);
-			I = (I + 4) & 0xf;
-			tick += 32;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 43:
-			T1 = rotr(*OP1, I);
-			T2 = rotr(*OP2, I);
-			T2 = (T1 & 0xf) - (T2 & 0xf) - C;
-			T1 = (T1 & 0xfff0) | (T2 & 0xf);
-			C = (T2 >> 4) & 0x1;
-			*OP1 = rotl(T1, I);
-			I = (I + 4) & 0xf;
-			tick += 32;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 44:	//mul.4
-			T1 = rotr(*OP1, I);
-			T2 = rotr(*OP2, I);
-			T3 = (uint32_t)((T1 & 0xf) * (T2 & 0xf));
-			H = T3 >> 16;
-			L = T3 & 0xffff;
-			tick += 31;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 45:	//muls.4
-			T1 = (((int8_t)rotr(*OP1, I)) << 4) >> 4;
-			T2 = (((int8_t)rotr(*OP2, I)) << 4) >> 4;
-			T3 = (int32_t)(T1 * T2);
-			H = T3 >> 16;
-			L = T3 & 0xffff;
-			tick += 31;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 46:	//div.4
-			T1 = rotr(*OP1, I);
-			T2 = rotr(*OP2, I);
-			L = (T1 & 0xf) / (T2 & 0xf);
-			H = (T1 & 0xf) % (T2 & 0xf);
-			tick += 31;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 47:	//divs.4
-			T1 = (((int8_t)rotr(*OP1, I)) << 4) >> 4;
-			T2 = (((int8_t)rotr(*OP2, I)) << 4) >> 4;
-			if (T2 == 0)
-			{
-				L = 0;
-				H = 0;
-			}
-			else
+			countSequence(P);
+		}
+		else if (blockChaining)
+		{
+			if (runBlocks(count, tick, inst_count))
 			{
-				L = (int16_t)T1 / (int16_t)T2;
-				H = (int16_t)T1 % (int16_t)T2;
+				continue;
 			}
-			tick += 31;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 48:	//mov.16
-			*OP1 = *OP2;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 49:
-			*OP1 = ~(*OP2);
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 50:
-			*OP1 = (*OP1) | (*OP2);
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 51:
-			*OP1 = (*OP1) & (*OP2);
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 52:
-			*OP1 = (*OP1) ^ (*OP2);
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 53:	//mfh
-			*OP1 = rotl(H, I);
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 54:
-			*OP1 = rotl(L, I);
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 55:
-			*OP1 = 0;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 56:
-			T1 = rotr(*OP2, I);
-			T1 = -T1;
-			*OP1 = rotl(T1, I);
-			tick += 31;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 57:	//nop
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 58:	//adc.16
-			T1 = rotr(*OP1, I);
-			T2 = rotr(*OP2, I);
-			T3 = T1 + T2 + C;
-			T1 = T3 & 0xffff;
-			C = (T3 >> 16) & 0x1;
-			*OP1 = rotl(T1, I);
-			tick += 35;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 59:
-			T1 = rotr(*OP1, I);
-			T2 = rotr(*OP2, I);
-			T3 = T1 - T2 - C;
-			T1 = T3 & 0xffff;
-			C = (T3 >> 16) & 0x1;
-			*OP1 = rotl(T1, I);
-			tick += 35;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 60:
-			T1 = rotr(*OP1, I);
-			T2 = rotr(*OP2, I);
-			T3 = (uint32_t)(T1) * (uint32_t)(T2);
-			H = T3 >> 16;
-			L = T3 & 0xffff;
-			tick += 31;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 61:
-			T1 = (int16_t)rotr(*OP1, I);
-			T2 = (int16_t)rotr(*OP2, I);
-			T3 = (int32_t)(T1) * (int32_t)(T2);
-			H = T3 >> 16;
-			L = T3 & 0xffff;
-			tick += 31;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 62:	//div.16
-			T1 = rotr(*OP1, I);
-			T2 = rotr(*OP2, I);
-			if (T2 == 0)
+		}
+		else if (superinstructions && P <= Memory::fetchLimit - (Memory::fusedSpan - 7))	//whole lookahead comes from the cache
+		{
+			Superinstruction s = fuse(P);
+			if (s != Superinstruction::none && runSuperinstruction(s, count, tick, inst_count))
 			{
-				L = 0;
-				H = 0;
+				continue;
 			}
-			else
+		}
+		inst = memory.fetch(P);
+		P += 7;
+		tick += operate();
+		inst_count++;
+		checkIRQ();
+		if (branched)
+		{
+			branched = false;
+			if (idleLoopSkip)
 			{
-				L = T1 / T2;
-				H = T1 % T2;
+				tick = skipIdleLoop(count, tick, inst_count);
 			}
-			tick += 31;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 63:
-			T1 = (int16_t)rotr(*OP1, I);
-			T2 = (int16_t)rotr(*OP2, I);
+		}
+	}
+	instructionCount += inst_count;
+	return tick - count;
+}
+
+uint8_t BBBBBrainDumbed::operate()
+{
+	switch (inst)
+	{
+	case 0:
+		OP1 = &A;
+		break;
+	case 1:
+		OP1 = &B;
+		break;
+	case 2:
+		OP1 = &D;
+		break;
+	case 3:
+		OP1 = &E;
+		break;
+	case 4:
+		OP1 = &F;
+		break;
+	case 5:
+		OP1 = &G;
+		break;
+	case 6:
+		OP1 = &K;
+		break;
+	case 7:
+		OP1 = &P;
+		break;
+	case 8:
+		OP2 = &A;
+		break;
+	case 9:
+		OP2 = &B;
+		break;
+	case 10:
+		OP2 = &D;
+		break;
+	case 11:
+		OP2 = &E;
+		break;
+	case 12:
+		OP2 = &F;
+		break;
+	case 13:
+		OP2 = &G;
+		break;
+	case 14:
+		OP2 = &K;
+		break;
+	case 15:
+		OP2 = &P;
+		break;
+	case 16:	//mov.1
+		T1 = rotr(*OP1, I);
+		T2 = rotr(*OP2, I);
+		T1 = (T1 & 0xfffe) | (T2 & 0x1);
+		*OP1 = rotl(T1, I);
+		I = (I + 1) & 0xf;
+		break;
+	case 17:
+		T1 = rotr(*OP1, I);
+		T2 = rotr(*OP2, I);
+		T1 = (T1 & 0xfffe) | (~T2 & 0x1);
+		*OP1 = rotl(T1, I);
+		I = (I + 1) & 0xf;
+		break;
+	case 18:
+		T1 = rotr(*OP1, I);
+		T2 = rotr(*OP2, I);
+		T1 = T1 | (T2 & 0x1);
+		*OP1 = rotl(T1, I);
+		I = (I + 1) & 0xf;
+		break;
+	case 19:
+		T1 = rotr(*OP1, I);
+		T2 = rotr(*OP2, I);
+		T1 = T1 & (T2 | 0xfffe);
+		*OP1 = rotl(T1, I);
+		I = (I + 1) & 0xf;
+		break;
+	case 20:
+		T1 = rotr(*OP1, I);
+		T2 = rotr(*OP2, I);
+		T1 = (T1 & 0xfffe) | ((T1 ^ T2) & 0x1);
+		*OP1 = rotl(T1, I);
+		I = (I + 1) & 0xf;
+		break;
+	case 21:
+		T1 = rotr(*OP1, I);
+		T2 = rotr(*OP2, I);
+		T1 = T1 << (T2 & 0xf);
+		*OP1 = rotl(T1, I);
+		break;
+	case 22:
+		T1 = rotr(*OP1, I);
+		T2 = rotr(*OP2, I);
+		T1 = T1 >> (T2 & 0xf);
+		*OP1 = rotl(T1, I);
+		break;
+	case 23:
+		T1 = rotr(*OP1, I);
+		T2 = rotr(*OP2, I);
+		T1 = (uint16_t)(((int16_t)T1) >> (T2 & 0xf));
+		*OP1 = rotl(T1, I);
+		break;
+	case 24:
+		T1 = rotr(*OP2, I);
+		*OP1 = rotl(*OP1, T1 & 0xf);
+		break;
+	case 25:
+		T1 = rotr(*OP2, I);
+		*OP1 = rotr(*OP1, T1 & 0xf);
+		break;
+	case 26:	//adc.1
+		T1 = rotr(*OP1, I);
+		T2 = rotr(*OP2, I);
+		T2 = (T1 & 0x1) + (T2 & 0x1) + C;
+		T1 = (T1 & 0xfffe) | (T2 & 0x1);
+		C = (T2 >> 1) & 0x1;
+		*OP1 = rotl(T1, I);
+		I = (I + 1) & 0xf;
+		break;
+	case 27:
+		T1 = rotr(*OP1, I);
+		T2 = rotr(*OP2, I);
+		T2 = (T1 & 0x1) - (T2 & 0x1) - C;
+		T1 = (T1 & 0xfffe) | (T2 & 0x1);
+		C = (T2 >> 1) & 0x1;
+		*OP1 = rotl(T1, I);
+		I = (I + 1) & 0xf;
+		break;
+	case 28:
+		T1 = rotr(*OP2, I);
+		T2 = (T1 & 0xf) + 1;
+		T1 = (T1 & 0xfff0) | (T2 & 0xf);
+		C = (T2 >> 4) & 0x1;
+		*OP1 = rotl(T1, I);
+		I = (I + 1) & 0xf;
+		break;
+	case 29:
+		T1 = rotr(*OP2, I);
+		T3 = T1 + 1;
+		T1 = T3 & 0xffff;
+		C = (T3 >> 16) & 0x1;
+		*OP1 = rotl(T1, I);
+		I = (I + 1) & 0xf;
+		break;
+	case 30:
+		T1 = rotr(*OP2, I);
+		T2 = (T1 & 0xf) - 1;
+		T1 = (T1 & 0xfff0) | (T2 & 0xf);
+		C = (T2 >> 4) & 0x1;
+		*OP1 = rotl(T1, I);
+		I = (I + 1) & 0xf;
+		break;
+	case 31:
+		T1 = rotr(*OP2, I);
+		T3 = T1 - 1;
+		T1 = T3 & 0xffff;
+		C = (T3 >> 16) & 0x1;
+		*OP1 = rotl(T1, I);
+		I = (I + 1) & 0xf;
+		break;
+	case 32:	//mov.4
+		T1 = rotr(*OP1, I);
+		T2 = rotr(*OP2, I);
+		T1 = (T1 & 0xfff0) | (T2 & 0xf);
+		*OP1 = rotl(T1, I);
+		I = (I + 4) & 0xf;
+		break;
+	case 33:
+		T1 = rotr(*OP1, I);
+		T2 = rotr(*OP2, I);
+		T1 = (T1 & 0xfff0) | (~T2 & 0xf);
+		*OP1 = rotl(T1, I);
+		I = (I + 4) & 0xf;
+		break;
+	case 34:
+		T1 = rotr(*OP1, I);
+		T2 = rotr(*OP2, I);
+		T1 = T1 | (T2 & 0xf);
+		*OP1 = rotl(T1, I);
+		I = (I + 4) & 0xf;
+		break;
+	case 35:
+		T1 = rotr(*OP1, I);
+		T2 = rotr(*OP2, I);
+		T1 = T1 & (T2 | 0xfff0);
+		*OP1 = rotl(T1, I);
+		I = (I + 4) & 0xf;
+		break;
+	case 36:
+		T1 = rotr(*OP1, I);
+		T2 = rotr(*OP2, I);
+		T1 = (T1 & 0xfff0) | ((T1 ^ T2) & 0xf);
+		*OP1 = rotl(T1, I);
+		I = (I + 4) & 0xf;
+		break;
+	case 37:
+		break;
+	case 38:
+		break;
+	case 39:
+		break;
+	case 40:
+		break;
+	case 41:
+		break;
+	case 42:	//adc.4
+		T1 = rotr(*OP1, I);
+		T2 = rotr(*OP2, I);
+		T2 = (T1 & 0xf) + (T2 & 0xf) + C;
+		T1 = (T1 & 0xfff0) | (T2 & 0xf);
+		C = (T2 >> 4) & 0x1;
+		*OP1 = rotl(T1, I);
+		I = (I + 4) & 0xf;
+		break;
+	case 43:
+		T1 = rotr(*OP1, I);
+		T2 = rotr(*OP2, I);
+		T2 = (T1 & 0xf) - (T2 & 0xf) - C;
+		T1 = (T1 & 0xfff0) | (T2 & 0xf);
+		C = (T2 >> 4) & 0x1;
+		*OP1 = rotl(T1, I);
+		I = (I + 4) & 0xf;
+		break;
+	case 44:	//mul.4
+		T1 = rotr(*OP1, I);
+		T2 = rotr(*OP2, I);
+		T3 = (uint32_t)((T1 & 0xf) * (T2 & 0xf));
+		H = T3 >> 16;
+		L = T3 & 0xffff;
+		break;
+	case 45:	//muls.4
+		T1 = (((int8_t)rotr(*OP1, I)) << 4) >> 4;
+		T2 = (((int8_t)rotr(*OP2, I)) << 4) >> 4;
+		T3 = (int32_t)(T1 * T2);
+		H = T3 >> 16;
+		L = T3 & 0xffff;
+		break;
+	case 46:	//div.4
+		T1 = rotr(*OP1, I);
+		T2 = rotr(*OP2, I);
+		L = (T1 & 0xf) / (T2 & 0xf);
+		H = (T1 & 0xf) % (T2 & 0xf);
+		break;
+	case 47:	//divs.4
+		T1 = (((int8_t)rotr(*OP1, I)) << 4) >> 4;
+		T2 = (((int8_t)rotr(*OP2, I)) << 4) >> 4;
+		if (T2 == 0)
+		{
+			L = 0;
+			H = 0;
+		}
+		else
+		{
+			L = (int16_t)T1 / (int16_t)T2;
+			H = (int16_t)T1 % (int16_t)T2;
+		}
+		break;
+	case 48:	//mov.16
+		*OP1 = *OP2;
+		break;
+	case 49:
+		*OP1 = ~(*OP2);
+		break;
+	case 50:
+		*OP1 = (*OP1) | (*OP2);
+		break;
+	case 51:
+		*OP1 = (*OP1) & (*OP2);
+		break;
+	case 52:
+		*OP1 = (*OP1) ^ (*OP2);
+		break;
+	case 53:	//mfh
+		*OP1 = rotl(H, I);
+		break;
+	case 54:
+		*OP1 = rotl(L, I);
+		break;
+	case 55:
+		*OP1 = 0;
+		break;
+	case 56:
+		T1 = rotr(*OP2, I);
+		T1 = -T1;
+		*OP1 = rotl(T1, I);
+		break;
+	case 57:	//nop
+		break;
+	case 58:	//adc.16
+		T1 = rotr(*OP1, I);
+		T2 = rotr(*OP2, I);
+		T3 = T1 + T2 + C;
+		T1 = T3 & 0xffff;
+		C = (T3 >> 16) & 0x1;
+		*OP1 = rotl(T1, I);
+		break;
+	case 59:
+		T1 = rotr(*OP1, I);
+		T2 = rotr(*OP2, I);
+		T3 = T1 - T2 - C;
+		T1 = T3 & 0xffff;
+		C = (T3 >> 16) & 0x1;
+		*OP1 = rotl(T1, I);
+		break;
+	case 60:
+		T1 = rotr(*OP1, I);
+		T2 = rotr(*OP2, I);
+		T3 = (uint32_t)(T1) * (uint32_t)(T2);
+		H = T3 >> 16;
+		L = T3 & 0xffff;
+		break;
+	case 61:
+		T1 = (int16_t)rotr(*OP1, I);
+		T2 = (int16_t)rotr(*OP2, I);
+		T3 = (int32_t)(T1) * (int32_t)(T2);
+		H = T3 >> 16;
+		L = T3 & 0xffff;
+		break;
+	case 62:	//div.16
+		T1 = rotr(*OP1, I);
+		T2 = rotr(*OP2, I);
+		if (T2 == 0)
+		{
+			L = 0;
+			H = 0;
+		}
+		else
+		{
 			L = T1 / T2;
 			H = T1 % T2;
-			tick += 31;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 64:	//ldi.4 0
-		case 65:
-		case 66:
-		case 67:
-		case 68:
-		case 69:
-		case 70:
-		case 71:
-		case 72:
-		case 73:
-		case 74:
-		case 75:
-		case 76:
-		case 77:
-		case 78:
-		case 79:	//ldi.4 15
-			T1 = rotr(*OP1, I);
-			T1 = (T1 & 0xfff0) | (inst & 0xf);
-			*OP1 = rotl(T1, I);
-			I = (I + 4) & 0xf;
-			tick += 31;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 80:	//ldr.1
-			T1 = rotr(*OP1, J);
-			T2 = rotr(*OP2, I);
-			T1 = (T1 & 0xfffe) | (memory.read(T2) & 0x1);
-			*OP1 = rotl(T1, J);
-			J = (J+ 1) & 0xf;
-			tick += 31;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 81:
-			T1 = rotr(*OP1, J);
-			T2 = rotr(*OP2, I);
-			T1 = (T1 & 0xfffe) | (memory.read(T2) & 0x1);
-			T2++;
-			*OP1 = rotl(T1, J);
-			*OP2 = rotl(T2, I);
-			J = (J+ 1) & 0xf;
-			tick += 35;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 82:
-			T1 = rotr(*OP1, J);
-			T2 = rotr(*OP2, I);
-			T2--;
-			T1 = (T1 & 0xfffe) | (memory.read(T2) & 0x1);
-			*OP1 = rotl(T1, J);
-			*OP2 = rotl(T2, I);
-			J = (J+ 1) & 0xf;
-			tick += 35;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 83:	//str.1
-			T1 = rotr(*OP1, J);
-			T2 = rotr(*OP2, I);
-			memory.write(T2, T1 & 0x1);
-			J = (J+ 1) & 0xf;
-			tick += 31;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 84:
-			T1 = rotr(*OP1, J);
-			T2 = rotr(*OP2, I);
-			memory.write(T2, T1 & 0x1);
-			T2++;
-			*OP2 = rotl(T2, I);
-			J = (J+ 1) & 0xf;
-			tick += 35;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 85:
-			T1 = rotr(*OP1, J);
-			T2 = rotr(*OP2, I);
-			T2--;
-			memory.write(T2, T1 & 0x1);
-			*OP2 = rotl(T2, I);
-			J = (J+ 1) & 0xf;
-			tick += 35;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 86:	//cli
-			I = 0;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 87:
-			I = (I + 1) & 0xf;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 88:
-			I = (I + 4) & 0xf;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 89:
-			*OP1 = I & 0xf;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 90:
-			I = *OP2 & 0xf;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 91:
-			J = 0;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 92:
-			J = (J + 1) & 0xf;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 93:
-			J = (J + 4) & 0xf;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 94:
-			T1 = J & 0xf;
-			*OP1 = rotl(T1, I);
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 95:
-			J = rotr(*OP2, I) & 0xf;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 96:	//ldr.4
-			T1 = rotr(*OP1, J);
-			T2 = rotr(*OP2, I);
-			T1 = (T1 & 0xfff0) | memory.read4(T2);
-			*OP1 = rotl(T1, J);
-			J = (J + 4) & 0xf;
-			tick += 46;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 97:
-			T1 = rotr(*OP1, J);
-			T2 = rotr(*OP2, I);
-			T1 = (T1 & 0xfff0) | memory.read4(T2);
-			T2 += 4;
-			*OP1 = rotl(T1, J);
-			*OP2 = rotl(T2, I);
-			J = (J + 4) & 0xf;
-			tick += 49;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 98:
-			T1 = rotr(*OP1, J);
-			T2 = rotr(*OP2, I);
-			T2 -= 4;;
-			T1 = (T1 & 0xfff0) | memory.read4(T2);
-			*OP1 = rotl(T1, J);
-			*OP2 = rotl(T2, I);
-			J = (J + 4) & 0xf;
-			tick += 50;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 99:	//str.4
-			T1 = rotr(*OP1, J);
-			T2 = rotr(*OP2, I);
-			memory.write4(T2, T1 & 0xf);
-			J = (J + 4) & 0xf;
-			tick += 46;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 100:
-			T1 = rotr(*OP1, J);
-			T2 = rotr(*OP2, I);
-			memory.write4(T2, T1 & 0xf);
-			T2 += 4;
-			*OP2 = rotl(T2, I);
-			J = (J + 4) & 0xf;
-			tick += 49;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 101:
-			T1 = rotr(*OP1, J);
-			T2 = rotr(*OP2, I);
-			T2 -= 4;
-			memory.write4(T2, T1 & 0xf);
-			*OP2 = rotl(T2, I);
-			J = (J + 4) & 0xf;
-			tick += 50;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 102:	//clc
-			C = false;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 103:
-			C = true;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 104:
-			T1 = rotr(*OP1, I);
-			T1 = (T1 & 0xfffe) | (C & 0x1);
-			*OP1 = rotl(T1, I);
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 105:
-			M = false;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 106:
-			M = true;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 107:
-			T1 = rotr(*OP1, I);
-			T1 = (T1 & 0xfffe) | (M & 0x1);
-			*OP1 = rotl(T1, I);
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 108:
-			*OP1 = rotl(V, I);
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 109:
-			V = rotr(*OP1, I);
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 110:
-			T1 = *OP1;
-			T1 = ((T1 & 0x5555) << 1) | ((T1 & 0xAAAA) >> 1);
-			T1 = ((T1 & 0x3333) << 2) | ((T1 & 0xCCCC) >> 2);
-			T1 = ((T1 & 0x0F0F) << 4) | ((T1 & 0xF0F0) >> 4);
-			T1 = ((T1 & 0x00FF) << 8) | ((T1 & 0xFF00) >> 8);
-			*OP1 = T1;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 111:
-			T1 = *OP1;
-			*OP1 = *OP2;
-			*OP2 = T1;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 112:	//ldr.16
-			T2 = rotr(*OP2, I);
-			T1 = memory.read16(T2);
-			*OP1 = rotl(T1, J);
-			tick += 106;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 113:
-			T2 = rotr(*OP2, I);
-			T1 = memory.read16(T2);
-			T2 += 16;
-			*OP1 = rotl(T1, J);
-			*OP2 = rotl(T2, I);
-			tick += 109;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 114:
-			T2 = rotr(*OP2, I);
-			T2 -= 16;
-			T1 = memory.read16(T2);
-			*OP1 = rotl(T1, J);
-			*OP2 = rotl(T2, I);
-			tick += 110;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 115:
-			T1 = rotr(*OP1, J);
-			T2 = rotr(*OP2, I);
-			memory.write16(T2, T1);
-			tick += 106;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 116:
-			T1 = rotr(*OP1, J);
-			T2 = rotr(*OP2, I);
-			memory.write16(T2, T1);
-			T2 += 16;
-			*OP2 = rotl(T2, I);
-			tick += 109;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 117:
-			T1 = rotr(*OP1, J);
-			T2 = rotr(*OP2, I);
-			T2 -= 16;
-			memory.write16(T2, T1);
-			*OP2 = rotl(T2, I);
-			tick += 110;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 118:	//bcc
-			if (C == false)
-			{
-				P = rotr(*OP2, I);
-			}
-			tick += 29;
-			inst_count++;
-			checkIRQ();
+		}
+		break;
+	case 63:
+		T1 = (int16_t)rotr(*OP1, I);
+		T2 = (int16_t)rotr(*OP2, I);
+		L = T1 / T2;
+		H = T1 % T2;
+		break;
+	case 64:	//ldi.4 0
+	case 65:
+	case 66:
+	case 67:
+	case 68:
+	case 69:
+	case 70:
+	case 71:
+	case 72:
+	case 73:
+	case 74:
+	case 75:
+	case 76:
+	case 77:
+	case 78:
+	case 79:	//ldi.4 15
+		T1 = rotr(*OP1, I);
+		T1 = (T1 & 0xfff0) | (inst & 0xf);
+		*OP1 = rotl(T1, I);
+		I = (I + 4) & 0xf;
+		break;
+	case 80:	//ldr.1
+		T1 = rotr(*OP1, J);
+		T2 = rotr(*OP2, I);
+		T1 = (T1 & 0xfffe) | (memory.read(T2) & 0x1);
+		*OP1 = rotl(T1, J);
+		J = (J+ 1) & 0xf;
+		break;
+	case 81:
+		T1 = rotr(*OP1, J);
+		T2 = rotr(*OP2, I);
+		T1 = (T1 & 0xfffe) | (memory.read(T2) & 0x1);
+		T2++;
+		*OP1 = rotl(T1, J);
+		*OP2 = rotl(T2, I);
+		J = (J+ 1) & 0xf;
+		break;
+	case 82:
+		T1 = rotr(*OP1, J);
+		T2 = rotr(*OP2, I);
+		T2--;
+		T1 = (T1 & 0xfffe) | (memory.read(T2) & 0x1);
+		*OP1 = rotl(T1, J);
+		*OP2 = rotl(T2, I);
+		J = (J+ 1) & 0xf;
+		break;
+	case 83:	//str.1
+		T1 = rotr(*OP1, J);
+		T2 = rotr(*OP2, I);
+		memory.write(T2, T1 & 0x1);
+		J = (J+ 1) & 0xf;
+		break;
+	case 84:
+		T1 = rotr(*OP1, J);
+		T2 = rotr(*OP2, I);
+		memory.write(T2, T1 & 0x1);
+		T2++;
+		*OP2 = rotl(T2, I);
+		J = (J+ 1) & 0xf;
+		break;
+	case 85:
+		T1 = rotr(*OP1, J);
+		T2 = rotr(*OP2, I);
+		T2--;
+		memory.write(T2, T1 & 0x1);
+		*OP2 = rotl(T2, I);
+		J = (J+ 1) & 0xf;
+		break;
+	case 86:	//cli
+		I = 0;
+		break;
+	case 87:
+		I = (I + 1) & 0xf;
+		break;
+	case 88:
+		I = (I + 4) & 0xf;
+		break;
+	case 89:
+		*OP1 = I & 0xf;
+		break;
+	case 90:
+		I = *OP2 & 0xf;
+		break;
+	case 91:
+		J = 0;
+		break;
+	case 92:
+		J = (J + 1) & 0xf;
+		break;
+	case 93:
+		J = (J + 4) & 0xf;
+		break;
+	case 94:
+		T1 = J & 0xf;
+		*OP1 = rotl(T1, I);
+		break;
+	case 95:
+		J = rotr(*OP2, I) & 0xf;
+		break;
+	case 96:	//ldr.4
+		T1 = rotr(*OP1, J);
+		T2 = rotr(*OP2, I);
+		T1 = (T1 & 0xfff0) | memory.read4(T2);
+		*OP1 = rotl(T1, J);
+		J = (J + 4) & 0xf;
+		break;
+	case 97:
+		T1 = rotr(*OP1, J);
+		T2 = rotr(*OP2, I);
+		T1 = (T1 & 0xfff0) | memory.read4(T2);
+		T2 += 4;
+		*OP1 = rotl(T1, J);
+		*OP2 = rotl(T2, I);
+		J = (J + 4) & 0xf;
+		break;
+	case 98:
+		T1 = rotr(*OP1, J);
+		T2 = rotr(*OP2, I);
+		T2 -= 4;;
+		T1 = (T1 & 0xfff0) | memory.read4(T2);
+		*OP1 = rotl(T1, J);
+		*OP2 = rotl(T2, I);
+		J = (J + 4) & 0xf;
+		break;
+	case 99:	//str.4
+		T1 = rotr(*OP1, J);
+		T2 = rotr(*OP2, I);
+		memory.write4(T2, T1 & 0xf);
+		J = (J + 4) & 0xf;
+		break;
+	case 100:
+		T1 = rotr(*OP1, J);
+		T2 = rotr(*OP2, I);
+		memory.write4(T2, T1 & 0xf);
+		T2 += 4;
+		*OP2 = rotl(T2, I);
+		J = (J + 4) & 0xf;
+		break;
+	case 101:
+		T1 = rotr(*OP1, J);
+		T2 = rotr(*OP2, I);
+		T2 -= 4;
+		memory.write4(T2, T1 & 0xf);
+		*OP2 = rotl(T2, I);
+		J = (J + 4) & 0xf;
+		break;
+	case 102:	//clc
+		C = false;
+		break;
+	case 103:
+		C = true;
+		break;
+	case 104:
+		T1 = rotr(*OP1, I);
+		T1 = (T1 & 0xfffe) | (C & 0x1);
+		*OP1 = rotl(T1, I);
+		break;
+	case 105:
+		M = false;
+		break;
+	case 106:
+		M = true;
+		break;
+	case 107:
+		T1 = rotr(*OP1, I);
+		T1 = (T1 & 0xfffe) | (M & 0x1);
+		*OP1 = rotl(T1, I);
+		break;
+	case 108:
+		*OP1 = rotl(V, I);
+		break;
+	case 109:
+		V = rotr(*OP1, I);
+		break;
+	case 110:
+		T1 = *OP1;
+		T1 = ((T1 & 0x5555) << 1) | ((T1 & 0xAAAA) >> 1);
+		T1 = ((T1 & 0x3333) << 2) | ((T1 & 0xCCCC) >> 2);
+		T1 = ((T1 & 0x0F0F) << 4) | ((T1 & 0xF0F0) >> 4);
+		T1 = ((T1 & 0x00FF) << 8) | ((T1 & 0xFF00) >> 8);
+		*OP1 = T1;
+		break;
+	case 111:
+		T1 = *OP1;
+		*OP1 = *OP2;
+		*OP2 = T1;
+		break;
+	case 112:	//ldr.16
+		T2 = rotr(*OP2, I);
+		T1 = memory.read16(T2);
+		*OP1 = rotl(T1, J);
+		break;
+	case 113:
+		T2 = rotr(*OP2, I);
+		T1 = memory.read16(T2);
+		T2 += 16;
+		*OP1 = rotl(T1, J);
+		*OP2 = rotl(T2, I);
+		break;
+	case 114:
+		T2 = rotr(*OP2, I);
+		T2 -= 16;
+		T1 = memory.read16(T2);
+		*OP1 = rotl(T1, J);
+		*OP2 = rotl(T2, I);
+		break;
+	case 115:
+		T1 = rotr(*OP1, J);
+		T2 = rotr(*OP2, I);
+		memory.write16(T2, T1);
+		break;
+	case 116:
+		T1 = rotr(*OP1, J);
+		T2 = rotr(*OP2, I);
+		memory.write16(T2, T1);
+		T2 += 16;
+		*OP2 = rotl(T2, I);
+		break;
+	case 117:
+		T1 = rotr(*OP1, J);
+		T2 = rotr(*OP2, I);
+		T2 -= 16;
+		memory.write16(T2, T1);
+		*OP2 = rotl(T2, I);
+		break;
+	case 118:	//bcc
+		if (C == false)
+		{
+			P = rotr(*OP2, I);
+			branched = true;
+		}
+		break;
+	case 119:
+		if (C == false)
+		{
+			T1 = rotr(*OP2, I);
+			*OP2 = rotl(P, I);
+			P = T1;
+			branched = true;
+		}
+		break;
+	case 120:
+		if (*OP1 == 0)
+		{
+			P = rotr(*OP2, I);
+			branched = true;
+		}
+		break;
+	case 121:
+		if (*OP1 == 0)
+		{
+			T1 = rotr(*OP2, I);
+			*OP2 = rotl(P, I);
+			P = T1;
+			branched = true;
+		}
+		break;
+	case 122:	//bn
+		if ((rotr(*OP1, I) & 0x8000) != 0)
+		{
+			P = rotr(*OP2, I);
+			branched = true;
+		}
+		break;
+	case 123:
+		if ((rotr(*OP1, I) & 0x8000) != 0)
+		{
+			T1 = rotr(*OP2, I);
+			*OP2 = rotl(P, I);
+			P = T1;
+			branched = true;
+		}
+		break;
+	case 124:	//wait.4
+		T1 = rotr(*OP1, I) & 0xf;
+		return isa[inst].ticks + T1;
+	case 125:	//wait.4e
+		T1 = rotr(*OP1, I) & 0xf;
+		return isa[inst].ticks + T1;
+	case 126:
+	case 127:
+		T1 = rotr(*OP1, I);
+		T1 = (T1 & 0xfffe) | (inst & 0x1);
+		*OP1 = rotl(T1, I);
+		I = (I + 1) & 0xf;
+		break;
+	default:
+		break;
+	}
+	return isa[inst].ticks;
+}
+
+void BBBBBrainDumbed::checkIRQ()
+{
+	if (!M && IRQ)
+	{
+		irqCount++;
+		T1 = P;
+		P = V;
+		V = T1;
+	}
+}
+
+IdleLoopState BBBBBrainDumbed::captureIdleState()
+{
+	IdleLoopState output;
+	output.A = A;
+	output.B = B;
+	output.D = D;
+	output.E = E;
+	output.F = F;
+	output.G = G;
+	output.K = K;
+	output.P = P;
+	output.V = V;
+	output.H = H;
+	output.L = L;
+	output.OP1 = OP1;
+	output.OP2 = OP2;
+	output.I = I;
+	output.J = J;
+	output.C = C;
+	output.M = M;
+	return output;
+}
+
+/*
+	Called after every taken branch. If the whole state and memory are unchanged since the previous taken branch, the code in between is a loop
+	that will repeat identically until the end of this slice (nothing outside the CPU changes within execute), so whole iterations are skipped.
+	At most (count - tick - 1) ticks are skipped, which leaves tick below count exactly as interpreting the iterations would.
+*/
+size_t BBBBBrainDumbed::skipIdleLoop(size_t count, size_t tick, size_t& inst_count)
+{
+	IdleLoopState state = captureIdleState();
+	if (idleValid && memory.writeCount == idleWriteCount && state == idleState)
+	{
+		size_t period = tick - idleTick;
+		if (period > 0 && count > tick)
+		{
+			size_t iterations = (count - tick - 1) / period;
+			tick += iterations * period;
+			inst_count += iterations * (inst_count - idleInstCount);
+			irqCount += iterations * (irqCount - idleIrqCount);
+			idleTicksSkipped += iterations * period;
+		}
+	}
+	idleValid = true;
+	idleState = state;
+	idleTick = tick;
+	idleInstCount = inst_count;
+	idleIrqCount = irqCount;
+	idleWriteCount = memory.writeCount;
+	return tick;
+}
+
+uint16_t* BBBBBrainDumbed::registerPointer(uint8_t index)	//register selected by op1/op2 opcodes
+{
+	uint16_t* registers[] = { &A, &B, &D, &E, &F, &G, &K, &P };
+	return registers[index & 0x7];
+}
+
+Superinstruction BBBBBrainDumbed::fuse(uint16_t address)
+{
+	if (memory.fused[address] != 0xff)
+	{
+		return (Superinstruction)memory.fused[address];
+	}
+	uint8_t op[4];
+	for (size_t k = 0; k < 4; k++)
+	{
+		op[k] = memory.fetch(address + 7 * k);
+	}
+	Superinstruction output = Superinstruction::none;
+	if (op[0] >= 64 && op[0] <= 79 && op[1] >= 64 && op[1] <= 79 && op[2] >= 64 && op[2] <= 79 && op[3] >= 64 && op[3] <= 79)
+	{
+		output = Superinstruction::ldi16;
+	}
+	else if (op[0] >= 8 && op[0] <= 15 && op[1] == 113 && op[2] >= 8 && op[2] <= 15 && op[3] == 116)
+	{
+		output = Superinstruction::copy16;
+	}
+	else if (op[0] <= 7 && op[1] >= 8 && op[1] <= 15 && !(op[2] == 113 && memory.fetch(address + 7 * 4) >= 8 && memory.fetch(address + 7 * 4) <= 15))	//leave op2 to a following copy16
+	{
+		output = Superinstruction::select;
+	}
+	memory.fused[address] = (uint8_t)output;
+	return output;
+}
+
+bool BBBBBrainDumbed::runSuperinstruction(Superinstruction s, size_t count, size_t& tick, size_t& inst_count)
+{
+	if (!M && IRQ)	//would be taken right after the first constituent
+	{
+		return false;
+	}
+	uint8_t op0 = memory.decoded[P], op1 = memory.decoded[P + 7], op2 = memory.decoded[P + 14], op3 = memory.decoded[P + 21];
+	switch (s)
+	{
+	case Superinstruction::ldi16:
+		if (OP1 == &P || tick + isa[op0].ticks * 3 >= count)
+		{
+			return false;
+		}
+		T1 = (op0 & 0xf) | ((op1 & 0xf) << 4) | ((op2 & 0xf) << 8) | ((op3 & 0xf) << 12);
+		*OP1 = rotl(T1, I);	//four nibble loads at I, I+4, I+8, I+12 replace the whole register and leave I where it was
+		T1 = rotr(*OP1, (I + 12) & 0xf);
+		inst = op3;
+		P += 28;
+		tick += isa[op0].ticks * 4;
+		inst_count += 4;
+		return true;
+	case Superinstruction::select:
+		if (tick + isa[op0].ticks >= count)
+		{
+			return false;
+		}
+		OP1 = registerPointer(op0);
+		OP2 = registerPointer(op1);
+		inst = op1;
+		P += 14;
+		tick += isa[op0].ticks + isa[op1].ticks;
+		inst_count += 2;
+		return true;
+	case Superinstruction::copy16:
+		if (OP1 == &P || (op0 & 0x7) == 7 || (op2 & 0x7) == 7 || tick + isa[op0].ticks + isa[op1].ticks + isa[op2].ticks >= count)
+		{
+			return false;
+		}
+		OP2 = registerPointer(op0);
+		inst = op1;
+		tick += isa[op0].ticks + operate();
+		OP2 = registerPointer(op2);
+		inst = op3;
+		tick += isa[op2].ticks + operate();
+		P += 28;
+		inst_count += 4;
+		return true;
+	default:
+		return false;
+	}
+}
+
+void BBBBBrainDumbed::countSequence(uint16_t address)
+{
+	if (address != historyNext)	//sequences do not span taken branches or IRQs
+	{
+		historyLength = 0;
+	}
+	uint32_t window = (history << 7) | memory.fetch(address);
+	historyLength = min(historyLength + 1, (size_t)4);
+	historyNext = address + 7;
+	for (size_t n = 2; n <= historyLength; n++)
+	{
+		sequenceCounts[((uint32_t)n << 28) | (window & ((1u << (7 * n)) - 1))]++;
+	}
+	history = window & 0x1fffff;	//last three opcodes
+}
+
+vector<pair<uint32_t, uint64_t>> BBBBBrainDumbed::fusionCandidates(size_t top)	//sequences ranked by dispatches a fused version would save
+{
+	vector<pair<uint32_t, uint64_t>> output(sequenceCounts.begin(), sequenceCounts.end());
+	auto saved = [](const pair<uint32_t, uint64_t>& a) { return a.second * ((a.first >> 28) - 1); };
+	sort(output.begin(), output.end(), [&](const pair<uint32_t, uint64_t>& a, const pair<uint32_t, uint64_t>& b) { return saved(a) > saved(b); });
+	if (output.size() > top)
+	{
+		output.resize(top);
+	}
+	return output;
+}
+
+Block* BBBBBrainDumbed::lookupBlock(uint16_t address)
+{
+	if (address > Memory::fetchLimit)
+	{
+		return nullptr;
+	}
+	Block& block = blocks[address];
+	if (block.generation != memory.romGeneration)
+	{
+		buildBlock(block, address);
+	}
+	return &block;
+}
+
+void BBBBBrainDumbed::buildBlock(Block& block, uint16_t address)
+{
+	blocksBuilt++;
+	block.address = address;
+	block.generation = memory.romGeneration;
+	block.opcodes.clear();
+	block.headTicks = 0;
+	block.exit[0] = block.exit[1] = nullptr;
+	uint16_t i = address;
+	while (true)
+	{
+		uint8_t opcode = memory.fetch(i);
+		block.opcodes.push_back(opcode);
+		i += 7;
+		if ((isa[opcode].effects & (branches | variableTicks | writeM)) || block.opcodes.size() == Block::maxLength || i > Memory::fetchLimit)
+		{
 			break;
-		case 119:
-			if (C == false)
-			{
-				T1 = rotr(*OP2, I);
-				*OP2 = rotl(P, I);
-				P = T1;
-			}
-			tick += 30;
+		}
+		block.headTicks += isa[opcode].ticks;
+	}
+}
+
+bool BBBBBrainDumbed::runBlocks(size_t count, size_t& tick, size_t& inst_count)	//false if not even the first block fits, the caller single-steps then
+{
+	Block* block = lookupBlock(P);
+	bool ran = false;
+	while (block && !(!M && IRQ) && tick + block->headTicks < count)
+	{
+		ran = true;
+		size_t generation = memory.romGeneration;
+		uint16_t expected = P;
+		for (uint8_t opcode : block->opcodes)
+		{
+			inst = opcode;
+			P += 7;
+			expected += 7;
+			tick += operate();
 			inst_count++;
-			checkIRQ();
-			break;
-		case 120:
-			if (*OP1 == 0)
+			if (P != expected || memory.romGeneration != generation)	//P was written or the code was overwritten, leave the block here
 			{
-				P = rotr(*OP2, I);
+				break;
 			}
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 121:
-			if (*OP1 == 0)
+		}
+		checkIRQ();
+		if (branched)
+		{
+			branched = false;
+			if (idleLoopSkip)
 			{
-				T1 = rotr(*OP2, I);
-				*OP2 = rotl(P, I);
-				P = T1;
+				tick = skipIdleLoop(count, tick, inst_count);
 			}
-			tick += 30;
-			inst_count++;
-			checkIRQ();
+		}
+		if (count <= tick)
+		{
 			break;
-		case 122:	//bn
-			if ((rotr(*OP1, I) & 0x8000) != 0)
+		}
+		Block* next = nullptr;
+		for (size_t k = 0; k < 2; k++)
+		{
+			if (block->exit[k] && block->exitAddress[k] == P)
 			{
-				P = rotr(*OP2, I);
+				next = block->exit[k];
 			}
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 123:
-			if ((rotr(*OP1, I) & 0x8000) != 0)
+		}
+		if (next)
+		{
+			if (next->generation != memory.romGeneration)
 			{
-				T1 = rotr(*OP2, I);
-				*OP2 = rotl(P, I);
-				P = T1;
+				buildBlock(*next, P);
 			}
-			tick += 30;
-			inst_count++;
-			checkIRQ();
-			break;
-		case 124:	//wait.4
-			T1 = rotr(*OP1, I) & 0xf;
-			tick += (30 + T1);
-			inst_count++;
-			checkIRQ();
-			break;
-		case 125:	//wait.4e
-			T1 = rotr(*OP1, I) & 0xf;
-			tick += (30 + T1 + 16);
-			inst_count++;
-			checkIRQ();
-			break;
-		case 126:
-		case 127:
-			T1 = rotr(*OP1, I);
-			T1 = (T1 & 0xfffe) | (inst & 0x1);
-			*OP1 = rotl(T1, I);
-			I = (I + 1) & 0xf;
-			tick += 29;
-			inst_count++;
-			checkIRQ();
-			break;
-		default:
-			break;
 		}
+		else
+		{
+			next = lookupBlock(P);
+			size_t slot = block->exit[0] ? 1 : 0;
+			block->exitAddress[slot] = P;
+			block->exit[slot] = next;
+		}
+		block = next;
 	}
-	return tick - count;
-}
-
-void BBBBBrainDumbed::checkIRQ()
-{
-	if (!M && IRQ)
-	{
-		T1 = P;
-		P = V;
-		V = T1;
-	}
+	return ran;
 }
\ No newline at end of file
@@ -0,0 +1,181 @@
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+/*
+	Bits packed 64 to a word, bit i is bit i % 64 of word i / 64, the same order the ROM is addressed in.
+	The assembler appends and patches whole opcodes and data fields, and Memory takes the words over as its ROM.
+	Copying is disabled so an image only ever moves from the parser to the ROM; bits past size() are kept 0.
+*/
+class BitBuffer
+{
+public:
+	BitBuffer();
+	explicit BitBuffer(size_t bits);
+	BitBuffer(const BitBuffer&) = delete;
+	BitBuffer(BitBuffer&& other) noexcept;
+	~BitBuffer();
+	BitBuffer& operator=(const BitBuffer&) = delete;
+	BitBuffer& operator=(BitBuffer&& other) noexcept;
+	size_t size() const;
+	bool empty() const;
+	bool operator[](size_t position) const;
+	uint64_t read(size_t position, size_t width) const;	//width <= 64, bits past the end read as 0
+	void write(size_t position, uint64_t value, size_t width);	//width <= 64, [position, position + width) must exist
+	void set(size_t position, bool value);
+	void append(uint64_t value, size_t width);
+	void append(const BitBuffer& source, size_t position, size_t length);	//source may be this buffer
+	void append(const uint8_t* bytes, size_t size, size_t position, size_t length);	//bits of a byte array, LSB first, bits past size read as 0
+	void resize(size_t bits);	//new bits are 0
+	void reserve(size_t bits);
+
+private:
+	vector<uint64_t> words;
+	size_t count = 0;
+};
+
+BitBuffer::BitBuffer()
+{
+}
+
+BitBuffer::BitBuffer(size_t bits)
+{
+	resize(bits);
+}
+
+BitBuffer::BitBuffer(BitBuffer&& other) noexcept : words(move(other.words)), count(other.count)
+{
+	other.words.clear();
+	other.count = 0;
+}
+
+BitBuffer::~BitBuffer()
+{
+}
+
+BitBuffer& BitBuffer::operator=(BitBuffer&& other) noexcept
+{
+	if (this != &other)
+	{
+		words = move(other.words);
+		count = other.count;
+		other.words.clear();
+		other.count = 0;
+	}
+	return *this;
+}
+
+size_t BitBuffer::size() const
+{
+	return count;
+}
+
+bool BitBuffer::empty() const
+{
+	return count == 0;
+}
+
+bool BitBuffer::operator[](size_t position) const
+{
+	return (words[position >> 6] >> (position & 63)) & 1;
+}
+
+uint64_t BitBuffer::read(size_t position, size_t width) const
+{
+	if (width == 0 || position >= count)
+	{
+		return 0;
+	}
+	size_t word = position >> 6, shift = position & 63;
+	uint64_t value = words[word] >> shift;
+	if (shift + width > 64 && word + 1 < words.size())
+	{
+		value |= words[word + 1] << (64 - shift);
+	}
+	return width == 64 ? value : value & ((1ull << width) - 1);
+}
+
+void BitBuffer::write(size_t position, uint64_t value, size_t width)
+{
+	if (width == 0)
+	{
+		return;
+	}
+	uint64_t mask = width == 64 ? ~0ull : (1ull << width) - 1;
+	value &= mask;
+	size_t word = position >> 6, shift = position & 63;
+	words[word] = (words[word] & ~(mask << shift)) | (value << shift);
+	if (shift + width > 64)	//straddles two words
+	{
+		words[word + 1] = (words[word + 1] & ~(mask >> (64 - shift))) | (value >> (64 - shift));
+	}
+}
+
+void BitBuffer::set(size_t position, bool value)
+{
+	uint64_t bit = 1ull << (position & 63);
+	words[position >> 6] = value ? words[position >> 6] | bit : words[position >> 6] & ~bit;
+}
+
+void BitBuffer::append(uint64_t value, size_t width)
+{
+	size_t position = count;
+	resize(count + width);
+	write(position, value, width);
+}
+
+void BitBuffer::append(const BitBuffer& source, size_t position, size_t length)
+{
+	size_t target = count;
+	resize(count + length);
+	for (size_t i = 0; i < length; i += 64)
+	{
+		size_t width = min<size_t>(64, length - i);
+		write(target + i, source.read(position + i, width), width);
+	}
+}
+
+void BitBuffer::append(const uint8_t* bytes, size_t size, size_t position, size_t length)
+{
+	size_t target = count;
+	resize(count + length);
+	for (size_t i = 0; i < length; i += 56)	//8 bytes loaded from any bit offset always hold 56 wanted bits
+	{
+		size_t width = min<size_t>(56, length - i), byte = (position + i) >> 3;
+		uint64_t value = 0;
+		if (byte + 8 <= size)	//compilers turn this into one load
+		{
+			for (size_t k = 0; k < 8; k++)
+			{
+				value |= (uint64_t)bytes[byte + k] << (8 * k);
+			}
+		}
+		else
+		{
+			for (size_t k = 0; byte + k < size && k < 8; k++)
+			{
+				value |= (uint64_t)bytes[byte + k] << (8 * k);
+			}
+		}
+		write(target + i, value >> ((position + i) & 7), width);
+	}
+}
+
+void BitBuffer::resize(size_t bits)
+{
+	words.resize((bits + 63) >> 6, 0);
+	if (bits < count && (bits & 63))	//clear what is left of the dropped bits in the last word
+	{
+		words.back() &= (1ull << (bits & 63)) - 1;
+	}
+	count = bits;
+}
+
+void BitBuffer::reserve(size_t bits)
+{
+	words.reserve((bits + 63) >> 6);
+}
\ No newline at end of file
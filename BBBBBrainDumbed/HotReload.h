@@ -0,0 +1,252 @@
+#pragma once
+#include <stdint.h>
+#include <bit>
+#include <chrono>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "BBBBBrainDumbed.h"
+#include "BitBuffer.h"
+#include "IncludeCache.h"
+#include "Parser.h"
+#include "Trace.h"
+
+using namespace std;
+
+/*
+	Bit ranges in which two ROM images differ, found a word at a time.
+	Differences less than a word apart share a range, so a patch is a few word-level copies and each decoded opcode is invalidated once.
+*/
+class RomPatch
+{
+public:
+	vector<pair<size_t, size_t>> ranges;	//[begin, end) bit positions, ascending
+	size_t bits = 0;	//how many bits differ
+	static RomPatch diff(const BitBuffer& before, const BitBuffer& after);
+	void apply(Memory& memory, const BitBuffer& image) const;
+};
+
+class Reassembly	//what one HotReload::reassemble did
+{
+public:
+	bool changed = false;	//a file the last assembly read was written since
+	bool assembled = false;	//false with error set when the new source does not assemble, the running ROM is left alone
+	bool patched = false;	//no label moved, so the differing bits went straight into the live ROM
+	wstring error;
+	RomPatch patch;
+	BitBuffer image;	//the new ROM when it could not be patched in place
+	double milliseconds = 0;
+};
+
+/*
+	Watch mode for the assembler: keeps the write time of every file the last assembly read, and reassembles when one of them changes.
+	Unchanged include files come out of IncludeCache without being tokenized again; the parse is rerun whole, since labels are global and any expression may refer forward.
+	The new image is diffed against the running ROM. When every label kept its address the diff is written into the live Memory and CPU and RAM state carry on;
+	otherwise the image is handed back so the caller can reset the machine and bake it.
+*/
+class HotReload
+{
+public:
+	wstring filepath;
+	Trace* trace = nullptr;
+	bool peephole = false;	//passed to every Parser, see Parser::peephole
+	bool relax = false;	//parse again until Parser::relaxation settles
+	unique_ptr<SourceBuffer> source;	//of the last successful assembly
+	unique_ptr<Parser> parser;	//of the last successful assembly, for listings
+	map<wstring, filesystem::file_time_type> dependencies;
+	map<wstring, size_t> labels;	//bit position of every label
+	HotReload(wstring _filepath);
+	~HotReload();
+	BitBuffer assemble();	//throws what Tokenizer and Parser throw
+	bool changed();
+	Reassembly reassemble(Memory& memory);
+	static wstring describe(const Reassembly& result);
+};
+
+RomPatch RomPatch::diff(const BitBuffer& before, const BitBuffer& after)
+{
+	RomPatch output;
+	size_t length = max(before.size(), after.size());
+	for (size_t i = 0; i < length; i += 64)
+	{
+		uint64_t difference = before.read(i, 64) ^ after.read(i, 64);	//bits past either end read as 0
+		if (!difference)
+		{
+			continue;
+		}
+		size_t begin = i + countr_zero(difference), end = min(i + 64 - countl_zero(difference), length);
+		if (!output.ranges.empty() && begin <= output.ranges.back().second + 64)
+		{
+			output.ranges.back().second = end;
+		}
+		else
+		{
+			output.ranges.push_back(make_pair(begin, end));
+		}
+		output.bits += popcount(difference);
+	}
+	return output;
+}
+
+void RomPatch::apply(Memory& memory, const BitBuffer& image) const
+{
+	for (auto& i : ranges)
+	{
+		memory.patchRom(image, i.first, i.second);
+	}
+}
+
+HotReload::HotReload(wstring _filepath) : filepath(_filepath)
+{
+}
+
+HotReload::~HotReload()
+{
+}
+
+BitBuffer HotReload::assemble()
+{
+	unique_ptr<SourceBuffer> nextSource;
+	unique_ptr<Parser> nextParser;
+	BitBuffer output;
+	Relaxation relaxation;
+	do
+	{
+		nextParser.reset();	//before the source it refers to
+		nextSource = make_unique<SourceBuffer>();
+		vector<Token> tokens;
+		{
+			TraceSpan span(trace, L"tokenize", L"assembler");
+			shared_ptr<const TokenizedFile> file = IncludeCache::shared().read(filepath);
+			if (!file)
+			{
+				throw runtime_error("failed to open file");
+			}
+			tokens = IncludeCache::splice(*nextSource, *file, filepath);
+		}
+		nextParser = make_unique<Parser>(*nextSource, move(tokens), filepath);
+		nextParser->trace = trace;
+		nextParser->peephole = peephole;
+		nextParser->relax = relax && relaxation.passes < Relaxation::passLimit;	//the last pass, without relaxation, cannot be wrong
+		nextParser->relaxation = move(relaxation);
+		output = nextParser->parse();
+		relaxation = nextParser->relaxation;
+	} while (nextParser->relax && !relaxation.settled);
+	if (output.size() > 0x8000)
+	{
+		throw out_of_range("Input is too large.");
+	}
+	dependencies.clear();
+	for (auto& i : nextParser->dependencies)
+	{
+		error_code ignored;
+		dependencies[i] = filesystem::last_write_time(filesystem::path(i), ignored);
+	}
+	labels.clear();
+	for (auto& i : nextParser->labelPositions)
+	{
+		labels[i.second] = i.first;
+	}
+	parser = move(nextParser);	//the old parser goes before the old source it refers to
+	source = move(nextSource);
+	return output;
+}
+
+bool HotReload::changed()
+{
+	for (auto& i : dependencies)
+	{
+		error_code status;
+		filesystem::file_time_type time = filesystem::last_write_time(filesystem::path(i.first), status);
+		if (status || time != i.second)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+Reassembly HotReload::reassemble(Memory& memory)
+{
+	Reassembly output;
+	if (!changed())
+	{
+		return output;
+	}
+	output.changed = true;
+	auto start = chrono::steady_clock::now();
+	map<wstring, size_t> previous = labels;
+	try
+	{
+		output.image = assemble();
+	}
+	catch (const ParserError& e)
+	{
+		wstringstream text;
+		text << L"Parser error at token:" << e.token.token << L" filename:" << e.token.filename << L" line:" << e.token.line << L" digit:" << e.token.digit << endl << e.what();
+		output.error = text.str();
+	}
+	catch (const TokenizerError& e)
+	{
+		wstringstream text;
+		text << L"Tokenizer error at token:" << e.token.token << L" filename:" << e.token.filename << L" line:" << e.token.line << L" digit:" << e.token.digit << endl << e.what();
+		output.error = text.str();
+	}
+	catch (const exception& e)
+	{
+		wstringstream text;
+		text << L"Parser error" << endl << e.what();
+		output.error = text.str();
+	}
+	if (output.error.empty())
+	{
+		output.assembled = true;
+		output.image.resize(0x8000);
+		output.patch = RomPatch::diff(memory.ROM, output.image);	//against the live ROM, so bits the program wrote are restored too
+		output.patched = true;
+		for (auto& i : labels)
+		{
+			auto j = previous.find(i.first);
+			if (j != previous.end() && j->second != i.second)	//code or data moved, addresses held in registers and RAM are stale
+			{
+				output.patched = false;
+				break;
+			}
+		}
+		if (output.patched)
+		{
+			output.patch.apply(memory, output.image);
+			output.image = BitBuffer();
+		}
+	}
+	else	//take the broken files as seen, so the same error is not reported on every poll
+	{
+		for (auto& i : dependencies)
+		{
+			error_code ignored;
+			i.second = filesystem::last_write_time(filesystem::path(i.first), ignored);
+		}
+	}
+	output.milliseconds = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+	return output;
+}
+
+wstring HotReload::describe(const Reassembly& result)	//one line for the log
+{
+	wstringstream text;
+	if (!result.assembled)
+	{
+		text << L"reassembly failed, ROM kept: " << result.error;
+	}
+	else
+	{
+		text << (result.patched ? L"patched " : L"labels moved, restarted with ") << result.patch.bits << L" changed bits in " << result.patch.ranges.size() << L" ranges";
+	}
+	text << L" (" << result.milliseconds << L" ms)";
+	return text.str();
+}
\ No newline at end of file
@@ -0,0 +1,228 @@
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "MappedFile.h"
+#include "Tokenizer.h"
+
+using namespace std;
+
+/*
+	Fixed set of worker threads running queued jobs in order.
+	Jobs left in the queue when the pool is destroyed are dropped, so their futures report a broken promise.
+*/
+class ThreadPool
+{
+public:
+	ThreadPool(size_t threads);
+	~ThreadPool();
+	void submit(function<void()> job);
+private:
+	vector<thread> workers;
+	deque<function<void()>> jobs;
+	mutex lock;
+	condition_variable ready;
+	bool stopping = false;
+	void work();
+};
+
+class TokenizedFile	//one file as Tokenizer::tokenize left it, independent of any SourceBuffer
+{
+public:
+	string bytes;	//file content, compared when hashes match
+	wstring text;	//folded text, L'\0', then decoded quoted text
+	vector<Token> tokens;	//offsets into text, file 0
+};
+
+/*
+	Tokenized include files shared by every assembly in the process, keyed by a hash of their bytes, so an edited file is never served stale.
+	A path keeps only the version it was last read as, so a long watch session does not collect every edit.
+	A hit only maps and hashes the file; the bytes are decoded and tokenized on a miss.
+	Splicing an entry into an assembly appends its text to the SourceBuffer and rebases the tokens, which is a copy rather than a scan.
+	prefetch reads and tokenizes a file on the pool; the parser starts one for every include it sees, so sibling files are tokenized in parallel.
+*/
+class IncludeCache
+{
+public:
+	IncludeCache();
+	~IncludeCache();
+	static IncludeCache& shared();
+	shared_ptr<const TokenizedFile> read(wstring filepath);	//null when the file cannot be opened
+	shared_future<shared_ptr<const TokenizedFile>> prefetch(wstring filepath);
+	static vector<Token> splice(SourceBuffer& source, const TokenizedFile& file, wstring filename);
+	void clear();
+	static uint64_t hashContent(string_view bytes);
+private:
+	multimap<uint64_t, shared_ptr<const TokenizedFile>> files;
+	map<wstring, pair<uint64_t, shared_ptr<const TokenizedFile>>> latest;	//what each path was last read as, with its hash
+	void remember(const wstring& filepath, uint64_t hash, const shared_ptr<const TokenizedFile>& file);	//with lock held
+	mutex lock;
+	ThreadPool pool;	//last, so workers are joined before files goes away
+};
+
+ThreadPool::ThreadPool(size_t threads)
+{
+	for (size_t i = 0; i < threads; i++)
+	{
+		workers.emplace_back(&ThreadPool::work, this);
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		lock_guard<mutex> guard(lock);
+		stopping = true;
+		jobs.clear();
+	}
+	ready.notify_all();
+	for (auto& i : workers)
+	{
+		i.join();
+	}
+}
+
+void ThreadPool::submit(function<void()> job)
+{
+	{
+		lock_guard<mutex> guard(lock);
+		jobs.push_back(move(job));
+	}
+	ready.notify_one();
+}
+
+void ThreadPool::work()
+{
+	while (true)
+	{
+		function<void()> job;
+		{
+			unique_lock<mutex> guard(lock);
+			ready.wait(guard, [&] {return stopping || !jobs.empty(); });
+			if (stopping)
+			{
+				return;
+			}
+			job = move(jobs.front());
+			jobs.pop_front();
+		}
+		job();
+	}
+}
+
+IncludeCache::IncludeCache() : pool(thread::hardware_concurrency() > 1 ? thread::hardware_concurrency() - 1 : 1)
+{
+}
+
+IncludeCache::~IncludeCache()
+{
+}
+
+IncludeCache& IncludeCache::shared()
+{
+	static IncludeCache cache;
+	return cache;
+}
+
+shared_ptr<const TokenizedFile> IncludeCache::read(wstring filepath)
+{
+	MappedFile file;
+	if (!file.open(filepath))
+	{
+		return nullptr;
+	}
+	string_view bytes((const char*)file.data(), file.size());
+	uint64_t hash = hashContent(bytes);
+	{
+		lock_guard<mutex> guard(lock);
+		for (auto i = files.lower_bound(hash); i != files.end() && i->first == hash; i++)
+		{
+			if (i->second->bytes == bytes)
+			{
+				shared_ptr<const TokenizedFile> output = i->second;
+				remember(filepath, hash, output);
+				return output;
+			}
+		}
+	}
+	wstring finput(bytes.size(), L'\0');	//decoded from the bytes that were hashed, one character per byte as include always read files
+	transform(bytes.begin(), bytes.end(), finput.begin(), [](char c) {return (wchar_t)(uint8_t)c; });
+	shared_ptr<TokenizedFile> output = make_shared<TokenizedFile>();
+	output->bytes = bytes;
+	SourceBuffer source;
+	output->tokens = Tokenizer::tokenize(source, move(finput), filepath);	//throws before anything is cached
+	output->text = move(source.text);
+	lock_guard<mutex> guard(lock);
+	files.insert(make_pair(hash, output));	//two threads may both miss on the same content, the extra entry is only memory
+	remember(filepath, hash, output);
+	return output;
+}
+
+void IncludeCache::remember(const wstring& filepath, uint64_t hash, const shared_ptr<const TokenizedFile>& file)
+{
+	pair<uint64_t, shared_ptr<const TokenizedFile>> stale = latest[filepath];
+	latest[filepath] = make_pair(hash, file);
+	if (!stale.second || stale.second == file || any_of(latest.begin(), latest.end(), [&](const auto& i) {return i.second.second == stale.second; }))
+	{
+		return;	//nothing older, or another path still reads the same content
+	}
+	for (auto i = files.lower_bound(stale.first); i != files.end() && i->first == stale.first; i++)
+	{
+		if (i->second == stale.second)
+		{
+			files.erase(i);
+			break;
+		}
+	}
+}
+
+shared_future<shared_ptr<const TokenizedFile>> IncludeCache::prefetch(wstring filepath)
+{
+	auto task = make_shared<packaged_task<shared_ptr<const TokenizedFile>()>>([this, filepath] {return read(filepath); });
+	shared_future<shared_ptr<const TokenizedFile>> output = task->get_future().share();
+	pool.submit([task] {(*task)(); });
+	return output;
+}
+
+vector<Token> IncludeCache::splice(SourceBuffer& source, const TokenizedFile& file, wstring filename)
+{
+	uint32_t index = source.file(filename);
+	uint32_t base = (uint32_t)source.text.size();
+	source.text.append(file.text);
+	vector<Token> output(file.tokens);
+	for (auto& i : output)
+	{
+		i.file = index;
+		i.offset += base;
+	}
+	return output;
+}
+
+void IncludeCache::clear()
+{
+	lock_guard<mutex> guard(lock);
+	files.clear();
+	latest.clear();
+}
+
+uint64_t IncludeCache::hashContent(string_view bytes)	//FNV-1a, 64 bit since whole files are hashed
+{
+	uint64_t hash = 0xcbf29ce484222325;
+	for (char c : bytes)
+	{
+		hash = (hash ^ (uint8_t)c) * 0x100000001b3;
+	}
+	return hash;
+}
\ No newline at end of file
@@ -0,0 +1,180 @@
+#pragma once
+#include <stdint.h>
+#include <future>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "BitBuffer.h"
+#include "IncludeCache.h"
+#include "ObjectFile.h"
+#include "Parser.h"
+
+using namespace std;
+
+class LinkerError : public runtime_error
+{
+public:
+	wstring module;	//the object the error was found in
+	wstring symbol;	//empty when no one symbol is at fault
+	LinkerError(const string& message, wstring _module, wstring _symbol = L"") : runtime_error(message), module(_module), symbol(_symbol) {}
+};
+
+/*
+	Places the sections of every object one after another in the order they were added, so the first module starts at ROM address 0.
+	Exported labels are rebased by their section's address, imports are looked up among them, and each relocation is evaluated and written with the fixup it came from.
+	build assembles the modules in parallel, each through its own Parser, and keeps each object next to its source as <source>.bbo, reused while every file it read hashes the same.
+*/
+class Linker
+{
+public:
+	vector<ObjectFile> objects;
+	map<wstring, int64_t> symbols;	//every export by name, as a ROM bit address
+	Linker();
+	~Linker();
+	void add(ObjectFile object);
+	BitBuffer link();	//throws LinkerError
+	static vector<ObjectFile> build(const vector<wstring>& modules, bool cache);	//throws what ObjectFile::assemble throws, for the first module that fails
+};
+
+Linker::Linker()
+{
+}
+
+Linker::~Linker()
+{
+}
+
+void Linker::add(ObjectFile object)
+{
+	objects.push_back(move(object));
+}
+
+BitBuffer Linker::link()
+{
+	BitBuffer output;
+	vector<vector<size_t>> addresses(objects.size());	//of each section
+	for (size_t i = 0; i < objects.size(); i++)
+	{
+		for (auto& j : objects[i].sections)
+		{
+			addresses[i].push_back(output.size());
+			output.append(j.bits, 0, j.bits.size());
+		}
+	}
+	symbols.clear();
+	for (size_t i = 0; i < objects.size(); i++)
+	{
+		for (auto& j : objects[i].symbols)
+		{
+			if (j.section == ObjectSymbol::imported)
+			{
+				continue;
+			}
+			if (!symbols.insert(make_pair(j.name, (int64_t)addresses[i][j.section] + j.value)).second)
+			{
+				throw LinkerError("label is defined in more than one module", objects[i].name, j.name);
+			}
+		}
+	}
+	vector<int64_t> values, stack;
+	for (size_t i = 0; i < objects.size(); i++)
+	{
+		const ObjectFile& object = objects[i];
+		values.resize(object.symbols.size());
+		for (size_t j = 0; j < object.symbols.size(); j++)
+		{
+			const ObjectSymbol& symbol = object.symbols[j];
+			if (symbol.section != ObjectSymbol::imported)
+			{
+				values[j] = addresses[i][symbol.section] + symbol.value;
+				continue;
+			}
+			auto k = symbols.find(symbol.name);
+			if (k == symbols.end())
+			{
+				throw LinkerError("undefined symbol", object.name, symbol.name);
+			}
+			values[j] = k->second;
+		}
+		for (auto& j : object.relocations)
+		{
+			stack.clear();
+			for (size_t k = j.fixup.expression.begin; k < j.fixup.expression.end; k++)
+			{
+				const ExpressionStep& step = object.steps[k];
+				switch (step.opcode)
+				{
+				case ExpressionOpcode::constant:
+					stack.push_back(step.value);
+					break;
+				case ExpressionOpcode::symbol:
+					stack.push_back(values[step.symbol]);
+					break;
+				case ExpressionOpcode::unary:
+					if (stack.empty())
+					{
+						throw LinkerError("malformed relocation", object.name);
+					}
+					stack.back() = Parser::apply(step.op, stack.back());
+					break;
+				case ExpressionOpcode::binary:
+				{
+					if (stack.size() < 2)
+					{
+						throw LinkerError("malformed relocation", object.name);
+					}
+					int64_t rhs = stack.back();
+					stack.pop_back();
+					if ((step.op == OperatorKind::divide || step.op == OperatorKind::modulo) && rhs == 0)
+					{
+						throw LinkerError("division by zero", object.name);
+					}
+					stack.back() = Parser::apply(step.op, stack.back(), rhs);
+					break;
+				}
+				}
+			}
+			if (stack.size() != 1)
+			{
+				throw LinkerError("malformed relocation", object.name);
+			}
+			Fixup fixup = j.fixup;
+			fixup.position += addresses[i][j.section];
+			fixup.write(output, stack.back());
+		}
+	}
+	return output;
+}
+
+vector<ObjectFile> Linker::build(const vector<wstring>& modules, bool cache)
+{
+	ThreadPool pool(thread::hardware_concurrency() > 1 ? thread::hardware_concurrency() : 1);	//not IncludeCache's, whose workers the parsers wait on for includes
+	vector<future<ObjectFile>> pending;
+	for (auto& i : modules)
+	{
+		auto task = make_shared<packaged_task<ObjectFile()>>([i, cache] {
+			wstring cachepath = i + L".bbo";
+			ObjectFile object;
+			if (cache && object.load(cachepath) && object.name == i && object.upToDate())
+			{
+				return object;
+			}
+			object = ObjectFile::assemble(i);
+			if (cache)
+			{
+				object.save(cachepath);	//a cache that cannot be written only costs the next build time
+			}
+			return object;
+		});
+		pending.push_back(task->get_future());
+		pool.submit([task] {(*task)(); });
+	}
+	vector<ObjectFile> output;
+	for (auto& i : pending)
+	{
+		output.push_back(i.get());
+	}
+	return output;
+}
\ No newline at end of file
@@ -0,0 +1,143 @@
+#pragma once
+#include <stdint.h>
+#include <string>
+
+#ifdef _WIN32
+#include <Windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif // _WIN32
+
+using namespace std;
+
+/*
+	Read-only mapping of a whole file, so binclude reads asset bytes where the OS already has them instead of copying the file.
+	MapViewOfFile on Windows, mmap elsewhere; an empty file opens with no mapping and size 0.
+*/
+class MappedFile
+{
+public:
+	MappedFile();
+	MappedFile(const MappedFile&) = delete;
+	~MappedFile();
+	MappedFile& operator=(const MappedFile&) = delete;
+	bool open(const wstring& filename);
+	void close();
+	bool isOpen() const;
+	const uint8_t* data() const;
+	size_t size() const;
+
+private:
+	const uint8_t* view = nullptr;
+	size_t length = 0;
+	bool opened = false;
+};
+
+MappedFile::MappedFile()
+{
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+bool MappedFile::open(const wstring& filename)
+{
+	close();
+#ifdef _WIN32
+	HANDLE file = CreateFileW(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+	{
+		return false;
+	}
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize))
+	{
+		CloseHandle(file);
+		return false;
+	}
+	length = (size_t)fileSize.QuadPart;
+	if (length)
+	{
+		HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping)
+		{
+			view = (const uint8_t*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(mapping);	//the view keeps the mapping alive
+		}
+		if (!view)
+		{
+			CloseHandle(file);
+			length = 0;
+			return false;
+		}
+	}
+	CloseHandle(file);
+#else
+	string path;
+	for (wchar_t i : filename)	//open takes a narrow path, only ASCII names survive this
+	{
+		path.push_back((char)i);
+	}
+	int file = ::open(path.c_str(), O_RDONLY);
+	if (file < 0)
+	{
+		return false;
+	}
+	struct stat status;
+	if (fstat(file, &status) != 0)
+	{
+		::close(file);
+		return false;
+	}
+	length = (size_t)status.st_size;
+	if (length)
+	{
+		void* mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, file, 0);
+		if (mapping == MAP_FAILED)
+		{
+			::close(file);
+			length = 0;
+			return false;
+		}
+		view = (const uint8_t*)mapping;
+	}
+	::close(file);	//the mapping stays valid
+#endif // _WIN32
+	opened = true;
+	return true;
+}
+
+void MappedFile::close()
+{
+	if (view)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(view);
+#else
+		munmap((void*)view, length);
+#endif // _WIN32
+	}
+	view = nullptr;
+	length = 0;
+	opened = false;
+}
+
+bool MappedFile::isOpen() const
+{
+	return opened;
+}
+
+const uint8_t* MappedFile::data() const
+{
+	return view;
+}
+
+size_t MappedFile::size() const
+{
+	return length;
+}
\ No newline at end of file
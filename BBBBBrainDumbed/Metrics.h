@@ -0,0 +1,209 @@
+#pragma once
+#include <stdint.h>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <ostream>
+
+using namespace std;
+
+/*
+	Runtime metrics shared between the emulation thread (writer) and whoever polls them (readers).
+	Every field is a relaxed atomic so recording a frame never takes a lock; a snapshot may mix two adjacent frames, which is fine for monitoring.
+	Frame times go into a log-linear histogram: 8 sub-buckets per power of two nanoseconds, so percentiles are within 12.5%.
+*/
+class MetricsSnapshot
+{
+public:
+	uint64_t frames = 0;
+	uint64_t guestTicks = 0;
+	uint64_t hostNanoseconds = 0;
+	uint64_t overshootTicks = 0;
+	uint64_t overshootMax = 0;
+	uint64_t instructions = 0;
+	uint64_t irqs = 0;
+	uint64_t frameTimeP50 = 0;
+	uint64_t frameTimeP99 = 0;
+	uint64_t frameTimeP999 = 0;
+	uint64_t frameTimeMax = 0;
+	double emulatedMHz();
+	double realTimeRatio();
+	double instructionsPerFrame();
+	void write(wostream& out);
+	void writeJson(wostream& out);
+};
+
+class Metrics
+{
+public:
+	static constexpr double clock = 230880681.818182;
+	static constexpr size_t subBuckets = 8;
+	static constexpr size_t buckets = 64 * subBuckets;
+	atomic<uint64_t> frames = 0;
+	atomic<uint64_t> guestTicks = 0;
+	atomic<uint64_t> hostNanoseconds = 0;
+	atomic<uint64_t> overshootTicks = 0;
+	atomic<uint64_t> overshootMax = 0;
+	atomic<uint64_t> instructions = 0;
+	atomic<uint64_t> irqs = 0;
+	atomic<uint64_t> frameTimeMax = 0;
+	atomic<uint64_t> frameTime[buckets] = {};
+	Metrics();
+	~Metrics();
+	void recordFrame(uint64_t nanoseconds, uint64_t ticks, uint64_t overshoot, uint64_t _instructions, uint64_t _irqs);
+	MetricsSnapshot snapshot();
+	bool dumpIfDue(wostream& out, bool json);
+	chrono::steady_clock::duration dumpInterval = chrono::seconds(1);
+	static size_t bucketOf(uint64_t nanoseconds);
+	static uint64_t bucketValue(size_t bucket);
+private:
+	chrono::steady_clock::time_point lastDump;
+	void add(atomic<uint64_t>& counter, uint64_t value);
+	void raise(atomic<uint64_t>& counter, uint64_t value);
+};
+
+double MetricsSnapshot::emulatedMHz()
+{
+	return hostNanoseconds ? guestTicks * 1000.0 / hostNanoseconds : 0;
+}
+
+double MetricsSnapshot::realTimeRatio()
+{
+	return emulatedMHz() * 1000000.0 / Metrics::clock;
+}
+
+double MetricsSnapshot::instructionsPerFrame()
+{
+	return frames ? (double)instructions / frames : 0;
+}
+
+void MetricsSnapshot::write(wostream& out)
+{
+	out << L"frames: " << frames << endl;
+	out << L"emulated MHz: " << emulatedMHz() << endl;
+	out << L"real-time ratio: " << realTimeRatio() << endl;
+	out << L"frame time us p50/p99/p999/max: " << frameTimeP50 / 1000.0 << L"/" << frameTimeP99 / 1000.0 << L"/" << frameTimeP999 / 1000.0 << L"/" << frameTimeMax / 1000.0 << endl;
+	out << L"overshoot ticks total/max: " << overshootTicks << L"/" << overshootMax << endl;
+	out << L"instructions per frame: " << instructionsPerFrame() << endl;
+	out << L"irqs: " << irqs << endl;
+}
+
+void MetricsSnapshot::writeJson(wostream& out)
+{
+	out << L"{\"frames\":" << frames << L",\"emulatedMHz\":" << emulatedMHz() << L",\"realTimeRatio\":" << realTimeRatio();
+	out << L",\"frameTimeNs\":{\"p50\":" << frameTimeP50 << L",\"p99\":" << frameTimeP99 << L",\"p999\":" << frameTimeP999 << L",\"max\":" << frameTimeMax << L"}";
+	out << L",\"overshootTicks\":" << overshootTicks << L",\"overshootMax\":" << overshootMax;
+	out << L",\"instructionsPerFrame\":" << instructionsPerFrame() << L",\"irqs\":" << irqs << L"}" << endl;
+}
+
+Metrics::Metrics()
+{
+	lastDump = chrono::steady_clock::now();
+}
+
+Metrics::~Metrics()
+{
+}
+
+void Metrics::add(atomic<uint64_t>& counter, uint64_t value)
+{
+	counter.store(counter.load(memory_order_relaxed) + value, memory_order_relaxed);	//single writer, no read-modify-write needed
+}
+
+void Metrics::raise(atomic<uint64_t>& counter, uint64_t value)
+{
+	if (counter.load(memory_order_relaxed) < value)
+	{
+		counter.store(value, memory_order_relaxed);
+	}
+}
+
+size_t Metrics::bucketOf(uint64_t nanoseconds)
+{
+	if (nanoseconds < subBuckets)
+	{
+		return (size_t)nanoseconds;
+	}
+	size_t msb = 63 - countl_zero(nanoseconds);
+	size_t sub = (size_t)(nanoseconds >> (msb - 3)) & (subBuckets - 1);
+	return (msb - 2) * subBuckets + sub;
+}
+
+uint64_t Metrics::bucketValue(size_t bucket)
+{
+	if (bucket < subBuckets)
+	{
+		return bucket;
+	}
+	size_t msb = bucket / subBuckets + 2;
+	return ((uint64_t)(subBuckets + bucket % subBuckets)) << (msb - 3);
+}
+
+void Metrics::recordFrame(uint64_t nanoseconds, uint64_t ticks, uint64_t overshoot, uint64_t _instructions, uint64_t _irqs)
+{
+	add(frames, 1);
+	add(guestTicks, ticks);
+	add(hostNanoseconds, nanoseconds);
+	add(overshootTicks, overshoot);
+	raise(overshootMax, overshoot);
+	add(instructions, _instructions);
+	add(irqs, _irqs);
+	raise(frameTimeMax, nanoseconds);
+	add(frameTime[bucketOf(nanoseconds)], 1);
+}
+
+MetricsSnapshot Metrics::snapshot()
+{
+	MetricsSnapshot output;
+	output.frames = frames.load(memory_order_relaxed);
+	output.guestTicks = guestTicks.load(memory_order_relaxed);
+	output.hostNanoseconds = hostNanoseconds.load(memory_order_relaxed);
+	output.overshootTicks = overshootTicks.load(memory_order_relaxed);
+	output.overshootMax = overshootMax.load(memory_order_relaxed);
+	output.instructions = instructions.load(memory_order_relaxed);
+	output.irqs = irqs.load(memory_order_relaxed);
+	output.frameTimeMax = frameTimeMax.load(memory_order_relaxed);
+	uint64_t counts[buckets];
+	uint64_t total = 0;
+	for (size_t i = 0; i < buckets; i++)
+	{
+		counts[i] = frameTime[i].load(memory_order_relaxed);
+		total += counts[i];
+	}
+	uint64_t* targets[] = { &output.frameTimeP50, &output.frameTimeP99, &output.frameTimeP999 };
+	const double quantiles[] = { 0.5, 0.99, 0.999 };
+	for (size_t j = 0; j < 3; j++)
+	{
+		uint64_t rank = (uint64_t)(quantiles[j] * total), seen = 0;
+		for (size_t i = 0; i < buckets; i++)
+		{
+			seen += counts[i];
+			if (seen > rank)
+			{
+				*targets[j] = bucketValue(i);
+				break;
+			}
+		}
+	}
+	return output;
+}
+
+bool Metrics::dumpIfDue(wostream& out, bool json)
+{
+	auto now = chrono::steady_clock::now();
+	if (now - lastDump < dumpInterval)
+	{
+		return false;
+	}
+	lastDump = now;
+	MetricsSnapshot s = snapshot();
+	if (json)
+	{
+		s.writeJson(out);
+	}
+	else
+	{
+		s.write(out);
+	}
+	return true;
+}
\ No newline at end of file
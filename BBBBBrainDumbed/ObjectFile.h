@@ -0,0 +1,351 @@
+#pragma once
+#include <stdint.h>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "BitBuffer.h"
+#include "IncludeCache.h"
+#include "MappedFile.h"
+#include "Parser.h"
+
+using namespace std;
+
+/*
+	Relocatable output of one module: a source file with everything it includes, assembled with Parser::relocatable set.
+	Its labels are exported and the symbols it uses without defining are imported; defines and macros stay local, modules share them by including the same file.
+	A relocation is a fixup the module could not finish. Its expression is kept as bytecode over the object's own symbol table, and the linker evaluates it once sections are placed.
+*/
+class ObjectSection
+{
+public:
+	wstring name;
+	BitBuffer bits;
+};
+
+class ObjectSymbol
+{
+public:
+	static constexpr int32_t imported = -1;
+	wstring name;
+	int32_t section = imported;	//index into sections
+	int64_t value = 0;	//bit offset in the section
+};
+
+class Relocation
+{
+public:
+	uint32_t section = 0;
+	Fixup fixup;	//position is in the section, the expression indexes ObjectFile::steps
+};
+
+class ObjectFile
+{
+public:
+	static constexpr char magic[4] = { 'B', 'B', 'O', '1' };
+	wstring name;	//the module's source file
+	vector<ObjectSection> sections;
+	vector<ObjectSymbol> symbols;
+	vector<ExpressionStep> steps;	//ExpressionStep::symbol indexes symbols
+	vector<Relocation> relocations;
+	vector<pair<wstring, uint64_t>> dependencies;	//full path and content hash of every file the module read
+	ObjectFile();
+	ObjectFile(ObjectFile&& other) = default;
+	~ObjectFile();
+	ObjectFile& operator=(ObjectFile&& other) = default;
+	static ObjectFile assemble(wstring filepath);	//throws what Tokenizer and Parser throw
+	static uint64_t hashFile(wstring filepath);	//0 when it cannot be read
+	bool upToDate() const;
+	bool save(wstring filename) const;
+	bool load(wstring filename);
+};
+
+ObjectFile::ObjectFile()
+{
+}
+
+ObjectFile::~ObjectFile()
+{
+}
+
+ObjectFile ObjectFile::assemble(wstring filepath)
+{
+	SourceBuffer source;
+	vector<Token> tokens;
+	{
+		shared_ptr<const TokenizedFile> file = IncludeCache::shared().read(filepath);
+		if (!file)
+		{
+			throw runtime_error("failed to open file");
+		}
+		tokens = IncludeCache::splice(source, *file, filepath);
+	}
+	Parser parser(source, move(tokens), filepath);
+	parser.relocatable = true;
+	ObjectFile output;
+	output.name = filepath;
+	output.sections.emplace_back();
+	output.sections.back().name = L"code";
+	output.sections.back().bits = parser.parse();
+	map<uint32_t, uint32_t> numbers;	//symbol slot to object symbol
+	auto number = [&](size_t slot) {
+		auto j = numbers.find((uint32_t)slot);
+		if (j != numbers.end())
+		{
+			return j->second;
+		}
+		ObjectSymbol symbol;
+		symbol.name = wstring(parser.insts.symbols.name(slot));
+		numbers.insert(make_pair((uint32_t)slot, (uint32_t)output.symbols.size()));
+		output.symbols.push_back(symbol);
+		return (uint32_t)output.symbols.size() - 1;
+	};
+	for (auto& j : parser.labelPositions)
+	{
+		size_t slot = parser.insts.symbols.slot(j.second);
+		ObjectSymbol& symbol = output.symbols[number(slot)];
+		symbol.section = 0;
+		symbol.value = parser.insts.symbols.at(slot).value;	//the last definition, as in a monolithic build
+	}
+	for (auto& j : parser.relocations)
+	{
+		Relocation relocation;
+		relocation.fixup = j;
+		relocation.fixup.expression.begin = output.steps.size();
+		for (size_t k = j.expression.begin; k < j.expression.end; k++)
+		{
+			ExpressionStep step = parser.bytecode[k];
+			if (step.opcode == ExpressionOpcode::symbol)
+			{
+				const Instruction& symbol = parser.insts.symbols.at(step.symbol);
+				if (symbol.itype == InstructionType::knownnumber && !numbers.count(step.symbol))	//a define, its value is final
+				{
+					step.opcode = ExpressionOpcode::constant;
+					step.value = symbol.value;
+				}
+				else
+				{
+					step.symbol = number(step.symbol);
+					step.value = 0;
+				}
+			}
+			else if (step.opcode != ExpressionOpcode::constant)
+			{
+				step.value = 0;	//token indices mean nothing outside the parser
+			}
+			output.steps.push_back(step);
+		}
+		relocation.fixup.expression.end = output.steps.size();
+		output.relocations.push_back(relocation);
+	}
+	for (auto& j : parser.dependencies)
+	{
+		output.dependencies.push_back(make_pair(j, hashFile(j)));
+	}
+	return output;
+}
+
+uint64_t ObjectFile::hashFile(wstring filepath)
+{
+	MappedFile file;
+	if (!file.open(filepath))
+	{
+		return 0;
+	}
+	return IncludeCache::hashContent(string_view((const char*)file.data(), file.size()));
+}
+
+bool ObjectFile::upToDate() const
+{
+	for (auto& j : dependencies)
+	{
+		if (hashFile(j.first) != j.second)
+		{
+			return false;
+		}
+	}
+	return !dependencies.empty();
+}
+
+bool ObjectFile::save(wstring filename) const	//little-endian fields, strings as a length and 32-bit characters
+{
+	ofstream ofs;
+	ofs.open(filename, ios_base::binary | ios_base::out);
+	if (ofs.fail())
+	{
+		return false;
+	}
+	auto put = [&](uint64_t value, size_t bytes) {
+		for (size_t j = 0; j < bytes; j++)
+		{
+			ofs.put((char)(value >> (8 * j)));
+		}
+	};
+	auto putString = [&](const wstring& text) {
+		put(text.size(), 4);
+		for (wchar_t c : text)
+		{
+			put((uint32_t)c, 4);
+		}
+	};
+	ofs.write(magic, sizeof(magic));
+	putString(name);
+	put(dependencies.size(), 4);
+	for (auto& j : dependencies)
+	{
+		putString(j.first);
+		put(j.second, 8);
+	}
+	put(sections.size(), 4);
+	for (auto& j : sections)
+	{
+		putString(j.name);
+		put(j.bits.size(), 8);
+		for (size_t k = 0; k < j.bits.size(); k += 64)
+		{
+			put(j.bits.read(k, 64), 8);
+		}
+	}
+	put(symbols.size(), 4);
+	for (auto& j : symbols)
+	{
+		putString(j.name);
+		put((uint32_t)j.section, 4);
+		put((uint64_t)j.value, 8);
+	}
+	put(steps.size(), 4);
+	for (auto& j : steps)
+	{
+		put((uint8_t)j.opcode, 1);
+		put((uint8_t)j.op, 1);
+		put(j.symbol, 4);
+		put((uint64_t)j.value, 8);
+	}
+	put(relocations.size(), 4);
+	for (auto& j : relocations)
+	{
+		put(j.section, 4);
+		put((uint8_t)j.fixup.kind, 1);
+		put(j.fixup.opcode, 1);
+		put(j.fixup.width, 1);
+		put(j.fixup.position, 8);
+		put(j.fixup.expression.begin, 4);
+		put(j.fixup.expression.end, 4);
+	}
+	ofs.close();
+	return !ofs.fail();
+}
+
+bool ObjectFile::load(wstring filename)	//false on a missing, truncated or inconsistent file, which is then reassembled
+{
+	ifstream ifs;
+	ifs.open(filename, ios_base::binary | ios_base::in);
+	if (ifs.fail())
+	{
+		return false;
+	}
+	auto get = [&](size_t bytes) {
+		uint64_t value = 0;
+		for (size_t j = 0; j < bytes; j++)
+		{
+			value |= (uint64_t)(uint8_t)ifs.get() << (8 * j);
+		}
+		return value;
+	};
+	auto getCount = [&](size_t limit) {	//a count no bigger than what is left of the file, so a damaged one cannot ask for huge allocations
+		size_t value = (size_t)get(4);
+		if (!ifs || value > limit)
+		{
+			ifs.setstate(ios_base::failbit);
+			return (size_t)0;
+		}
+		return value;
+	};
+	ifs.seekg(0, ios_base::end);
+	size_t length = (size_t)ifs.tellg();
+	ifs.seekg(0, ios_base::beg);
+	auto getString = [&]() {
+		wstring text(getCount(length / 4), L'\0');
+		for (auto& c : text)
+		{
+			c = (wchar_t)get(4);
+		}
+		return text;
+	};
+	char header[sizeof(magic)] = {};
+	ifs.read(header, sizeof(header));
+	if (!ifs || !equal(header, header + sizeof(header), magic))
+	{
+		return false;
+	}
+	ObjectFile output;
+	output.name = getString();
+	output.dependencies.resize(getCount(length / 12));
+	for (auto& j : output.dependencies)
+	{
+		j.first = getString();
+		j.second = get(8);
+	}
+	output.sections.resize(getCount(length / 12));
+	for (auto& j : output.sections)
+	{
+		j.name = getString();
+		size_t bits = (size_t)get(8);
+		if (!ifs || bits > length * 8)
+		{
+			return false;
+		}
+		j.bits.reserve(bits);
+		for (size_t k = 0; k < bits; k += 64)
+		{
+			j.bits.append(get(8), min<size_t>(64, bits - k));
+		}
+	}
+	output.symbols.resize(getCount(length / 16));
+	for (auto& j : output.symbols)
+	{
+		j.name = getString();
+		j.section = (int32_t)get(4);
+		j.value = (int64_t)get(8);
+		if (j.section != ObjectSymbol::imported && (j.section < 0 || (size_t)j.section >= output.sections.size()))
+		{
+			return false;
+		}
+	}
+	output.steps.resize(getCount(length / 14));
+	for (auto& j : output.steps)
+	{
+		j.opcode = (ExpressionOpcode)get(1);
+		j.op = (OperatorKind)get(1);
+		j.symbol = (uint32_t)get(4);
+		j.value = (int64_t)get(8);
+		if (j.opcode == ExpressionOpcode::symbol && j.symbol >= output.symbols.size())
+		{
+			return false;
+		}
+	}
+	output.relocations.resize(getCount(length / 23));
+	for (auto& j : output.relocations)
+	{
+		j.section = (uint32_t)get(4);
+		j.fixup.kind = (FixupKind)get(1);
+		j.fixup.opcode = (uint8_t)get(1);
+		j.fixup.width = (uint8_t)get(1);
+		j.fixup.position = (size_t)get(8);
+		j.fixup.expression.begin = (size_t)get(4);
+		j.fixup.expression.end = (size_t)get(4);
+		if (j.section >= output.sections.size() || j.fixup.expression.begin > j.fixup.expression.end || j.fixup.expression.end > output.steps.size() || j.fixup.position + (j.fixup.kind == FixupKind::data ? j.fixup.width : j.fixup.kind == FixupKind::wideImmediate ? 7 * 4 : 7) > output.sections[j.section].bits.size())
+		{
+			return false;
+		}
+	}
+	if (!ifs)
+	{
+		return false;
+	}
+	*this = move(output);
+	return true;
+}
\ No newline at end of file
@@ -0,0 +1,129 @@
+#pragma once
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <ostream>
+#include <thread>
+
+using namespace std;
+
+/*
+	Real-time pacing for the host loop.
+	Deadlines are derived from the total guest ticks since the last resync, so rounding in individual frames never accumulates into drift.
+	Waiting sleeps until spinMargin before the deadline and spins the rest; spinMargin follows the worst recently observed oversleep, which covers coarse OS timers.
+	If the host falls more than maxLag behind it resyncs instead of running frames back to back to catch up.
+*/
+class PacerStatistics
+{
+public:
+	uint64_t frames = 0;
+	uint64_t lateFrames = 0;
+	uint64_t resyncs = 0;
+	double jitterMean = 0;	//seconds, wake time minus deadline
+	double jitterM2 = 0;
+	double jitterMax = 0;
+	double jitterStddev();
+	void add(double jitter);
+	void write(wostream& out);
+};
+
+class Pacer
+{
+public:
+	static constexpr double clock = 230880681.818182;
+	static constexpr double frameRate = 60;
+	static constexpr double ticksPerFrame = clock / frameRate;
+	bool turbo = false;
+	chrono::duration<double> spinMargin = chrono::milliseconds(2);
+	chrono::duration<double> maxLag = chrono::milliseconds(100);
+	PacerStatistics statistics;
+	Pacer();
+	~Pacer();
+	void reset();
+	void frame(uint64_t ticks);
+	bool present();
+private:
+	chrono::steady_clock::time_point origin;
+	double ticks = 0;
+};
+
+double PacerStatistics::jitterStddev()
+{
+	return frames > 1 ? sqrt(jitterM2 / (frames - 1)) : 0;
+}
+
+void PacerStatistics::add(double jitter)
+{
+	frames++;
+	double delta = jitter - jitterMean;
+	jitterMean += delta / frames;
+	jitterM2 += delta * (jitter - jitterMean);
+	jitterMax = max(jitterMax, jitter);
+}
+
+void PacerStatistics::write(wostream& out)
+{
+	out << L"paced frames: " << frames << L" late: " << lateFrames << L" resyncs: " << resyncs << endl;
+	out << L"jitter us mean/stddev/max: " << jitterMean * 1e6 << L"/" << jitterStddev() * 1e6 << L"/" << jitterMax * 1e6 << endl;
+}
+
+Pacer::Pacer()
+{
+	reset();
+}
+
+Pacer::~Pacer()
+{
+}
+
+void Pacer::reset()
+{
+	origin = chrono::steady_clock::now();
+	ticks = 0;
+}
+
+void Pacer::frame(uint64_t _ticks)
+{
+	if (turbo)
+	{
+		reset();
+		return;
+	}
+	ticks += _ticks;
+	auto deadline = origin + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(ticks / clock));
+	auto now = chrono::steady_clock::now();
+	if (now > deadline)
+	{
+		statistics.lateFrames++;
+		if (now - deadline > maxLag)
+		{
+			statistics.resyncs++;
+			reset();
+			return;
+		}
+		statistics.add(chrono::duration<double>(now - deadline).count());
+		return;
+	}
+	auto sleepUntil = deadline - chrono::duration_cast<chrono::steady_clock::duration>(spinMargin);
+	if (now < sleepUntil)
+	{
+		this_thread::sleep_until(sleepUntil);
+		auto woke = chrono::steady_clock::now();
+		if (woke > sleepUntil)
+		{
+			chrono::duration<double> oversleep = woke - sleepUntil;
+			spinMargin = max(spinMargin * 0.99, min(oversleep * 1.25, chrono::duration<double>(maxLag / 2)));	//decay slowly, grow at once
+		}
+	}
+	while ((now = chrono::steady_clock::now()) < deadline)
+	{
+		this_thread::yield();
+	}
+	statistics.add(chrono::duration<double>(now - deadline).count());
+}
+
+bool Pacer::present()
+{
+	return !turbo;
+}
\ No newline at end of file
@@ -1,30 +1,188 @@
 #pragma once
 #include <vector>
-#include <list>
 #include <map>
+#include <set>
 #include <stdexcept>
 #include <fstream>
-#include <deque>
 #include <bitset>
+#include <algorithm>
+#include <bit>
+#include <ostream>
+#include <tuple>
 
+#include "BitBuffer.h"
+#include "IncludeCache.h"
 #include "Instructions.h"
+#include "MappedFile.h"
 #include "Tokenizer.h"
+#include "Trace.h"
 
 using namespace std;
 
+/*
+	A macro is where its definition sits in Parser::input: tokens are only ever inserted or appended after the cursor, so the ranges stay valid and nothing is copied when it is defined.
+	Its scope is the symbol count at the definition; SymbolTable only appends, so those symbols are exactly what was visible there.
+	Which body tokens are arguments is worked out once, so an expansion is one pass over slots that copies either the body token or the argument's tokens.
+*/
 class Macro
 {
 public:
-	vector<Token> args;
-	list<Token> body;
-	Instructions insts;
+	size_t name = 0;	//token indices in Parser::input
+	size_t argsBegin = 0, argsEnd = 0;
+	size_t bodyBegin = 0, bodyEnd = 0;
+	size_t scope = 0;
+	vector<uint16_t> slots;	//per body token: 0 to copy it, otherwise the argument number + 1
 };
 
-class ParserError : public runtime_error
+class MacroExpansion
 {
 public:
+	wstring name;
 	Token token;
-	ParserError(string message, Token _token) :runtime_error(message) {
+	size_t begin = 0, end = 0;	//bit positions in the output
+	size_t resume = 0;	//token index parsing continues at after the body, which is appended to the input
+};
+
+enum class ExpressionOpcode : uint8_t
+{
+	constant,
+	symbol,
+	unary,
+	binary,
+};
+
+class ExpressionStep
+{
+public:
+	ExpressionOpcode opcode = ExpressionOpcode::constant;
+	OperatorKind op = OperatorKind::none;
+	uint32_t symbol = 0;	//slot in Instructions::symbols
+	int64_t value = 0;	//the constant, or for symbols and operators the token index an error is reported at
+};
+
+/*
+	Operands are compiled once, while the source is parsed, into reverse polish steps appended to Parser::bytecode.
+	Numbers are decoded and constant sub-expressions folded at that point; symbols stay references to their slot, so labels defined later are read when the fixups are evaluated.
+*/
+class Expression	//[begin, end) of Parser::bytecode
+{
+public:
+	size_t begin = 0, end = 0;
+};
+
+enum class FixupKind : uint8_t
+{
+	immediate,	//ldi.4, ldi.1: the operand bits of one opcode
+	wideImmediate,	//ldi.16: four ldi.4
+	data,	//ed: width bits
+};
+
+class Fixup
+{
+public:
+	FixupKind kind = FixupKind::immediate;
+	uint8_t opcode = 0;	//of immediate
+	uint8_t width = 0;	//of data
+	size_t position = 0;	//bit position in the output
+	Expression expression;
+	void write(BitBuffer& output, int64_t value) const;
+};
+
+class LoadPlan	//opcodes that load a constant into OP1 and leave I where it was
+{
+public:
+	vector<uint8_t> opcodes;
+	size_t ticks = 0;
+	bool operator<(const LoadPlan& other) const;	//fewer ticks, then fewer bits
+};
+
+/*
+	What straight-line code has selected so far: the OP1 and OP2 registers and the values of I and J, -1 where unknown, and which bits of each register are known.
+	Only op1 and op2 change a selection; I and J move by the advances in the opcode table, and mti and mtj load values the assembler cannot know.
+	clr, ldi.4 and ldi.1 with a known operand, and mov.16 and not.16 of a known register set register bits; any other write through a select forgets that register, or all of them when the select is unknown.
+	A label may be reached from anywhere, so it forgets everything, as does data in the code stream and any write through a select that points at P.
+	Interrupt handlers are assumed to leave the selects, I, J and the registers as they found them, which code that spans any two instructions already depends on.
+*/
+class SelectState
+{
+public:
+	int8_t op1 = -1, op2 = -1, i = -1, j = -1;
+	uint16_t value[8] = {}, known[8] = {};
+	bool redundant(uint8_t opcode) const;	//for op1, op2, cli and clj: selects what is already selected
+	void step(uint8_t opcode, bool operandKnown = true);	//an ldi.4 or ldi.1 whose operand is not known yet comes with its low bits clear
+	void reset();
+	void forget(int8_t r);	//-1 for every register
+	LoadPlan load(uint16_t constant) const;	//the cheapest way to do what ldi.16 constant would
+	bool operator==(const SelectState& other) const = default;
+private:
+	void fill(uint16_t current, uint16_t mask, uint16_t target, LoadPlan& plan) const;	//appends ldi.4, ldi.1, add4i, inci and cli from I to the register holding target
+};
+
+/*
+	ldi.16 relaxation across passes. Every ldi.16 is emitted for a value, the one its expression has when it is read or else what the previous pass resolved it to, as the plan SelectState::load picks;
+	ldi.4 and ldi.1 operands known when they are read feed SelectState the same way. Each pass checks every such assumption once labels are placed, and another pass runs while one failed
+	or a load emitted in full could now be shorter. A load still moving after half the passes is pinned to four ldi.4 with a fixup; after passLimit passes relaxation is switched off.
+*/
+class Relaxation
+{
+public:
+	static constexpr size_t passLimit = 8;
+	vector<int64_t> values;	//of every ldi.16 in parse order, as the last pass resolved them
+	vector<bool> pinned;
+	vector<bool> opaque;	//ldi.4 and ldi.1 whose operand changed after it was read, in parse order
+	size_t passes = 0;
+	bool settled = true;
+};
+
+class ConstantLoad	//one ldi.16 of a relaxing pass
+{
+public:
+	Expression expression;
+	int64_t assumed = -1;	//the value its code was emitted for, -1 when it went out as four ldi.4 and a fixup
+	bool relaxable = false;	//outside nopt and not pinned
+	SelectState selects;	//before it
+	LoadPlan plan;	//what went out for assumed
+};
+
+/*
+	An active repeat. The body is parsed again from begin for every iteration, with the iteration variable bound to index wherever an expression reads it.
+	When the first iteration only emitted code and fixups, the rest are copies of its bits instead.
+*/
+class Repetition
+{
+public:
+	Token token;
+	size_t begin = 0;	//token index of the first body token
+	int64_t count = 0;
+	int64_t index = 0;
+	int64_t variable = -1;	//symbol slot, -1 without one
+	Instruction shadowed = Instruction(InstructionType::unknownnumber);	//what the variable's name meant before the loop, restored after it
+	size_t output = 0, instructions = 0, fixups = 0, loads = 0, immediates = 0, peepholeRemoved = 0, peepholeTicks = 0;	//sizes and counters when the first iteration started
+	uint64_t sideEffects = 0;
+	SelectState selects;	//when the first iteration started, copies are only valid if it ended the same
+};
+
+class TickAssertion	//assert_ticks limit: code since the enclosing macro expansion (or the last label) must fit in limit ticks
+{
+public:
+	Token token;
+	Expression limit;
+	size_t begin = 0, end = 0;
+};
+
+class CodeBlock
+{
+public:
+	size_t begin = 0, end = 0;
+	size_t instructions = 0;
+	size_t minTicks = 0, maxTicks = 0;
+};
+
+class ParserError : public runtime_error
+{
+public:
+	TokenText token;
+	ParserError(string message, TokenText _token) :runtime_error(message) {
 		token = _token;
 	}
 };
@@ -33,79 +191,384 @@ class Parser
 {
 public:
 	Instructions insts;
-	list<Token>* input;
-	list<Token>::iterator i;
+	SourceBuffer& source;
+	vector<Token> input;
+	size_t i = 0;	//cursor into input
 	vector<wstring> fileHierarchy;
-	map<wstring, Macro> macros;
-	vector<wstring> macroHierarchy;
-	Parser(list<Token>* _input, wstring _filename);
+	vector<Macro> macros;	//indexed by the value of their symbol
+	Trace* trace = nullptr;
+	vector<size_t> instructionStarts;	//bit position of every emitted opcode, ascending
+	multimap<size_t, wstring> labelPositions;
+	vector<MacroExpansion> expansions;
+	vector<TickAssertion> tickAssertions;
+	vector<CodeBlock> blocks;
+	set<wstring> dependencies;	//full path of every file the assembly read, for watch mode
+	bool relocatable = false;	//leave fixups that read labels or undefined symbols to the linker, see ObjectFile
+	vector<Fixup> relocations;	//those fixups, their bits hold the value 0
+	vector<ExpressionStep> bytecode;
+	bool peephole = false;	//drop op1, op2, cli and clj that select what SelectState shows is already selected, outside nopt ... endnopt
+	size_t peepholeRemoved = 0, peepholeTicks = 0;	//instructions dropped and the ticks one pass over them took
+	bool relax = false;	//emit each ldi.16 as the cheapest sequence for its value, see Relaxation; ignored when relocatable
+	Relaxation relaxation;	//from the previous pass going in, for the next one coming out
+	size_t relaxedLoads = 0, relaxedTicks = 0, relaxedBits = 0;	//ldi.16 made shorter, and what that saved
+	Parser(SourceBuffer& _source, vector<Token> _input, wstring _filename);
 	~Parser();
-	bool hasNumber(Token input);
-	bool isParsable(Token input);
-	int64_t toNumber(bool allowUnknown);
-	list<Token>::iterator peekToken();
-	list<Token>::iterator getToken();
-	bool isUnary(list<Token>::iterator begin);
-	int64_t parse_unary(list<Token>::iterator begin, bool allowUnknown);
-	int64_t parse_main(list<Token>::iterator begin, int64_t lhs, int64_t precedence, bool allowUnknown);
-	int64_t parse_init(bool allowUnknown);
+	wstring_view view(size_t position);
+	ParserError error(string message, size_t position);
+	bool hasNumber(const Token& input);
+	bool isParsable(size_t position);
+	void compileNumber();
+	size_t peekToken();
+	size_t getToken();
+	bool isUnary(size_t begin);
+	void compile_unary(size_t begin);
+	void compile_main(size_t begin, int64_t precedence);
+	Expression compile_init();
+	int64_t evaluate(Expression expression);
 	bool checkDependencyCycleAndAssign(vector<wstring>* Hierarchy, wstring name);
-	vector<bool> parse();
+	void prefetch(size_t begin, size_t end);
+	BitBuffer parse();
+	pair<size_t, size_t> ticks(const BitBuffer& output, size_t begin, size_t end);
+	void analyzeTicks(const BitBuffer& output);
+	void listing(const BitBuffer& output, wostream& out);
+	static int64_t apply(OperatorKind op, int64_t lhs, int64_t rhs);
+	static int64_t apply(OperatorKind op, int64_t operand);
 private:
+	vector<size_t> expansionStack;
+	size_t lastLabel = 0;
+	vector<pair<size_t, size_t>> arguments;	//token ranges of the macro invocation being expanded
+	vector<Repetition> repetitions;
+	uint64_t sideEffects = 0;	//counts what a copied iteration would not redo: labels, definitions, includes, macros, tick assertions, nested repeats and iteration variables
+	vector<int64_t> stack;	//evaluate's, kept between calls
+	SelectState selects;
+	vector<Token> untouchable;	//the open nopt directives, innermost last
+	bool optimize(uint8_t opcode, bool operandKnown = true);	//true when the opcode is redundant and is not emitted
+	vector<ConstantLoad> loads;	//every ldi.16 of a relaxing pass
+	vector<pair<Fixup, int64_t>> immediates;	//every ldi.4 and ldi.1 of a relaxing pass, with the operand it was tracked with or -1
+	bool resolvable(Expression expression);	//every symbol it reads has a value already
+	void relaxLoads();
+	map<wstring, shared_future<shared_ptr<const TokenizedFile>>> prefetched;	//include files by full path, read and tokenized on IncludeCache's pool
+	void emit(ExpressionStep step);
 
 };
 
-Parser::Parser(list<Token>* _input, wstring _filename)
+bool LoadPlan::operator<(const LoadPlan& other) const
+{
+	return ticks != other.ticks ? ticks < other.ticks : opcodes.size() < other.opcodes.size();
+}
+
+bool SelectState::redundant(uint8_t opcode) const
+{
+	if (opcode <= 7)
+	{
+		return op1 == opcode;
+	}
+	if (opcode <= 15)
+	{
+		return op2 == opcode - 8;
+	}
+	if (opcode == 86)	//cli
+	{
+		return i == 0;
+	}
+	if (opcode == 91)	//clj
+	{
+		return j == 0;
+	}
+	return false;
+}
+
+void SelectState::step(uint8_t opcode, bool operandKnown)
+{
+	const OpcodeInfo& info = isa[opcode];
+	if (opcode <= 7)
+	{
+		op1 = opcode;
+		return;
+	}
+	if (opcode <= 15)
+	{
+		op2 = opcode - 8;
+		return;
+	}
+	if (((info.effects & writeOp1) && op1 == 7) || ((info.effects & writeOp2) && op2 == 7))	//a write to P is a jump
+	{
+		reset();
+		return;
+	}
+	if (opcode == 55 && op1 >= 0)	//clr
+	{
+		value[op1] = 0;
+		known[op1] = 0xffff;
+	}
+	else if ((info.operand == OperandKind::nibble || info.operand == OperandKind::bit) && op1 >= 0 && i >= 0 && operandKnown)	//ldi.4, ldi.1
+	{
+		uint16_t mask = rotl((uint16_t)(info.operand == OperandKind::bit ? 0x1 : 0xf), i);
+		value[op1] = (value[op1] & ~mask) | (rotl((uint16_t)(opcode & 0xf), i) & mask);
+		known[op1] |= mask;
+	}
+	else if ((opcode == 48 || opcode == 49) && op1 >= 0 && op2 >= 0)	//mov.16, not.16
+	{
+		value[op1] = opcode == 49 ? ~value[op2] : value[op2];
+		known[op1] = known[op2];
+	}
+	else
+	{
+		if (info.effects & writeOp1)
+		{
+			forget(op1);
+		}
+		if (info.effects & writeOp2)	//the post-incrementing loads and stores
+		{
+			forget(op2);
+		}
+	}
+	if (opcode == 86)	//cli
+	{
+		i = 0;
+	}
+	else if (opcode == 91)	//clj
+	{
+		j = 0;
+	}
+	if ((info.effects & writeI) && opcode != 86)
+	{
+		i = i >= 0 && info.advanceI ? (i + info.advanceI) & 0xf : -1;	//mti loads I from a register
+	}
+	if ((info.effects & writeJ) && opcode != 91)
+	{
+		j = j >= 0 && info.advanceJ ? (j + info.advanceJ) & 0xf : -1;
+	}
+}
+
+void SelectState::reset()
+{
+	op1 = op2 = i = j = -1;
+	forget(-1);
+}
+
+void SelectState::forget(int8_t r)
+{
+	if (r < 0)
+	{
+		fill_n(known, 8, 0);
+		fill_n(value, 8, 0);
+	}
+	else
+	{
+		known[r] = 0;
+		value[r] = 0;	//so equal states compare equal
+	}
+}
+
+LoadPlan SelectState::load(uint16_t constant) const
+{
+	LoadPlan output;
+	for (size_t n = 0; n < 4; n++)	//what ldi.16 itself emits, right for any I
+	{
+		output.opcodes.push_back((uint8_t)(64 | ((constant >> (4 * n)) & 0xf)));
+		output.ticks += isa[64].ticks;
+	}
+	if (op1 < 0 || op1 == 7)	//clr there could be a jump
+	{
+		return output;
+	}
+	bool same = op1 == op2;	//not.16 then inverts OP1 in place
+	LoadPlan candidate;
+	for (size_t start = 0; start < (same ? 3u : 2u); start++)	//as it is, after clr, after clr and not.16
+	{
+		for (size_t invert = 0; invert < (same ? 2u : 1u); invert++)
+		{
+			candidate.opcodes.clear();
+			candidate.ticks = 0;
+			uint16_t current = value[op1], mask = known[op1];
+			for (size_t k = 0; k < start; k++)
+			{
+				candidate.opcodes.push_back(k ? 49 : 55);
+				candidate.ticks += isa[k ? 49 : 55].ticks;
+				current = k ? 0xffff : 0;
+				mask = 0xffff;
+			}
+			fill(current, mask, invert ? ~constant : constant, candidate);
+			if (invert)
+			{
+				candidate.opcodes.push_back(49);
+				candidate.ticks += isa[49].ticks;
+			}
+			if (candidate < output)
+			{
+				output = candidate;
+			}
+		}
+	}
+	return output;
+}
+
+void SelectState::fill(uint16_t current, uint16_t mask, uint16_t target, LoadPlan& plan) const
+{
+	if (i >= 0)	//bit p below is the one I + p points at
+	{
+		current = rotr(current, i);
+		mask = rotr(mask, i);
+	}
+	else if (mask != 0xffff || (current != 0 && current != 0xffff))	//without I only a register that reads the same at every rotation is known
+	{
+		mask = 0;
+	}
+	uint16_t wrong = (uint16_t)~mask | (current ^ target);
+	auto settled = [&](size_t p, size_t length) {
+		return !((wrong >> p) & ((1u << length) - 1));
+	};
+	if (!wrong)
+	{
+		return;
+	}
+	size_t cost[17];
+	uint8_t choice[17] = {};	//opcode that reached p, 0 for none
+	fill_n(cost, 17, SIZE_MAX);
+	cost[0] = 0;
+	for (size_t p = 0; p < 16; p++)
+	{
+		if (cost[p] == SIZE_MAX)
+		{
+			continue;
+		}
+		auto relax = [&](size_t next, uint8_t opcode) {
+			if (next <= 16 && cost[p] + isa[opcode].ticks < cost[next])
+			{
+				cost[next] = cost[p] + isa[opcode].ticks;
+				choice[next] = opcode;
+			}
+		};
+		relax(p + 4, (uint8_t)(64 | ((target >> p) & 0xf)));	//ldi.4
+		relax(p + 1, (uint8_t)(126 | ((target >> p) & 0x1)));	//ldi.1
+		if (p + 4 <= 16 && settled(p, 4))
+		{
+			relax(p + 4, 88);	//add4i
+		}
+		if (settled(p, 1))
+		{
+			relax(p + 1, 87);	//inci
+		}
+	}
+	size_t end = 16, total = cost[16];
+	if (i == 0)	//or stop once the rest is right and put I back with cli
+	{
+		for (size_t p = 1; p < 16; p++)
+		{
+			if (cost[p] != SIZE_MAX && settled(p, 16 - p) && cost[p] + isa[86].ticks < total)
+			{
+				end = p;
+				total = cost[p] + isa[86].ticks;
+			}
+		}
+	}
+	vector<uint8_t> path;
+	for (size_t p = end; p > 0;)
+	{
+		uint8_t opcode = choice[p];
+		path.push_back(opcode);
+		p -= opcode == 88 || (opcode >= 64 && opcode < 80) ? 4 : 1;
+	}
+	plan.opcodes.insert(plan.opcodes.end(), path.rbegin(), path.rend());
+	if (end != 16)
+	{
+		plan.opcodes.push_back(86);
+	}
+	plan.ticks += total;
+}
+
+void Fixup::write(BitBuffer& output, int64_t value) const
+{
+	if (kind == FixupKind::data)
+	{
+		output.write(position, value, width);
+	}
+	else if (kind == FixupKind::wideImmediate)
+	{
+		uint64_t m = 0;
+		for (size_t n = 0; n < 4; n++)	//four ldi.4, low nibble first
+		{
+			m |= (uint64_t)(((value >> (4 * n)) & 0xf) | 0x40) << (7 * n);
+		}
+		output.write(position, m, 7 * 4);
+	}
+	else
+	{
+		value &= isa[opcode].operand == OperandKind::bit ? 0x1 : 0xf;
+		output.write(position, opcode | value, 7);
+	}
+}
+
+Parser::Parser(SourceBuffer& _source, vector<Token> _input, wstring _filename) : source(_source), input(move(_input))
 {
-	input = _input;
 	wchar_t* fullpath = _wfullpath(NULL, _filename.c_str(), _MAX_PATH);
 	if (!fullpath)
 	{
 		throw runtime_error("invalid path");
 	}
 	fileHierarchy.push_back(wstring(fullpath));
+	dependencies.insert(wstring(fullpath));
+	input.push_back(source.generated(input.empty() ? Token() : input.back(), L" endoffile"));	//macro bodies are appended after it
+	prefetch(0, input.size());
 }
 
 Parser::~Parser()
 {
 }
 
-bool Parser::hasNumber(Token input)
+wstring_view Parser::view(size_t position)	//empty past the end, so lookahead needs no bounds check
+{
+	return position < input.size() ? source.view(input[position]) : wstring_view();
+}
+
+ParserError Parser::error(string message, size_t position)
+{
+	return ParserError(message, position < input.size() ? source.resolve(input[position]) : TokenText());
+}
+
+bool Parser::hasNumber(const Token& input)
 {
 	/*
 		followings has number: binary(start with 0b), quaternary(start with 0q), octal(start with 0o or 0), decimal(no prefix or start with 0d), hexadecimal(start with 0x), quoted text(surrounded by ' or "), identifier(enything else without end with :), label(enything else with end with :)
 		followings does not have number: mnemonic, directive, operator
 	*/
-	auto i = insts.inst.find(input.token);
-	if (i != insts.inst.end() && (i->second.itype == InstructionType::mnemonic || i->second.itype == InstructionType::directive || i->second.itype == InstructionType::$operator))
+	if (input.op != OperatorKind::none)
 	{
 		return false;
 	}
-	return true;
+	const Instruction* i = Instructions::keywords().find(source.view(input));
+	return !i || (i->itype != InstructionType::mnemonic && i->itype != InstructionType::directive);
 }
 
-bool Parser::isParsable(Token input)
+bool Parser::isParsable(size_t position)
 {
-	return hasNumber(input) || input.type == $TokenType::LeftParenthesis || input.type == $TokenType::Operator;
+	return position < input.size() && (hasNumber(input[position]) || input[position].type == $TokenType::LeftParenthesis || input[position].type == $TokenType::Operator);
 }
 
-int64_t Parser::toNumber(bool allowUnknown)
+void Parser::compileNumber()
 {
-	auto j = i->token;
-	auto k = insts.inst.find(j);
-	if (k != insts.inst.end())
+	wstring j(view(i));
+	ExpressionStep step;
+	const Instruction* k = insts.find(j);
+	if (k)
 	{
-		if (k->second.itype == InstructionType::knownnumber)
+		if (k->itype != InstructionType::knownnumber && k->itype != InstructionType::unknownnumber)
 		{
-			return k->second.value;
+			throw error("unresolved value", i);
 		}
-		else if (k->second.itype == InstructionType::unknownnumber && allowUnknown)
+		step.opcode = ExpressionOpcode::symbol;
+		step.symbol = (uint32_t)insts.symbols.slot(j);
+		step.value = i;
+		for (auto l = repetitions.rbegin(); l != repetitions.rend(); l++)	//iteration variables are bound now, fixups run after the loop
 		{
-			return 0;
-		}
-		else
-		{
-			throw ParserError("unresolved value", *i);
+			if (l->variable == step.symbol)
+			{
+				step.opcode = ExpressionOpcode::constant;
+				step.value = l->index;
+				sideEffects++;
+				break;
+			}
 		}
 	}
 	else if (j[0] == L'0')
@@ -113,239 +576,274 @@ int64_t Parser::toNumber(bool allowUnknown)
 		if (j[1] == L'b')
 		{
 			j.erase(0, 2);
-			return stoll(j, nullptr, 2);
+			step.value = stoll(j, nullptr, 2);
 		}
 		else if (j[1] == L'q')
 		{
 			j.erase(0, 2);
-			return stoll(j, nullptr, 4);
+			step.value = stoll(j, nullptr, 4);
 		}
 		else if (j[1] == L'o')
 		{
 			j.erase(0, 2);
-			return stoll(j, nullptr, 8);
+			step.value = stoll(j, nullptr, 8);
 		}
 		else if (j[1] == L'd')
 		{
 			j.erase(0, 2);
-			return stoll(j, nullptr, 10);
+			step.value = stoll(j, nullptr, 10);
 		}
 		else if (j[1] == L'x')
 		{
 			j.erase(0, 2);
-			return stoll(j, nullptr, 16);
+			step.value = stoll(j, nullptr, 16);
 		}
 		else
 		{
-			return stoll(j, nullptr, 0);
+			step.value = stoll(j, nullptr, 0);
 		}
 	}
 	else if (j[0] >= L'1' && j[0] <= L'9')
 	{
-		return stoll(j, nullptr, 10);
+		step.value = stoll(j, nullptr, 10);
 	}
 	else if ((j[0] == L'\"' && j.back() == L'\"') || (j[0] == L'\'' && j.back() == L'\''))
 	{
 		j.erase(0, 1);
 		j.erase(j.size() - 1, 1);
 		j.resize(sizeof(wchar_t) * 4, 0);
-		return (int64_t)*j.c_str();
+		step.value = (int64_t)*j.c_str();
 	}
 	else
 	{
-		//throw ParserError("not a number", *i);
-		insts.inst.insert(make_pair(j, Instruction(InstructionType::unknownnumber)));
+		step.opcode = ExpressionOpcode::symbol;
+		step.symbol = (uint32_t)insts.symbols.slot(j);	//defined later, or reported when evaluated
+		step.value = i;
 	}
-	return 0;
+	emit(step);
 }
 
-list<Token>::iterator Parser::peekToken()
+size_t Parser::peekToken()
 {
-	auto j = ++i;
-	--i;
-	return j;
+	return i + 1;
 }
 
-list<Token>::iterator Parser::getToken()
+size_t Parser::getToken()
 {
 	return ++i;
 }
 
-bool Parser::isUnary(list<Token>::iterator begin)
+bool Parser::isUnary(size_t begin)
 {
-	bool output = false;
 	if (i == begin)
 	{
 		return true;
 	}
-	--i;
-	auto j = insts.inst.find(i->token);
-	if (j != insts.inst.end() && j->second.itype == InstructionType::$operator)
-	{
-		output = true;
-	}
-	if (i->token == L")")
-	{
-		output = true;
-	}
-	++i;
-	return output;
+	return input[i - 1].op != OperatorKind::none || input[i - 1].type == $TokenType::RightParenthesis;
 }
 
-int64_t Parser::parse_unary(list<Token>::iterator begin, bool allowUnknown)
+void Parser::compile_unary(size_t begin)
 {
-	int64_t value = 0;
-	if (i->token == L"(")
+	OperatorKind op = i < input.size() ? input[i].op : OperatorKind::none;
+	if (i < input.size() && input[i].type == $TokenType::LeftParenthesis)
 	{
 		getToken();
-		value = parse_init(allowUnknown);
+		compile_init();
 		getToken();
-		if (i->token != L")")
+		if (i >= input.size() || input[i].type != $TokenType::RightParenthesis)
 		{
 			throw runtime_error("Right parenthesis missing");
 		}
 	}
-	else if (i->token == L"-" && isUnary(begin) && !allowUnknown)	//unary minus if previous token does not exist or is operator or right parenthesis
+	else if ((op == OperatorKind::subtract || op == OperatorKind::add || op == OperatorKind::bitNot || op == OperatorKind::boolNot) && isUnary(begin))	//unary if previous token does not exist or is operator or right parenthesis
 	{
+		ExpressionStep step;
+		step.opcode = ExpressionOpcode::unary;
+		step.op = op;
+		step.value = i;
 		getToken();
-		value -= parse_unary(begin, allowUnknown);
+		compile_unary(begin);
+		emit(step);
 	}
-	else if (i->token == L"+" && isUnary(begin) && !allowUnknown)
+	else if (i < input.size() && hasNumber(input[i]))
 	{
-		getToken();
-		value += parse_unary(begin, allowUnknown);
+		compileNumber();
 	}
-	else if (i->token == L"~" && isUnary(begin) && !allowUnknown)
+	else
 	{
-		getToken();
-		value = ~parse_unary(begin, allowUnknown);
+		throw error("parsable token expacted", i);
 	}
-	else if (i->token == L"!" && isUnary(begin) && !allowUnknown)
+}
+
+void Parser::compile_main(size_t begin, int64_t precedence)
+{
+	size_t j = peekToken();
+	while (j < input.size() && operatorInfo(input[j].op).precedence >= precedence)
 	{
+		ExpressionStep step;
+		step.opcode = ExpressionOpcode::binary;
+		step.op = input[j].op;
+		step.value = j;
 		getToken();
-		value = !parse_unary(begin, allowUnknown);
-	}
-	else if (hasNumber(*i))
-	{
-		value = toNumber(allowUnknown);
+		getToken();
+		compile_unary(begin);
+		j = peekToken();
+		while (j < input.size() && (operatorInfo(step.op).precedence < operatorInfo(input[j].op).precedence || (operatorInfo(input[j].op).associativity == Associativity::right_associative && operatorInfo(step.op).precedence == operatorInfo(input[j].op).precedence)))
+		{
+			compile_main(begin, operatorInfo(step.op).precedence + 1);
+			j = peekToken();
+		}
+		emit(step);
 	}
-	else if (allowUnknown)
+}
+
+Expression Parser::compile_init()
+{
+	Expression expression;
+	expression.begin = bytecode.size();
+	size_t begin = i;
+	compile_unary(begin);
+	compile_main(begin, 0);
+	expression.end = bytecode.size();
+	return expression;
+}
+
+void Parser::emit(ExpressionStep step)	//folds operators whose operands are constants
+{
+	size_t n = bytecode.size();
+	if (step.opcode == ExpressionOpcode::unary && n >= 1 && bytecode[n - 1].opcode == ExpressionOpcode::constant)
 	{
-		getToken();
+		bytecode[n - 1].value = apply(step.op, bytecode[n - 1].value);
+		return;
 	}
-	else
+	if (step.opcode == ExpressionOpcode::binary && n >= 2 && bytecode[n - 2].opcode == ExpressionOpcode::constant && bytecode[n - 1].opcode == ExpressionOpcode::constant && !((step.op == OperatorKind::divide || step.op == OperatorKind::modulo) && bytecode[n - 1].value == 0))
 	{
-
+		bytecode[n - 2].value = apply(step.op, bytecode[n - 2].value, bytecode[n - 1].value);
+		bytecode.pop_back();
+		return;
 	}
-	return value;
+	bytecode.push_back(step);
 }
 
-int64_t Parser::parse_main(list<Token>::iterator begin, int64_t lhs, int64_t precedence, bool allowUnknown)
+int64_t Parser::evaluate(Expression expression)
 {
-	list<Token>::iterator j = peekToken();
-	auto k = insts.inst.find((j)->token);
-	while ((j) != input->end() && (j->token != L")") && k != insts.inst.end() && k->second.itype == InstructionType::$operator && k->second.value >= precedence)
+	stack.clear();
+	for (size_t j = expression.begin; j < expression.end; j++)
 	{
-		Token op = *j;
-		getToken();
-		getToken();
-		int64_t rhs = parse_unary(begin, allowUnknown);
-		j = peekToken();
-		while ((j != input->end()) && (j->token != L")") && ((insts.inst.find(op.token)->second.value < insts.inst.find((j)->token)->second.value) || (insts.inst.find((j)->token)->second.atype == Associativity::right_associative && (insts.inst.find(op.token)->second.value == insts.inst.find((j)->token)->second.value))))
+		const ExpressionStep& step = bytecode[j];
+		switch (step.opcode)
 		{
-			rhs = parse_main(begin, rhs, insts.inst.find(op.token)->second.value + 1, allowUnknown);
-			j = peekToken();
-		}
-		if (!allowUnknown)
+		case ExpressionOpcode::constant:
+			stack.push_back(step.value);
+			break;
+		case ExpressionOpcode::symbol:
 		{
-			if (op.token == L"+")
-			{
-				lhs += rhs;
-			}
-			else if (op.token == L"-")
-			{
-				lhs -= rhs;
-			}
-			else if (op.token == L"*")
-			{
-				lhs *= rhs;
-			}
-			else if (op.token == L"/")
-			{
-				lhs /= rhs;
-			}
-			else if (op.token == L"%")
-			{
-				lhs %= rhs;
-			}
-			else if (op.token == L"|")
-			{
-				lhs |= rhs;
-			}
-			else if (op.token == L"&")
-			{
-				lhs &= rhs;
-			}
-			else if (op.token == L"^")
-			{
-				lhs ^= rhs;
-			}
-			else if (op.token == L"<<")
-			{
-				lhs = lhs << rhs;
-			}
-			else if (op.token == L">>")
-			{
-				lhs = ((uint64_t)lhs) >> rhs;
-			}
-			else if (op.token == L">>>")
-			{
-				lhs = ((int64_t)lhs) >> rhs;
-			}
-			else if (op.token == L"||")
-			{
-				lhs = (lhs != 0) || (rhs != 0);
-			}
-			else if (op.token == L"&&")
-			{
-				lhs = (lhs != 0) && (rhs != 0);
-			}
-			else if (op.token == L"^^")
-			{
-				lhs = (lhs != 0) != (rhs != 0);
-			}
-			else if (op.token == L"<")
-			{
-				lhs = lhs < rhs;
-			}
-			else if (op.token == L">")
-			{
-				lhs = lhs > rhs;
-			}
-			else if (op.token == L"<=")
-			{
-				lhs = lhs <= rhs;
-			}
-			else if (op.token == L">=")
-			{
-				lhs = lhs >= rhs;
-			}
-			else if (op.token == L"!=")
+			const Instruction& symbol = insts.symbols.at(step.symbol);
+			if (symbol.itype != InstructionType::knownnumber)
 			{
-				lhs = lhs != rhs;;
+				throw error("unresolved value", (size_t)step.value);
 			}
-			else if (op.token == L"==")
+			stack.push_back(symbol.value);
+			break;
+		}
+		case ExpressionOpcode::unary:
+			stack.back() = apply(step.op, stack.back());
+			break;
+		case ExpressionOpcode::binary:
+		{
+			int64_t rhs = stack.back();
+			stack.pop_back();
+			if ((step.op == OperatorKind::divide || step.op == OperatorKind::modulo) && rhs == 0)
 			{
-				lhs = lhs == rhs;
+				throw error("division by zero", (size_t)step.value);
 			}
+			stack.back() = apply(step.op, stack.back(), rhs);
+			break;
 		}
+		}
+	}
+	return stack.empty() ? 0 : stack.back();
+}
+
+int64_t Parser::apply(OperatorKind op, int64_t lhs, int64_t rhs)
+{
+	switch (op)
+	{
+	case OperatorKind::add:
+		return lhs + rhs;
+	case OperatorKind::subtract:
+		return lhs - rhs;
+	case OperatorKind::multiply:
+		return lhs * rhs;
+	case OperatorKind::divide:
+		return lhs / rhs;
+	case OperatorKind::modulo:
+		return lhs % rhs;
+	case OperatorKind::bitOr:
+		return lhs | rhs;
+	case OperatorKind::bitAnd:
+		return lhs & rhs;
+	case OperatorKind::bitXor:
+		return lhs ^ rhs;
+	case OperatorKind::shiftLeft:
+		return lhs << rhs;
+	case OperatorKind::shiftRight:
+		return ((uint64_t)lhs) >> rhs;
+	case OperatorKind::arithmeticShiftRight:
+		return lhs >> rhs;
+	case OperatorKind::boolOr:
+		return (lhs != 0) || (rhs != 0);
+	case OperatorKind::boolAnd:
+		return (lhs != 0) && (rhs != 0);
+	case OperatorKind::boolXor:
+		return (lhs != 0) != (rhs != 0);
+	case OperatorKind::less:
+		return lhs < rhs;
+	case OperatorKind::greater:
+		return lhs > rhs;
+	case OperatorKind::lessEqual:
+		return lhs <= rhs;
+	case OperatorKind::greaterEqual:
+		return lhs >= rhs;
+	case OperatorKind::notEqual:
+		return lhs != rhs;
+	case OperatorKind::equal:
+		return lhs == rhs;
+	default:	//',' and the unary-only operators keep the left operand
+		return lhs;
 	}
-	return lhs;
 }
 
-int64_t Parser::parse_init(bool allowUnknown)
+int64_t Parser::apply(OperatorKind op, int64_t operand)
 {
-	return parse_main(i, parse_unary(i, allowUnknown), 0, allowUnknown);
+	switch (op)
+	{
+	case OperatorKind::subtract:
+		return -operand;
+	case OperatorKind::bitNot:
+		return ~operand;
+	case OperatorKind::boolNot:
+		return !operand;
+	default:
+		return operand;
+	}
+}
+
+void Parser::prefetch(size_t begin, size_t end)	//start reading the files that include directives in [begin, end) name, before the parser gets to them
+{
+	for (size_t k = begin; k + 1 < end; k++)
+	{
+		if (input[k].type == $TokenType::Default && input[k + 1].type == $TokenType::QuotedText && view(k) == L"include")
+		{
+			wstring filepath(view(k + 1));
+			wchar_t* fullpath = _wfullpath(NULL, filepath.c_str(), _MAX_PATH);
+			if (fullpath && !prefetched.count(fullpath))
+			{
+				prefetched.insert(make_pair(wstring(fullpath), IncludeCache::shared().prefetch(filepath)));
+			}
+			free(fullpath);
+		}
+	}
 }
 
 bool Parser::checkDependencyCycleAndAssign(vector<wstring>* Hierarchy, wstring name)
@@ -361,19 +859,85 @@ bool Parser::checkDependencyCycleAndAssign(vector<wstring>* Hierarchy, wstring n
 	return true;
 }
 
-vector<bool> Parser::parse()
+bool Parser::optimize(uint8_t opcode, bool operandKnown)
+{
+	if (!peephole && !relax)
+	{
+		return false;
+	}
+	if (peephole && untouchable.empty() && selects.redundant(opcode))
+	{
+		peepholeRemoved++;
+		peepholeTicks += isa[opcode].ticks;
+		return true;
+	}
+	selects.step(opcode, operandKnown);
+	return false;
+}
+
+bool Parser::resolvable(Expression expression)
 {
-	vector<bool> output;
-	vector<pair<size_t, list<Token>::iterator>> TBR;	//to be resolved. <binary position, directive>
-	; i = input->begin();
-	while (i != input->end())
+	for (size_t j = expression.begin; j < expression.end; j++)
 	{
-		for (basic_string<wchar_t>::size_type j = 0; j < (*i).token.length(); j++)
+		if (bytecode[j].opcode == ExpressionOpcode::symbol && insts.symbols.at(bytecode[j].symbol).itype != InstructionType::knownnumber)
 		{
-			(*i).token[j] = towlower((*i).token[j]);
+			return false;
 		}
-		i++;
 	}
+	return true;
+}
+
+void Parser::relaxLoads()	//checks what this pass assumed and leaves in relaxation what the next one should do
+{
+	Relaxation next;
+	next.passes = relaxation.passes + 1;
+	next.pinned = relaxation.pinned;
+	next.pinned.resize(loads.size());
+	next.opaque = relaxation.opaque;
+	next.opaque.resize(immediates.size());
+	for (size_t j = 0; j < immediates.size(); j++)
+	{
+		const Fixup& fixup = immediates[j].first;
+		if (immediates[j].second >= 0 && immediates[j].second != (evaluate(fixup.expression) & (isa[fixup.opcode].operand == OperandKind::bit ? 0x1 : 0xf)))
+		{
+			next.opaque[j] = true;	//its bits are right, what was tracked after it was not
+			next.settled = false;
+		}
+	}
+	for (size_t j = 0; j < loads.size(); j++)
+	{
+		const ConstantLoad& load = loads[j];
+		int64_t value = evaluate(load.expression) & 0xffff;
+		next.values.push_back(value);
+		if (load.assumed >= 0)
+		{
+			if (load.assumed != value)
+			{
+				next.settled = false;
+				next.pinned[j] = next.passes > Relaxation::passLimit / 2;
+			}
+			else if (load.plan.ticks < isa[64].ticks * 4)
+			{
+				relaxedLoads++;
+				relaxedTicks += isa[64].ticks * 4 - load.plan.ticks;
+				relaxedBits += 7 * (4 - load.plan.opcodes.size());
+			}
+		}
+		else if (load.relaxable && !next.pinned[j] && load.selects.load((uint16_t)value).ticks < isa[64].ticks * 4)	//known now, and worth another pass
+		{
+			next.settled = false;
+		}
+	}
+	relaxation = move(next);
+}
+
+BitBuffer Parser::parse()
+{
+	BitBuffer output;
+	vector<Fixup> fixups;	//operands that may refer to labels not seen yet
+	map<wstring, MappedFile> binaries;	//binclude files by full path, mapped once per assembly and unmapped when it ends, so a kept parser does not lock them
+	double phase = trace ? trace->now() : 0;
+	relax = relax && !relocatable;	//a relaxed load cannot wait for the linker
 	/*
 	processing order: convert to binary (leave unresolved reference empty) -> resolve reference -> overwrite resolved reference -> end
 
@@ -382,79 +946,102 @@ vector<bool> Parser::parse()
 		filesize:	;<- filesize need to know size of binclude which defined by filesize (self reference)
 	Dependency of label is all of previously appeared size-defining identifier
 	*/
-	i = input->begin();
-	while (i != input->end())
+	i = 0;
+	while (i < input.size())
 	{
-		auto j = insts.inst.find((*i).token);
-		if (j == insts.inst.end())
+		const Instruction* j = insts.find(view(i));
+		if (!j)
 		{
-			if ((*i).type == $TokenType::Label)	//label
+			if (input[i].type == $TokenType::Label)	//label
 			{
-				wstring l = (*i).token;
+				wstring l(view(i));
 				l.pop_back();
-				insts.inst.insert_or_assign(l, Instruction(InstructionType::knownnumber, output.size()));
+				if (Instructions::keywords().find(l))
+				{
+					throw error("keyword cannot be used", i);
+				}
+				insts.symbols.assign(l, Instruction(InstructionType::knownnumber, output.size()));
+				labelPositions.insert(make_pair(output.size(), l));
+				lastLabel = output.size();
+				selects.reset();
+				sideEffects++;
 			}
 			else	//identifier
 			{
-				throw ParserError("identifier must be come with mnemonic or directive", *i);
+				throw error("identifier must be come with mnemonic or directive", i);
 			}
 		}
 		else
 		{
-			if (j->second.itype == InstructionType::mnemonic)
+			if (j->itype == InstructionType::mnemonic)
 			{
-				for (size_t k = 0; k < j->second.opcode.size(); k++)
+				if (!optimize((uint8_t)j->opcode.to_ulong()))
 				{
-					output.push_back(j->second.opcode.test(k));
+					instructionStarts.push_back(output.size());
+					output.append(j->opcode.to_ulong(), 7);
 				}
 			}
-			else if (j->second.itype == InstructionType::mnemonic_expect_number)
+			else if (j->itype == InstructionType::mnemonic_expect_number)
 			{
-				TBR.push_back(make_pair(output.size(), i));
+				Fixup fixup;
+				fixup.kind = FixupKind::immediate;
+				fixup.opcode = (uint8_t)j->opcode.to_ulong();
+				fixup.position = output.size();
+				instructionStarts.push_back(output.size());
 				i++;
-				if (!isParsable(*i))
+				if (!isParsable(i))
 				{
-					throw ParserError("parsable token expacted", *i);
+					throw error("parsable token expacted", i);
 				}
-				parse_init(true);
-				for (size_t k = 0; k < 7 ; k++)
+				fixup.expression = compile_init();
+				fixups.push_back(fixup);
+				output.append(0, 7);
+				int64_t operand = -1;
+				if (relax && (isa[fixup.opcode].operand == OperandKind::nibble || isa[fixup.opcode].operand == OperandKind::bit))
 				{
-					output.push_back(false);
+					if ((immediates.size() >= relaxation.opaque.size() || !relaxation.opaque[immediates.size()]) && resolvable(fixup.expression))
+					{
+						operand = evaluate(fixup.expression) & (isa[fixup.opcode].operand == OperandKind::bit ? 0x1 : 0xf);
+					}
+					immediates.push_back(make_pair(fixup, operand));
 				}
+				optimize((uint8_t)(fixup.opcode | max<int64_t>(operand, 0)), operand >= 0);	//only tracked, an immediate is never redundant
 			}
-			else if (j->second.itype == InstructionType::mnemonic_expect_registername)
+			else if (j->itype == InstructionType::mnemonic_expect_registername)
 			{
 				i++;
-				auto k = insts.inst.find((*i).token);
-				if (k->second.itype != InstructionType::registername)
+				const Instruction* k = Instructions::keywords().find(view(i));
+				if (!k || k->itype != InstructionType::registername)
 				{
-					throw ParserError("register name expacted", *i);
+					throw error("register name expacted", i);
 				}
-				uint8_t l = (uint8_t)(j->second.opcode.to_ullong() | k->second.opcode.to_ullong());
-				for (size_t m = 0; m < j->second.opcode.size(); m++)
+				uint8_t l = (uint8_t)(j->opcode.to_ullong() | k->opcode.to_ullong());
+				if (!optimize(l))
 				{
-					output.push_back((l >> m) & 0x1);
+					instructionStarts.push_back(output.size());
+					output.append(l, 7);
 				}
 			}
-			else if (j->second.itype == InstructionType::directive)
+			else if (j->itype == InstructionType::directive)
 			{
-				if (j->first == L"binclude")	//format: binclude filename [offset] [size]
+				if ((Directive)j->value == Directive::binclude)	//format: binclude filename [offset] [size]
 				{
+					selects.reset();
 					i++;
-					if (i->type != $TokenType::QuotedText)
+					if (input[i].type != $TokenType::QuotedText)
 					{
-						throw ParserError("file name must be quoted", *i);
+						throw error("file name must be quoted", i);
 					}
-					wstring filepath = (*i).token;
+					wstring filepath(view(i));
 					int64_t size = 0, offset = 0;
 					i++;
-					if (isParsable(*i))
+					if (isParsable(i))
 					{
-						offset = parse_init(false);
+						offset = evaluate(compile_init());
 						i++;
-						if (isParsable(*i))
+						if (isParsable(i))
 						{
-							size = parse_init(false);
+							size = evaluate(compile_init());
 						}
 						else
 						{
@@ -465,292 +1052,675 @@ vector<bool> Parser::parse()
 					{
 						i--;
 					}
-					basic_ifstream<char> ifs;
-					ifs.open(filepath, ios_base::binary | ios_base::in);
-					if (ifs.fail())
+					if (offset < 0 || size < 0)
 					{
-						throw ParserError("failed to open file", *i);
+						throw error("binclude range must not be negative", i);
 					}
-					istreambuf_iterator<char> ifsbegin(ifs), ifsend;
-					string finput(ifsbegin, ifsend);
-					ifs.close();
-					deque<bool> binput;
-					for (size_t k = 0; k < finput.size(); k++)
+					wchar_t* fullpath = _wfullpath(NULL, filepath.c_str(), _MAX_PATH);
+					if (!fullpath)
+					{
+						throw error("invalid path", i);
+					}
+					dependencies.insert(wstring(fullpath));
+					MappedFile& file = binaries[wstring(fullpath)];
+					free(fullpath);
+					if (!file.isOpen() && !file.open(filepath))
 					{
-						binput.push_back(finput[k] & 1);
-						binput.push_back((finput[k] >> 1) & 1);
-						binput.push_back((finput[k] >> 2) & 1);
-						binput.push_back((finput[k] >> 3) & 1);
-						binput.push_back((finput[k] >> 4) & 1);
-						binput.push_back((finput[k] >> 5) & 1);
-						binput.push_back((finput[k] >> 6) & 1);
-						binput.push_back((finput[k] >> 7) & 1);
+						throw error("failed to open file", i);
 					}
-					binput.resize(offset + size);
-					for (size_t k = offset; k < size; k++)
+					if (offset < size)	//bits [offset, size), past the end of the file they are 0
 					{
-						output.push_back(binput[k]);
+						output.append(file.data(), file.size(), offset, size - offset);
 					}
 				}
-				else if (j->first == L"include")	//format: include filename
+				else if ((Directive)j->value == Directive::include)	//format: include filename
 				{
+					if (!repetitions.empty())
+					{
+						throw error("include cannot be repeated", i);
+					}
 					i++;
-					if (i->type != $TokenType::QuotedText)
+					if (input[i].type != $TokenType::QuotedText)
 					{
-						throw ParserError("file name must be quoted", *i);
+						throw error("file name must be quoted", i);
 					}
-					wstring filepath = (*i).token;
+					wstring filepath(view(i));
 					wchar_t* fullpath = _wfullpath(NULL, filepath.c_str(), _MAX_PATH);
 					if (!fullpath)
 					{
-						throw ParserError("invalid path", *i);
+						throw error("invalid path", i);
 					}
 					if (!checkDependencyCycleAndAssign(&fileHierarchy, wstring(fullpath)))
 					{
-						throw ParserError("file dependency cycle detected", *i);
+						throw error("file dependency cycle detected", i);
 					}
-					basic_ifstream<wchar_t> ifs;
-					ifs.open(filepath, ios_base::binary | ios_base::in);
-					if (ifs.fail())
+					dependencies.insert(wstring(fullpath));
+					vector<Token> token;
 					{
-						throw ParserError("failed to open file", *i);
+						TraceSpan span(trace, L"tokenize", L"assembler");
+						auto k = prefetched.find(fullpath);
+						shared_ptr<const TokenizedFile> file = k != prefetched.end() ? k->second.get() : IncludeCache::shared().read(filepath);	//get rethrows what tokenizing threw
+						if (!file)
+						{
+							throw error("failed to open file", i);
+						}
+						token = IncludeCache::splice(source, *file, filepath);
 					}
-					istreambuf_iterator<wchar_t> ifsbegin(ifs), ifsend;
-					wstring finput(ifsbegin, ifsend);
-					ifs.close();
-					list<Token>* token = Tokenizer::tokenize(finput, filepath);
-					i++;
-					auto k = --(token->end());
-					Token eof = *k;
-					eof.token = L" endoffile";
-					eof.type = $TokenType::Genetated;
-					input->insert(i, eof);
-					input->insert(i, token->begin(), token->end());
+					token.push_back(source.generated(token.empty() ? input[i] : token.back(), L" endoffile"));
+					input.insert(input.begin() + i + 1, token.begin(), token.end());	//right after the file name, so they are parsed next
+					prefetch(i + 1, i + 1 + token.size());
 
 				}
-				else if (j->first == L"define")
+				else if ((Directive)j->value == Directive::define)
 				{
-					auto k = ++i;
-					if (i == input->end())
+					size_t k = ++i;
+					if (i >= input.size())
 					{
 						throw runtime_error("unexpected end of file");
 					}
 					i++;
-					int64_t l = parse_init(false);
-					if (insts.inst.find((*k).token) == insts.inst.end() || insts.inst.find((*k).token)->second.itype == InstructionType::knownnumber || insts.inst.find((*k).token)->second.itype == InstructionType::unknownnumber)
+					Expression expression = compile_init();
+					if (relocatable)	//its value is used as a constant, which a label only becomes at link time
+					{
+						for (size_t n = expression.begin; n < expression.end; n++)
+						{
+							if (bytecode[n].opcode == ExpressionOpcode::symbol && any_of(labelPositions.begin(), labelPositions.end(), [&](const pair<const size_t, wstring>& label) {return insts.symbols.slot(label.second) == bytecode[n].symbol; }))
+							{
+								throw error("define cannot read a label in a module", (size_t)bytecode[n].value);
+							}
+						}
+					}
+					int64_t l = evaluate(expression);
+					const Instruction* m = insts.find(view(k));
+					if (!m || m->itype == InstructionType::knownnumber || m->itype == InstructionType::unknownnumber)
 					{
-						insts.inst.insert_or_assign(k->token, Instruction(InstructionType::knownnumber, l));
+						insts.symbols.assign(view(k), Instruction(InstructionType::knownnumber, l));
+						sideEffects++;
 					}
 					else
 					{
-						throw ParserError("keyword cannot be used", *k);
+						throw error("keyword cannot be used", k);
 					}
 				}
-				else if (j->first == L"macro")	//format: macro identifier [(argument ...)] endmacro
+				else if ((Directive)j->value == Directive::macro)	//format: macro identifier [(argument ...)] endmacro
 				{
 					Macro macro = Macro();
+					sideEffects++;
 					i++;
-					auto l = i;
-					if (!checkDependencyCycleAndAssign(&macroHierarchy, i->token))
-					{
-						throw ParserError("macro dependency cycle detected", *i);
-					}
-					insts.inst.insert_or_assign(i->token, Instruction(InstructionType::macro));
-					if (macroHierarchy.size() <= 1)
+					size_t l = i;
+					const Instruction* k = insts.symbols.find(view(i));
+					if (k && k->itype == InstructionType::macro)
 					{
-						macro.insts = insts;
+						throw error("macro dependency cycle detected", i);
 					}
-					else
+					if (Instructions::keywords().find(view(i)))
 					{
-						auto k = macroHierarchy.end();
-						k--;
-						k--;
-						macro.insts = macros.find(*k)->second.insts;
+						throw error("keyword cannot be used", i);
 					}
+					insts.symbols.assign(view(i), Instruction(InstructionType::macro, macros.size()));
+					macro.name = i;
+					macro.scope = insts.symbols.size();
 					i++;
-					if (i->type == $TokenType::LeftParenthesis)
+					if (input[i].type == $TokenType::LeftParenthesis)
 					{
 						i++;
-						while (i->type != $TokenType::RightParenthesis)
+						macro.argsBegin = i;
+						while (input[i].type != $TokenType::RightParenthesis)
 						{
-							if (macro.insts.inst.find(i->token) != macro.insts.inst.end())
+							if (insts.find(view(i), macro.scope))
 							{
-								throw ParserError("identfier of the argument is already taken", *i);
+								throw error("identfier of the argument is already taken", i);
 							}
-							macro.args.push_back(*i);
 							i++;
 						}
+						macro.argsEnd = i;
 						i++;
 					}
-					while (i->token != L"endmacro")
+					macro.bodyBegin = i;
+					while (view(i) != L"endmacro")
 					{
-						macro.body.push_back(*i);
+						if (i >= input.size())
+						{
+							throw error("endmacro expected", l);
+						}
 						i++;
 					}
-					macros.insert_or_assign(l->token, macro);
+					macro.bodyEnd = i;
+					for (size_t m = macro.bodyBegin; m < macro.bodyEnd; m++)
+					{
+						uint16_t slot = 0;
+						for (size_t n = macro.argsBegin; n < macro.argsEnd && !slot; n++)
+						{
+							if (view(n) == view(m))
+							{
+								slot = (uint16_t)(n - macro.argsBegin + 1);
+							}
+						}
+						macro.slots.push_back(slot);
+					}
+					macros.push_back(move(macro));
 				}
-				else if (j->first == L"ed")	//format: ed size(0<n<=64) data (...) enddata
+				else if ((Directive)j->value == Directive::ed)	//format: ed size(0<n<=64) data (...) enddata
 				{
-					TBR.push_back(make_pair(output.size(), i));
+					selects.reset();	//data may be executed, or jumped over
+					size_t l = i;
 					i++;
 					int64_t size;
-					if (!isParsable(*i))
+					if (!isParsable(i))
 					{
-						throw ParserError("parsable token expacted", *i);
+						throw error("parsable token expacted", i);
 					}
-					size = parse_init(false);
+					size = evaluate(compile_init());
 					if (size > 64 || size <= 0)
 					{
-						throw ParserError("data size too small or too large\nsize must be in 0 < size <= 64", *i);
+						throw error("data size too small or too large\nsize must be in 0 < size <= 64", i);
+					}
+					i++;
+					while (view(i) != L"enddata")
+					{
+						if (i >= input.size())
+						{
+							throw error("enddata expected", l);
+						}
+						Fixup fixup;
+						fixup.kind = FixupKind::data;
+						fixup.width = (uint8_t)size;
+						fixup.position = output.size();
+						fixup.expression = compile_init();
+						fixups.push_back(fixup);
+						output.append(0, size);
+						i++;
+					}
+				}
+				else if ((Directive)j->value == Directive::ldi16)	//accepts label as value. format: ldi value
+				{
+					Fixup fixup;
+					fixup.kind = FixupKind::wideImmediate;
+					fixup.position = output.size();
+					i++;
+					if (!isParsable(i))
+					{
+						throw error("parsable token expacted", i);
+					}
+					fixup.expression = compile_init();
+					bool relaxed = false;
+					if (relax)
+					{
+						size_t site = loads.size();
+						ConstantLoad load;
+						load.expression = fixup.expression;
+						load.relaxable = untouchable.empty() && !(site < relaxation.pinned.size() && relaxation.pinned[site]);
+						load.selects = selects;
+						if (load.relaxable && resolvable(fixup.expression))
+						{
+							load.assumed = evaluate(fixup.expression) & 0xffff;
+						}
+						else if (load.relaxable && site < relaxation.values.size())
+						{
+							load.assumed = relaxation.values[site];
+						}
+						if (load.assumed >= 0)
+						{
+							load.plan = selects.load((uint16_t)load.assumed);
+							for (uint8_t k : load.plan.opcodes)
+							{
+								instructionStarts.push_back(output.size());
+								output.append(k, 7);
+								selects.step(k);
+							}
+						}
+						relaxed = load.assumed >= 0;
+						loads.push_back(load);
 					}
-					while (i->token != L"enddata")
+					if (!relaxed)
 					{
-						parse_init(true);
-						for (size_t k = 0; k < size; k++)
+						fixups.push_back(fixup);
+						for (size_t k = 0; k < 4; k++)
 						{
-							output.push_back(false);
+							optimize(64, false);	//ldi.4
+							instructionStarts.push_back(output.size() + 7 * k);
 						}
+						output.append(0, 7 * 4);
 					}
 				}
-				else if (j->first == L"ldi.16")	//accepts label as value. format: ldi value
+				else if ((Directive)j->value == Directive::assertTicks)	//format: assert_ticks limit
 				{
-					TBR.push_back(make_pair(output.size(), i));
+					TickAssertion assertion;
+					assertion.token = input[i];
+					assertion.begin = expansionStack.empty() ? lastLabel : expansions[expansionStack.back()].begin;
+					assertion.end = output.size();
 					i++;
-					if (!isParsable(*i))
+					if (!isParsable(i))
 					{
-						throw ParserError("parsable token expacted", *i);
+						throw error("parsable token expacted", i);
 					}
-					parse_init(true);
-					for (size_t k = 0; k < 7 * 4; k++)
+					assertion.limit = compile_init();
+					tickAssertions.push_back(assertion);
+					sideEffects++;
+				}
+				else if ((Directive)j->value == Directive::nopt)	//format: nopt ... endnopt, code the peephole pass must leave as written
+				{
+					untouchable.push_back(input[i]);
+				}
+				else if ((Directive)j->value == Directive::endnopt)
+				{
+					if (untouchable.empty())
 					{
-						output.push_back(false);
+						throw error("nopt expected", i);
 					}
+					untouchable.pop_back();
 				}
-			}
-			else if (j->second.itype == InstructionType::macro)	//format: identifier [ ['('] argument [')'] ...]
-			{
-				auto k_ = macros.find(i->token);
-				if (k_ == macros.end())
+				else if ((Directive)j->value == Directive::repeat)	//format: repeat count [identifier] ... endrepeat
+				{
+					Repetition repetition;
+					repetition.token = input[i];
+					sideEffects++;
+					i++;
+					if (!isParsable(i))
+					{
+						throw error("parsable token expacted", i);
+					}
+					repetition.count = evaluate(compile_init());
+					if (repetition.count < 0)
+					{
+						throw error("repeat count must not be negative", i);
+					}
+					bool identifier = i + 1 < input.size() && input[i + 1].type == $TokenType::Default && !iswdigit(view(i + 1)[0]);
+					const Instruction* k = identifier ? insts.find(view(i + 1)) : nullptr;
+					if (identifier && (!k || k->itype == InstructionType::knownnumber || k->itype == InstructionType::unknownnumber))	//one that is not a keyword or macro names the iteration variable
+					{
+						i++;
+						repetition.variable = insts.symbols.slot(view(i));
+						repetition.shadowed = insts.symbols.at(repetition.variable);
+						insts.symbols.at(repetition.variable) = Instruction(InstructionType::knownnumber, 0);
+					}
+					if (repetition.count == 0)	//skip to the matching endrepeat
+					{
+						size_t depth = 1;
+						while (depth)
+						{
+							i++;
+							if (i >= input.size())
+							{
+								throw ParserError("endrepeat expected", source.resolve(repetition.token));
+							}
+							if (view(i) == L"repeat")
+							{
+								depth++;
+							}
+							else if (view(i) == L"endrepeat")
+							{
+								depth--;
+							}
+						}
+						if (repetition.variable >= 0)
+						{
+							insts.symbols.at(repetition.variable) = repetition.shadowed;
+						}
+					}
+					else
+					{
+						repetition.begin = i + 1;
+						repetition.output = output.size();
+						repetition.instructions = instructionStarts.size();
+						repetition.fixups = fixups.size();
+						repetition.loads = loads.size();
+						repetition.immediates = immediates.size();
+						repetition.peepholeRemoved = peepholeRemoved;
+						repetition.peepholeTicks = peepholeTicks;
+						repetition.sideEffects = sideEffects;
+						repetition.selects = selects;
+						repetitions.push_back(repetition);
+					}
+				}
+				else if ((Directive)j->value == Directive::endrepeat)
 				{
-					throw ParserError("the macro does not found", *i);
+					if (repetitions.empty())
+					{
+						throw error("repeat expected", i);
+					}
+					Repetition& repetition = repetitions.back();
+					repetition.index++;
+					if (repetition.index < repetition.count && repetition.index == 1 && repetition.sideEffects == sideEffects && repetition.selects == selects)	//the first iteration only emitted code and the next would start from the same selects, copy it
+					{
+						size_t length = output.size() - repetition.output;
+						size_t instructions = instructionStarts.size(), fixupCount = fixups.size(), loadCount = loads.size(), immediateCount = immediates.size();
+						output.reserve(output.size() + length * (repetition.count - 1));
+						for (int64_t k = 1; k < repetition.count; k++)
+						{
+							output.append(output, repetition.output, length);
+							for (size_t l = repetition.instructions; l < instructions; l++)
+							{
+								instructionStarts.push_back(instructionStarts[l] + length * k);
+							}
+							for (size_t l = repetition.fixups; l < fixupCount; l++)
+							{
+								Fixup fixup = fixups[l];
+								fixup.position += length * k;
+								fixups.push_back(fixup);
+							}
+							for (size_t l = repetition.loads; l < loadCount; l++)	//so sites keep their indices whether or not a pass copied
+							{
+								ConstantLoad load = loads[l];
+								loads.push_back(load);
+							}
+							for (size_t l = repetition.immediates; l < immediateCount; l++)
+							{
+								pair<Fixup, int64_t> immediate = immediates[l];
+								immediates.push_back(immediate);
+							}
+						}
+						peepholeRemoved += (peepholeRemoved - repetition.peepholeRemoved) * (repetition.count - 1);	//each copy drops what the first iteration did
+						peepholeTicks += (peepholeTicks - repetition.peepholeTicks) * (repetition.count - 1);
+						repetition.index = repetition.count;
+					}
+					if (repetition.index < repetition.count)
+					{
+						if (repetition.variable >= 0)
+						{
+							insts.symbols.at(repetition.variable) = Instruction(InstructionType::knownnumber, repetition.index);
+						}
+						i = repetition.begin - 1;
+					}
+					else
+					{
+						if (repetition.variable >= 0)
+						{
+							insts.symbols.at(repetition.variable) = repetition.shadowed;
+						}
+						repetitions.pop_back();
+					}
 				}
-				auto k = k_->second;
+			}
+			else if (j->itype == InstructionType::macro)	//format: identifier [ ['('] argument [')'] ...]
+			{
+				const Macro& k = macros[j->value];
+				sideEffects++;
+				MacroExpansion expansion;
+				expansion.name = wstring(view(k.name));
+				expansion.token = input[i];
+				expansion.begin = output.size();
 				i++;
-				size_t l = 0;
-				while (l < k.args.size())
+				arguments.clear();
+				for (size_t l = k.argsBegin; l < k.argsEnd; l++)
 				{
-					list<Token> replaceList;
+					size_t begin = i, end = i;
 					size_t parenthesisDepth = 0;
-					if (i->type == $TokenType::LeftParenthesis)
+					if (input[i].type == $TokenType::LeftParenthesis)
 					{
 						i++;
+						begin = i;
 						parenthesisDepth++;
-						while (i->type != $TokenType::RightParenthesis && parenthesisDepth <= 1)
+						while (input[i].type != $TokenType::RightParenthesis && parenthesisDepth <= 1)
 						{
-							if (i->type != $TokenType::LeftParenthesis)
+							if (input[i].type != $TokenType::LeftParenthesis)
 							{
 								parenthesisDepth++;
 							}
-							else if (i->type != $TokenType::RightParenthesis)
+							else if (input[i].type != $TokenType::RightParenthesis)
 							{
 								parenthesisDepth--;
 							}
-							replaceList.push_back(*i);
 							i++;
 						}
+						end = i;
 						i++;
 					}
-					auto m = k.body.begin();
-					while (m != k.body.end())
+					arguments.push_back(make_pair(begin, end));
+					i++;
+				}
+				size_t first = input.size();
+				for (size_t l = 0; l < k.slots.size(); l++)
+				{
+					size_t begin = k.bodyBegin + l, end = begin + 1;
+					if (k.slots[l])
 					{
-						m = find_if(m, k.body.end(), [&](Token o) {return o.token == k.args[l].token; });
-						m = k.body.erase(m);
-						k.body.insert(m, replaceList.begin(), replaceList.end());
-						for (size_t p = 0; p < replaceList.size(); p++)
-						{
-							m++;
-						}
+						tie(begin, end) = arguments[k.slots[l] - 1];
 					}
-					i++;
-					l++;
+					for (size_t m = begin; m < end; m++)
+					{
+						Token token = input[m];	//input may grow under a reference
+						input.push_back(token);
+					}
+				}
+				if (input.size() == first)
+				{
+					expansion.end = output.size();
+					expansions.push_back(expansion);
+				}
+				else
+				{
+					input.push_back(source.generated(input.back(), L" endmacro"));	//closes the expansion once its body has been emitted
+					expansion.resume = i;
+					expansionStack.push_back(expansions.size());
+					expansions.push_back(expansion);
+					i = first;
 				}
-				i = input->insert(i, k.body.begin(), k.body.end());
 			}
-			else if (j->second.itype == InstructionType::endoffile)
+			else if (j->itype == InstructionType::endoffile)
 			{
 				fileHierarchy.pop_back();
+				if (fileHierarchy.empty())
+				{
+					if (!repetitions.empty())
+					{
+						throw ParserError("endrepeat expected", source.resolve(repetitions.back().token));
+					}
+					if (!untouchable.empty())
+					{
+						throw ParserError("endnopt expected", source.resolve(untouchable.back()));
+					}
+					break;
+				}
+			}
+			else if (j->itype == InstructionType::endofmacro)
+			{
+				expansions[expansionStack.back()].end = output.size();
+				i = expansions[expansionStack.back()].resume - 1;
+				expansionStack.pop_back();
 			}
 		}
 		i++;
 	}
-	for (size_t j = 0; j < TBR.size(); j++)
+	if (trace)
+	{
+		trace->complete(L"parse", L"assembler", phase);
+		phase = trace->now();
+	}
+	vector<bool> unplaced;	//symbols whose value is not known until link time: labels, and anything never defined
+	if (relocatable)
 	{
-		if (TBR[j].second->token == L"ed")
+		unplaced.resize(insts.symbols.size());
+		for (size_t j = 0; j < unplaced.size(); j++)
 		{
-			auto k = TBR[j].second;
-			k++;
-			i = k;
-			int64_t size = parse_init(false);
-			while (i->token != L"enddata")
+			unplaced[j] = insts.symbols.at(j).itype != InstructionType::knownnumber;
+		}
+		for (auto& j : labelPositions)
+		{
+			unplaced[insts.symbols.slot(j.second)] = true;
+		}
+	}
+	for (auto& j : fixups)
+	{
+		if (relocatable && any_of(bytecode.begin() + j.expression.begin, bytecode.begin() + j.expression.end, [&](const ExpressionStep& k) {return k.opcode == ExpressionOpcode::symbol && unplaced[k.symbol]; }))
+		{
+			relocations.push_back(j);
+			j.write(output, 0);	//still decodes as the right opcode for the tick analysis
+			continue;
+		}
+		j.write(output, evaluate(j.expression));
+	}
+	if (relax)
+	{
+		relaxLoads();
+	}
+	if (trace)
+	{
+		trace->complete(L"fixup", L"assembler", phase);
+	}
+	analyzeTicks(output);
+	return output;
+}
+
+pair<size_t, size_t> Parser::ticks(const BitBuffer& output, size_t begin, size_t end)	//minimum and maximum for one pass over [begin, end), waits are exact where the waited nibble is known
+{
+	size_t low = 0, high = 0;
+	int8_t op1 = -1, index = -1;	//-1 when unknown
+	uint16_t value[8] = {}, known[8] = {};
+	auto forget = [&](int8_t r) {
+		if (r < 0)
+		{
+			fill(known, known + 8, 0);
+		}
+		else
+		{
+			known[r] = 0;
+		}
+	};
+	for (auto j = lower_bound(instructionStarts.begin(), instructionStarts.end(), begin); j != instructionStarts.end() && *j < end; j++)
+	{
+		uint8_t opcode = (uint8_t)output.read(*j, 7);
+		const OpcodeInfo& info = isa[opcode];
+		low += info.ticks;
+		high += info.ticks;
+		if (info.effects & variableTicks)	//wait.4, wait.4e
+		{
+			if (op1 >= 0 && index >= 0 && (rotr(known[op1], index) & 0xf) == 0xf)
 			{
-				int64_t l = parse_init(false);
-				for (size_t k = 0; k < size; k++)
-				{
-					output.push_back(l & 1);
-					l >>= 1;
-				}
+				low += rotr(value[op1], index) & 0xf;
+				high += rotr(value[op1], index) & 0xf;
 			}
-		}
-		if (TBR[j].second->token == L"ldi.16")
-		{
-			auto k = TBR[j].second;
-			k++;
-			i = k;
-			int64_t l = parse_init(false);
-			l &= 0xffff;
-			uint8_t m0, m1, m2, m3;
-			m0 = (l) & 0xf | 0x40;
-			m1 = (l >> 4) & 0xf | 0x40;
-			m2 = (l >> 8) & 0xf | 0x40;
-			m3 = (l >> 12) & 0xf | 0x40;
-			for (size_t n = 0; n < 7; n++)
+			else
 			{
-				output[TBR[j].first + n] = (m0 >> n) & 1;
-				output[TBR[j].first + n + 7] = (m1 >> n) & 1;
-				output[TBR[j].first + n + 7 * 2] = (m2 >> n) & 1;
-				output[TBR[j].first + n + 7 * 3] = (m3 >> n) & 1;
+				high += 15;
 			}
+			continue;
+		}
+		if (opcode <= 7)
+		{
+			op1 = opcode;
 		}
-		else if (TBR[j].second->token == L"ldi.4")
-		{
-			auto k = TBR[j].second;
-			k++;
-			i = k;
-			int64_t l = parse_init(false);
-			l &= 0xf;
-			bitset<7> n = l;
-			uint8_t m0;
-			m0 = (uint8_t)(n | insts.inst.find(TBR[j].second->token)->second.opcode).to_ullong();
-			for (size_t n = 0; n < 7; n++)
+		else if (info.operand == OperandKind::nibble || info.operand == OperandKind::bit)	//ldi.4, ldi.1
+		{
+			uint16_t mask = info.operand == OperandKind::bit ? 0x1 : 0xf;
+			if (op1 >= 0 && index >= 0)
+			{
+				value[op1] = (value[op1] & ~rotl(mask, index)) | rotl((uint16_t)(opcode & mask), index);
+				known[op1] |= rotl(mask, index);
+			}
+			else
 			{
-				output[TBR[j].first + n] = (m0 >> n) & 1;
+				forget(op1);
 			}
 		}
-		else if (TBR[j].second->token == L"ldi.1")
-		{
-			auto k = TBR[j].second;
-			k++;
-			i = k;
-			int64_t l = parse_init(false);
-			l &= 0x1;
-			bitset<7> n = l;
-			uint8_t m0;
-			m0 = (uint8_t)(n | insts.inst.find(TBR[j].second->token)->second.opcode).to_ullong();
-			for (size_t n = 0; n < 7; n++)
+		else if (opcode == 55)	//clr
+		{
+			if (op1 >= 0)
+			{
+				value[op1] = 0;
+				known[op1] = 0xffff;
+			}
+			else
 			{
-				output[TBR[j].first + n] = (m0 >> n) & 1;
+				forget(op1);
 			}
 		}
+		else if (info.effects & writeOp2)	//the op2 register is not tracked, so it may be any of them
+		{
+			forget(-1);
+		}
+		else if (info.effects & writeOp1)
+		{
+			forget(op1);
+		}
+		if (opcode == 86)	//cli
+		{
+			index = 0;
+		}
+		else if (info.effects & writeI)
+		{
+			index = index >= 0 && info.advanceI ? (index + info.advanceI) & 0xf : -1;
+		}
 	}
-	return output;
+	return make_pair(low, high);
+}
+
+void Parser::analyzeTicks(const BitBuffer& output)	//basic blocks split at labels, after branches and around data
+{
+	blocks.clear();
+	for (size_t j = 0; j < instructionStarts.size(); j++)
+	{
+		size_t position = instructionStarts[j];
+		uint8_t previous = j > 0 ? (uint8_t)output.read(instructionStarts[j - 1], 7) : 0;
+		if (j == 0 || labelPositions.count(position) || (isa[previous].effects & branches) || instructionStarts[j - 1] + 7 != position)
+		{
+			CodeBlock block;
+			block.begin = position;
+			blocks.push_back(block);
+		}
+		blocks.back().end = position + 7;
+		blocks.back().instructions++;
+	}
+	for (auto& j : blocks)
+	{
+		tie(j.minTicks, j.maxTicks) = ticks(output, j.begin, j.end);
+	}
+	for (auto& j : tickAssertions)
+	{
+		int64_t limit = evaluate(j.limit);
+		size_t worst = ticks(output, j.begin, j.end).second;
+		if (worst > (uint64_t)limit)
+		{
+			throw ParserError("tick budget exceeded: " + to_string(worst) + " > " + to_string(limit), source.resolve(j.token));
+		}
+	}
+}
+
+void Parser::listing(const BitBuffer& output, wostream& out)
+{
+	auto flags = out.flags();
+	auto address = [&](size_t position) -> wostream& {
+		wchar_t text[8];
+		swprintf(text, 8, L"%04zx", position);
+		return out << text;
+	};
+	auto range = [&](size_t low, size_t high) -> wostream& {
+		return low == high ? out << low : out << low << L"-" << high;
+	};
+	size_t block = 0;
+	for (size_t j = 0; j < instructionStarts.size(); j++)
+	{
+		size_t position = instructionStarts[j];
+		for (auto k = labelPositions.lower_bound(position); k != labelPositions.end() && k->first == position; k++)
+		{
+			out << k->second << L":" << endl;
+		}
+		uint8_t opcode = (uint8_t)output.read(position, 7);
+		pair<size_t, size_t> before = ticks(output, blocks[block].begin, position), after = ticks(output, blocks[block].begin, position + 7);	//in the context of its block, so known wait operands show
+		pair<size_t, size_t> cost = make_pair(after.first - before.first, after.second - before.second);
+		address(position) << L"	" << disassemble(opcode) << L"	";
+		range(cost.first, cost.second) << endl;
+		if (block < blocks.size() && blocks[block].end == position + 7)
+		{
+			out << L"; block ";
+			address(blocks[block].begin) << L"-";
+			address(blocks[block].end) << L" " << blocks[block].instructions << L" instructions ";
+			range(blocks[block].minTicks, blocks[block].maxTicks) << L" ticks" << endl;
+			block++;
+		}
+	}
+	for (auto& j : expansions)
+	{
+		pair<size_t, size_t> cost = ticks(output, j.begin, j.end);
+		out << L"; macro " << j.name << L" ";
+		address(j.begin) << L"-";
+		address(j.end) << L" worst case " << cost.second << L" ticks" << endl;
+	}
+	for (auto& j : tickAssertions)
+	{
+		out << L"; assert_ticks line " << j.token.line << L" ";
+		address(j.begin) << L"-";
+		address(j.end) << L" worst case " << ticks(output, j.begin, j.end).second << L" ticks" << endl;
+	}
+	out.flags(flags);
 }
@@ -0,0 +1,286 @@
+#pragma once
+#include <stdint.h>
+#include <chrono>
+#include <ostream>
+#include <vector>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif // __linux__
+
+#if defined(_M_X64) || defined(_M_IX86)
+#include <intrin.h>
+#define PROFILER_HAS_RDTSC
+#elif defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILER_HAS_RDTSC
+#endif
+
+using namespace std;
+
+/*
+	Host-side counters sampled around BBBBBrainDumbed::execute.
+	With perf_event_open (Linux) all five counters come from one event group; otherwise only cycles is filled, from rdtsc.
+	cacheL2Misses uses the generic last-level cache event, which is the L2 on most of our targets.
+*/
+enum class HardwareCounter
+{
+	cycles,
+	instructions,
+	branchMisses,
+	cacheL1Misses,
+	cacheL2Misses,
+	count
+};
+
+class HardwareCounters
+{
+public:
+	uint64_t value[(size_t)HardwareCounter::count] = {};
+	HardwareCounters& operator+=(const HardwareCounters& rhs);
+	HardwareCounters operator-(const HardwareCounters& rhs) const;
+};
+
+class ProfileSample
+{
+public:
+	uint32_t frame = 0;
+	uint32_t scanline = 0;
+	uint64_t calls = 0;
+	uint64_t guestTicks = 0;
+	HardwareCounters counters;
+};
+
+class Profiler
+{
+public:
+	bool usingPerf = false;
+	bool available[(size_t)HardwareCounter::count] = {};
+	vector<ProfileSample> samples;
+	Profiler();
+	~Profiler();
+	void begin();
+	void end(uint32_t frame, uint32_t scanline, size_t guestTicks);
+	HardwareCounters read();
+	HardwareCounters total();
+	void report(wostream& out);
+	static const wchar_t* name(HardwareCounter counter);
+private:
+	int fd[(size_t)HardwareCounter::count] = { -1, -1, -1, -1, -1 };
+	size_t slot[(size_t)HardwareCounter::count] = {};
+	size_t opened = 0;
+	HardwareCounters started;
+	void open();
+};
+
+HardwareCounters& HardwareCounters::operator+=(const HardwareCounters& rhs)
+{
+	for (size_t i = 0; i < (size_t)HardwareCounter::count; i++)
+	{
+		value[i] += rhs.value[i];
+	}
+	return *this;
+}
+
+HardwareCounters HardwareCounters::operator-(const HardwareCounters& rhs) const
+{
+	HardwareCounters output;
+	for (size_t i = 0; i < (size_t)HardwareCounter::count; i++)
+	{
+		output.value[i] = value[i] - rhs.value[i];
+	}
+	return output;
+}
+
+Profiler::Profiler()
+{
+	open();
+}
+
+Profiler::~Profiler()
+{
+#ifdef __linux__
+	for (size_t i = 0; i < (size_t)HardwareCounter::count; i++)
+	{
+		if (fd[i] >= 0)
+		{
+			close(fd[i]);
+		}
+	}
+#endif // __linux__
+}
+
+void Profiler::open()
+{
+#ifdef __linux__
+	const uint32_t types[] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE };
+	const uint64_t configs[] = {
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_BRANCH_MISSES,
+		PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+		PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+	};
+	for (size_t i = 0; i < (size_t)HardwareCounter::count; i++)
+	{
+		perf_event_attr attr = {};
+		attr.size = sizeof(attr);
+		attr.type = types[i];
+		attr.config = configs[i];
+		attr.disabled = (fd[0] < 0);	//only the group leader starts disabled
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP;
+		fd[i] = (int)syscall(__NR_perf_event_open, &attr, 0, -1, fd[0], 0);
+		if (fd[i] < 0)
+		{
+			if (i == 0)	//no cycle counter, no group
+			{
+				break;
+			}
+			continue;
+		}
+		available[i] = true;
+		slot[i] = opened++;
+	}
+	if (fd[0] >= 0)
+	{
+		usingPerf = true;
+		ioctl(fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+		return;
+	}
+#endif // __linux__
+	available[(size_t)HardwareCounter::cycles] = true;
+}
+
+HardwareCounters Profiler::read()
+{
+	HardwareCounters output;
+#ifdef __linux__
+	if (usingPerf)
+	{
+		uint64_t buffer[1 + (size_t)HardwareCounter::count] = {};	//nr, value...
+		if (::read(fd[0], buffer, sizeof(buffer)) > 0)
+		{
+			for (size_t i = 0; i < (size_t)HardwareCounter::count; i++)
+			{
+				if (available[i])
+				{
+					output.value[i] = buffer[1 + slot[i]];
+				}
+			}
+		}
+		return output;
+	}
+#endif // __linux__
+#ifdef PROFILER_HAS_RDTSC
+	output.value[(size_t)HardwareCounter::cycles] = __rdtsc();
+#else
+	output.value[(size_t)HardwareCounter::cycles] = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+#endif // PROFILER_HAS_RDTSC
+	return output;
+}
+
+void Profiler::begin()
+{
+	started = read();
+}
+
+void Profiler::end(uint32_t frame, uint32_t scanline, size_t guestTicks)
+{
+	HardwareCounters delta = read() - started;
+	if (samples.empty() || samples.back().frame != frame || samples.back().scanline != scanline)
+	{
+		ProfileSample sample;
+		sample.frame = frame;
+		sample.scanline = scanline;
+		samples.push_back(sample);
+	}
+	samples.back().calls++;
+	samples.back().guestTicks += guestTicks;
+	samples.back().counters += delta;
+}
+
+HardwareCounters Profiler::total()
+{
+	HardwareCounters output;
+	for (size_t i = 0; i < samples.size(); i++)
+	{
+		output += samples[i].counters;
+	}
+	return output;
+}
+
+const wchar_t* Profiler::name(HardwareCounter counter)
+{
+	switch (counter)
+	{
+	case HardwareCounter::cycles:
+		return L"cycles";
+	case HardwareCounter::instructions:
+		return L"instructions";
+	case HardwareCounter::branchMisses:
+		return L"branch-misses";
+	case HardwareCounter::cacheL1Misses:
+		return L"L1d-misses";
+	case HardwareCounter::cacheL2Misses:
+		return L"L2-misses";
+	default:
+		return L"";
+	}
+}
+
+void Profiler::report(wostream& out)
+{
+	HardwareCounters sum = total();
+	uint64_t ticks = 0;
+	const ProfileSample* worst = nullptr;
+	for (size_t i = 0; i < samples.size(); i++)
+	{
+		ticks += samples[i].guestTicks;
+		if (!worst || samples[i].counters.value[0] > worst->counters.value[0])
+		{
+			worst = &samples[i];
+		}
+	}
+	out << L"counters: " << (usingPerf ? L"perf_event" : L"rdtsc") << endl;
+	out << L"samples: " << samples.size() << L" guest ticks: " << ticks << endl;
+	for (size_t i = 0; i < (size_t)HardwareCounter::count; i++)
+	{
+		if (!available[i])
+		{
+			continue;
+		}
+		out << name((HardwareCounter)i) << L": " << sum.value[i];
+		if (ticks)
+		{
+			out << L" (" << (double)sum.value[i] / ticks << L" per guest tick)";
+		}
+		out << endl;
+	}
+	if (available[(size_t)HardwareCounter::instructions] && sum.value[(size_t)HardwareCounter::instructions])
+	{
+		double kinst = sum.value[(size_t)HardwareCounter::instructions] / 1000.0;
+		out << L"IPC: " << (double)sum.value[(size_t)HardwareCounter::instructions] / sum.value[(size_t)HardwareCounter::cycles] << endl;
+		if (available[(size_t)HardwareCounter::branchMisses])
+		{
+			out << L"branch-misses per 1k instructions: " << sum.value[(size_t)HardwareCounter::branchMisses] / kinst << endl;
+		}
+		if (available[(size_t)HardwareCounter::cacheL1Misses])
+		{
+			out << L"L1d-misses per 1k instructions: " << sum.value[(size_t)HardwareCounter::cacheL1Misses] / kinst << endl;
+		}
+		if (available[(size_t)HardwareCounter::cacheL2Misses])
+		{
+			out << L"L2-misses per 1k instructions: " << sum.value[(size_t)HardwareCounter::cacheL2Misses] / kinst << endl;
+		}
+	}
+	if (worst)
+	{
+		out << L"slowest: frame " << worst->frame << L" scanline " << worst->scanline << L" cycles " << worst->counters.value[0] << endl;
+	}
+}
\ No newline at end of file
@@ -1,12 +1,25 @@
 #pragma once
 
+#include <stdint.h>
+#include <bit>
+#include <cwchar>
+#include <cwctype>
 #include <string>
-#include <list>
+#include <string_view>
+#include <map>
+#include <vector>
 #include <stdexcept>
 
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#include <emmintrin.h>
+#define TOKENIZER_HAS_SSE2
+#endif
+
+#include "Instructions.h"
+
 using namespace std;
 
-enum class $TokenType {
+enum class $TokenType : uint8_t {
 	Default,
 	Label,
 	ExposedDelimiter,
@@ -20,17 +33,78 @@ enum class $TokenType {
 
 class Token {
 public:
-	wstring token = L"";
 	$TokenType type = $TokenType::Default;
+	OperatorKind op = OperatorKind::none;	//set for operators and ','
+	uint32_t file = 0;	//index into SourceBuffer::files
+	uint32_t offset = 0;	//text is SourceBuffer::text[offset, offset + length)
+	uint32_t length = 0;
+	uint32_t line = 0;
+	uint32_t digit = 0;
+};
+
+class TokenText {	//a token resolved against its SourceBuffer, for error messages
+public:
+	wstring token = L"";
 	wstring filename = L"";
 	basic_string<wchar_t>::size_type line = 0;
 	basic_string<wchar_t>::size_type digit = 0;
 };
 
+/*
+	All source text of an assembly lives in one buffer and tokens only refer to ranges of it, so tokenizing allocates nothing per token.
+	Each file is followed by L'\0', which lets the scanner look one character ahead without a bounds check.
+	Identifiers are case folded in place while they are classified; quoted text is decoded, folded and appended after the file it came from.
+*/
+class SourceBuffer {
+public:
+	wstring text;
+	vector<wstring> files;
+	SourceBuffer();
+	~SourceBuffer();
+	uint32_t file(wstring filename);
+	wstring_view view(const Token& token) const;
+	Token generated(const Token& at, const wchar_t* marker);
+	TokenText resolve(const Token& token) const;
+private:
+	map<wstring, uint32_t, less<>> markers;
+};
+
+/*
+	Character classes of 64 consecutive characters as bit masks, bit k standing for text[base + k].
+	With SSE2 a block is classified 16 characters at a time: characters are narrowed to bytes, with everything outside ASCII mapped to 0x80 so it lands in no class but wide.
+	The tokenizer then finds where whitespace, comments and identifiers end by counting trailing zeros, and only does scalar work at token boundaries.
+	Characters at or past end read as L'\0'.
+*/
+class CharacterMasks {
+public:
+	uint64_t stop = 0;	//ends an identifier: blanks, line ends, L'\0', operators, ',', '(', ')' and ':'
+	uint64_t blank = 0;	//space and tab
+	uint64_t lineEnd = 0;	//\r and \n
+	uint64_t upper = 0;	//A-Z, folded by adding 0x20
+	uint64_t wide = 0;	//outside ASCII, folded with towlower
+};
+
+class CharacterScanner {
+public:
+	CharacterScanner(wchar_t* _text, size_t _end);
+	~CharacterScanner();
+	bool test(size_t i, uint64_t CharacterMasks::* member);
+	size_t find(size_t i, uint64_t CharacterMasks::* member);
+	size_t skip(size_t i, uint64_t CharacterMasks::* member);
+	void fold(size_t begin, size_t last);
+private:
+	wchar_t* text;
+	size_t end;
+	size_t base = SIZE_MAX;
+	CharacterMasks masks;
+	const CharacterMasks& block(size_t i);
+	static bool isStop(wchar_t c);
+};
+
 class TokenizerError : public runtime_error {
 public:
-	Token token;
-	TokenizerError(string message, Token _token) :runtime_error(message) {
+	TokenText token;
+	TokenizerError(string message, TokenText _token) :runtime_error(message) {
 		token = _token;
 	}
 };
@@ -40,11 +114,210 @@ class Tokenizer
 public:
 	Tokenizer();
 	~Tokenizer();
-	static list<Token>* tokenize(wstring input, wstring filename);
+	static vector<Token> tokenize(SourceBuffer& source, wstring input, wstring filename);
 private:
-
+	static void numericEscape(const wchar_t* input, size_t& i, size_t& digit, wstring& output, size_t bits);
 };
 
+SourceBuffer::SourceBuffer()
+{
+}
+
+SourceBuffer::~SourceBuffer()
+{
+}
+
+uint32_t SourceBuffer::file(wstring filename)
+{
+	for (size_t i = 0; i < files.size(); i++)
+	{
+		if (files[i] == filename)
+		{
+			return (uint32_t)i;
+		}
+	}
+	files.push_back(filename);
+	return (uint32_t)files.size() - 1;
+}
+
+wstring_view SourceBuffer::view(const Token& token) const
+{
+	return wstring_view(text.data() + token.offset, token.length);
+}
+
+Token SourceBuffer::generated(const Token& at, const wchar_t* marker)	//a token the parser splices in, like " endoffile", reported at the position of at
+{
+	auto i = markers.find(marker);
+	if (i == markers.end())
+	{
+		i = markers.insert(make_pair(wstring(marker), (uint32_t)text.size())).first;
+		text.append(marker);
+		text.push_back(L'\0');
+	}
+	Token output = at;
+	output.type = $TokenType::Genetated;
+	output.offset = i->second;
+	output.length = (uint32_t)i->first.size();
+	return output;
+}
+
+TokenText SourceBuffer::resolve(const Token& token) const
+{
+	TokenText output;
+	output.token = wstring(view(token));
+	output.filename = token.file < files.size() ? files[token.file] : L"";
+	output.line = token.line;
+	output.digit = token.digit;
+	return output;
+}
+
+CharacterScanner::CharacterScanner(wchar_t* _text, size_t _end)
+{
+	text = _text;
+	end = _end;
+}
+
+CharacterScanner::~CharacterScanner()
+{
+}
+
+bool CharacterScanner::isStop(wchar_t c)
+{
+	return c == L' ' || c == L'\r' || c == L'\n' || c == L'\0' || c == L'\t' || c == L'+' || c == L'-' || c == L'*' || c == L'/' || c == L'%' || c == L'|' || c == L'&' || c == L'^' || c == L'~' || c == L'<' || c == L'>' || c == L'!' || c == L'=' || c == L',' || c == L'(' || c == L')' || c == L':';
+}
+
+const CharacterMasks& CharacterScanner::block(size_t i)
+{
+	size_t first = i & ~(size_t)63;
+	if (first == base)
+	{
+		return masks;
+	}
+	base = first;
+	masks = CharacterMasks();
+	size_t k = 0;
+#ifdef TOKENIZER_HAS_SSE2
+	for (; k < 64 && base + k + 16 <= end; k += 16)
+	{
+		const __m128i* p = (const __m128i*)(text + base + k);
+		__m128i bytes;
+		if constexpr (sizeof(wchar_t) == 2)
+		{
+			__m128i a = _mm_loadu_si128(p), b = _mm_loadu_si128(p + 1);
+			__m128i narrowA = _mm_cmpeq_epi16(_mm_and_si128(a, _mm_set1_epi16((short)0xff80)), _mm_setzero_si128());
+			__m128i narrowB = _mm_cmpeq_epi16(_mm_and_si128(b, _mm_set1_epi16((short)0xff80)), _mm_setzero_si128());
+			a = _mm_or_si128(_mm_and_si128(narrowA, a), _mm_andnot_si128(narrowA, _mm_set1_epi16(0x80)));
+			b = _mm_or_si128(_mm_and_si128(narrowB, b), _mm_andnot_si128(narrowB, _mm_set1_epi16(0x80)));
+			bytes = _mm_packus_epi16(a, b);
+		}
+		else
+		{
+			__m128i words[2];
+			for (size_t n = 0; n < 2; n++)
+			{
+				__m128i a = _mm_loadu_si128(p + 2 * n), b = _mm_loadu_si128(p + 2 * n + 1);
+				__m128i narrowA = _mm_cmpeq_epi32(_mm_and_si128(a, _mm_set1_epi32((int)0xffffff80)), _mm_setzero_si128());
+				__m128i narrowB = _mm_cmpeq_epi32(_mm_and_si128(b, _mm_set1_epi32((int)0xffffff80)), _mm_setzero_si128());
+				a = _mm_or_si128(_mm_and_si128(narrowA, a), _mm_andnot_si128(narrowA, _mm_set1_epi32(0x80)));
+				b = _mm_or_si128(_mm_and_si128(narrowB, b), _mm_andnot_si128(narrowB, _mm_set1_epi32(0x80)));
+				words[n] = _mm_packs_epi32(a, b);
+			}
+			bytes = _mm_packus_epi16(words[0], words[1]);
+		}
+		auto is = [&](char c) { return _mm_cmpeq_epi8(bytes, _mm_set1_epi8(c)); };
+		__m128i blank = _mm_or_si128(is(' '), is('\t'));
+		__m128i lineEnd = _mm_or_si128(is('\r'), is('\n'));
+		__m128i stop = _mm_or_si128(_mm_or_si128(blank, lineEnd), is('\0'));
+		stop = _mm_or_si128(stop, _mm_or_si128(_mm_or_si128(is('+'), is('-')), _mm_or_si128(is('*'), is('/'))));
+		stop = _mm_or_si128(stop, _mm_or_si128(_mm_or_si128(is('%'), is('|')), _mm_or_si128(is('&'), is('^'))));
+		stop = _mm_or_si128(stop, _mm_or_si128(_mm_or_si128(is('~'), is('<')), _mm_or_si128(is('>'), is('!'))));
+		stop = _mm_or_si128(stop, _mm_or_si128(_mm_or_si128(is('='), is(',')), _mm_or_si128(is('('), is(')'))));
+		stop = _mm_or_si128(stop, is(':'));
+		__m128i upper = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('A' - 1)), _mm_cmplt_epi8(bytes, _mm_set1_epi8('Z' + 1)));
+		masks.stop |= (uint64_t)(uint16_t)_mm_movemask_epi8(stop) << k;
+		masks.blank |= (uint64_t)(uint16_t)_mm_movemask_epi8(blank) << k;
+		masks.lineEnd |= (uint64_t)(uint16_t)_mm_movemask_epi8(lineEnd) << k;
+		masks.upper |= (uint64_t)(uint16_t)_mm_movemask_epi8(upper) << k;
+		masks.wide |= (uint64_t)(uint16_t)_mm_movemask_epi8(is((char)0x80)) << k;
+	}
+#endif // TOKENIZER_HAS_SSE2
+	for (; k < 64; k++)	//the tail of the buffer, or everything without SSE2
+	{
+		wchar_t c = base + k < end ? text[base + k] : L'\0';
+		uint64_t bit = (uint64_t)1 << k;
+		masks.stop |= isStop(c) ? bit : 0;
+		masks.blank |= c == L' ' || c == L'\t' ? bit : 0;
+		masks.lineEnd |= c == L'\r' || c == L'\n' ? bit : 0;
+		masks.upper |= c >= L'A' && c <= L'Z' ? bit : 0;
+		masks.wide |= (uint32_t)c > 0x7f ? bit : 0;
+	}
+	return masks;
+}
+
+bool CharacterScanner::test(size_t i, uint64_t CharacterMasks::* member)
+{
+	return (block(i).*member >> (i & 63)) & 1;
+}
+
+size_t CharacterScanner::find(size_t i, uint64_t CharacterMasks::* member)	//first position at or after i in the class
+{
+	while (true)
+	{
+		uint64_t bits = block(i).*member & (~(uint64_t)0 << (i & 63));
+		if (bits)
+		{
+			return min(base + countr_zero(bits), end);
+		}
+		if (base + 64 >= end)
+		{
+			return end;
+		}
+		i = base + 64;
+	}
+}
+
+size_t CharacterScanner::skip(size_t i, uint64_t CharacterMasks::* member)	//first position at or after i not in the class
+{
+	while (true)
+	{
+		uint64_t bits = ~(block(i).*member) & (~(uint64_t)0 << (i & 63));
+		if (bits)
+		{
+			return min(base + countr_zero(bits), end);
+		}
+		if (base + 64 >= end)
+		{
+			return end;
+		}
+		i = base + 64;
+	}
+}
+
+void CharacterScanner::fold(size_t begin, size_t last)	//lowercase [begin, last) in place
+{
+	for (size_t i = begin; i < last; i = base + 64)
+	{
+		const CharacterMasks& m = block(i);
+		uint64_t range = ~(uint64_t)0 << (i & 63);
+		if (last - base < 64)
+		{
+			range &= ((uint64_t)1 << (last - base)) - 1;
+		}
+		if (!((m.upper | m.wide) & range))
+		{
+			continue;
+		}
+		for (uint64_t bits = m.upper & range; bits; bits &= bits - 1)
+		{
+			text[base + countr_zero(bits)] += 0x20;
+		}
+		for (uint64_t bits = m.wide & range; bits; bits &= bits - 1)
+		{
+			text[base + countr_zero(bits)] = towlower(text[base + countr_zero(bits)]);
+		}
+	}
+}
+
 Tokenizer::Tokenizer()
 {
 }
@@ -53,781 +326,261 @@ Tokenizer::~Tokenizer()
 {
 }
 
-list<Token>* Tokenizer::tokenize(wstring input, wstring filename) {
+vector<Token> Tokenizer::tokenize(SourceBuffer& source, wstring input, wstring filename) {
+	static const wchar_t escapes[] = L"abfnrtv\\\'\"\?", escaped[] = L"\a\b\f\n\r\t\v\\\'\"\?";
 	size_t parenthesisDepth = 0;
-	list<Token>* output = new list<Token>();
-	basic_string<wchar_t>::size_type i = 0;
+	vector<Token> output;
+	vector<size_t> quoted;	//tokens whose offset is still relative to decoded
+	wstring decoded;
+	uint32_t file = source.file(filename);
+	size_t i = source.text.size();
+	if (source.text.empty())
+	{
+		source.text = move(input);
+	}
+	else
+	{
+		source.text.append(input);
+	}
+	size_t end = source.text.size();
+	source.text.push_back(L'\0');
+	wchar_t* text = source.text.data();
+	CharacterScanner scanner(text, end);
+	output.reserve((end - i) / 8);	//about what data heavy sources produce, avoids most regrowth
 	basic_string<wchar_t>::size_type line = 1;
 	basic_string<wchar_t>::size_type digit = 1;
+	auto emit = [&]($TokenType type, size_t length) {
+		Token tmp;
+		tmp.type = type;
+		tmp.file = file;
+		tmp.offset = (uint32_t)i;
+		tmp.length = (uint32_t)length;
+		tmp.line = (uint32_t)line;
+		tmp.digit = (uint32_t)digit;
+		if (type == $TokenType::Operator || type == $TokenType::ExposedDelimiter || type == $TokenType::NonexposedDelimiter)
+		{
+			tmp.op = findOperator(wstring_view(text + i, length));
+		}
+		output.push_back(tmp);
+		i += length;
+		digit += length;
+	};
 	while (true)
 	{
-		Token tmp;
-		if (i >= input.length() || input[i] == L'\0')	//end of file
+		if (i >= end || text[i] == L'\0')	//end of file
 		{
 			break;
 		}
-		if (input[i] == L',')
+		if ((text[i] == L':' || !scanner.test(i, &CharacterMasks::stop)) && text[i] != L';' && text[i] != L'\'' && text[i] != L'\"')	//identifiers, numbers and labels, the common case
 		{
-			tmp.token.push_back(input[i]);
-			if (parenthesisDepth != 0)
+			size_t j = scanner.find(i + 1, &CharacterMasks::stop);
+			$TokenType type = $TokenType::Default;
+			if (text[i] == L':')
 			{
-				tmp.type = $TokenType::NonexposedDelimiter;
+				type = $TokenType::Label;
+				j = i + 1;
 			}
-			else
+			else if (j < end && text[j] == L':')
 			{
-				tmp.type = $TokenType::ExposedDelimiter;
+				type = $TokenType::Label;
+				j++;
 			}
-			tmp.filename = filename;
-			tmp.digit = digit;
-			tmp.line = line;
-			i++;
-			digit++;
-			output->push_back(tmp);
+			scanner.fold(i, j);
+			emit(type, j - i);
 			continue;
 		}
-		if (input[i] == L'(')
+		if (text[i] == L',')
+		{
+			emit(parenthesisDepth != 0 ? $TokenType::NonexposedDelimiter : $TokenType::ExposedDelimiter, 1);
+			continue;
+		}
+		if (text[i] == L'(')
 		{
 			parenthesisDepth++;
-			tmp.token.push_back(input[i]);
-			tmp.type = $TokenType::LeftParenthesis;
-			tmp.filename = filename;
-			tmp.digit = digit;
-			tmp.line = line;
-			i++;
-			digit++;
-			output->push_back(tmp);
+			emit($TokenType::LeftParenthesis, 1);
 			continue;
 		}
-		if (input[i] == L')')
+		if (text[i] == L')')
 		{
 			parenthesisDepth--;
-			tmp.token.push_back(input[i]);
-			tmp.type = $TokenType::RightParenthesis;
-			tmp.filename = filename;
-			tmp.digit = digit;
-			tmp.line = line;
+			emit($TokenType::RightParenthesis, 1);
 			if (parenthesisDepth < 0)
 			{
-				throw TokenizerError("Parenthesis depth underrun", tmp);
+				throw TokenizerError("Parenthesis depth underrun", source.resolve(output.back()));
 			}
-			i++;
-			digit++;
-			output->push_back(tmp);
 			continue;
 		}
-		if (input[i] == L'+' || input[i] == L'-' || input[i] == L'*' || input[i] == L'/' || input[i] == L'%' || input[i] == L'~')	//label and operands
+		if (text[i] == L'+' || text[i] == L'-' || text[i] == L'*' || text[i] == L'/' || text[i] == L'%' || text[i] == L'~')	//label and operands
 		{
-			tmp.token.push_back(input[i]);
-			tmp.type = $TokenType::Operator;
-			tmp.filename = filename;
-			tmp.digit = digit;
-			tmp.line = line;
-			i++;
-			digit++;
-			output->push_back(tmp);
+			emit($TokenType::Operator, 1);
 			continue;
 		}
-		if (input[i] == L'<')
+		if (text[i] == L'<')	//<, <<, <=
 		{
-			if ((i + 1) < input.length() && (input[i + 1] == L'<' || input[i + 1] == L'='))
-			{
-				tmp.token.push_back(input[i]);
-				tmp.token.push_back(input[i + 1]);
-				tmp.type = $TokenType::Operator;
-				tmp.filename = filename;
-				tmp.digit = digit;
-				tmp.line = line;
-				i += 2;
-				digit += 2;
-				output->push_back(tmp);
-				continue;
-			}
-			else
-			{
-				tmp.token.push_back(input[i]);
-				tmp.type = $TokenType::Operator;
-				tmp.filename = filename;
-				tmp.digit = digit;
-				tmp.line = line;
-				i++;
-				digit++;
-				output->push_back(tmp);
-				continue;
-			}
-		}
-		if (input[i] == L'>')
-		{
-			if ((i + 2) < input.length() && input[i + 1] == L'>' && input[i + 2] == L'>')
-			{
-				tmp.token.push_back(input[i]);
-				tmp.token.push_back(input[i + 1]);
-				tmp.token.push_back(input[i + 2]);
-				tmp.type = $TokenType::Operator;
-				tmp.filename = filename;
-				tmp.digit = digit;
-				tmp.line = line;
-				i += 3;
-				digit += 3;
-				output->push_back(tmp);
-				continue;
-			}
-			else if ((i + 1) < input.length() && (input[i + 1] == L'>' || input[i + 1] == L'='))
-			{
-				tmp.token.push_back(input[i]);
-				tmp.token.push_back(input[i + 1]);
-				tmp.type = $TokenType::Operator;
-				tmp.filename = filename;
-				tmp.digit = digit;
-				tmp.line = line;
-				i += 2;
-				digit += 2;
-				output->push_back(tmp);
-				continue;
-			}
-			else
-			{
-				tmp.token.push_back(input[i]);
-				tmp.type = $TokenType::Operator;
-				tmp.filename = filename;
-				tmp.digit = digit;
-				tmp.line = line;
-				i++;
-				digit++;
-				output->push_back(tmp);
-				continue;
-			}
-		}
-		if (input[i] == L'|')
-		{
-			if ((i + 1) < input.length() && input[i + 1] == L'|')
-			{
-				tmp.token.push_back(input[i]);
-				tmp.token.push_back(input[i + 1]);
-				tmp.type = $TokenType::Operator;
-				tmp.filename = filename;
-				tmp.digit = digit;
-				tmp.line = line;
-				i += 2;
-				digit += 2;
-				output->push_back(tmp);
-				continue;
-			}
-			else
-			{
-				tmp.token.push_back(input[i]);
-				tmp.type = $TokenType::Operator;
-				tmp.filename = filename;
-				tmp.digit = digit;
-				tmp.line = line;
-				i++;
-				digit++;
-				output->push_back(tmp);
-				continue;
-			}
-		}
-		if (input[i] == L'&')
-		{
-			if ((i + 1) < input.length() && input[i + 1] == L'&')
-			{
-				tmp.token.push_back(input[i]);
-				tmp.token.push_back(input[i + 1]);
-				tmp.type = $TokenType::Operator;
-				tmp.filename = filename;
-				tmp.digit = digit;
-				tmp.line = line;
-				i += 2;
-				digit += 2;
-				output->push_back(tmp);
-				continue;
-			}
-			else
-			{
-				tmp.token.push_back(input[i]);
-				tmp.type = $TokenType::Operator;
-				tmp.filename = filename;
-				tmp.digit = digit;
-				tmp.line = line;
-				i++;
-				digit++;
-				output->push_back(tmp);
-				continue;
-			}
+			emit($TokenType::Operator, text[i + 1] == L'<' || text[i + 1] == L'=' ? 2 : 1);
+			continue;
 		}
-		if (input[i] == L'^')
+		if (text[i] == L'>')	//>, >>, >>>, >=
 		{
-			if ((i + 1) < input.length() && input[i + 1] == L'^')
-			{
-				tmp.token.push_back(input[i]);
-				tmp.token.push_back(input[i + 1]);
-				tmp.type = $TokenType::Operator;
-				tmp.filename = filename;
-				tmp.digit = digit;
-				tmp.line = line;
-				i += 2;
-				digit += 2;
-				output->push_back(tmp);
-				continue;
-			}
-			else
-			{
-				tmp.token.push_back(input[i]);
-				tmp.type = $TokenType::Operator;
-				tmp.filename = filename;
-				tmp.digit = digit;
-				tmp.line = line;
-				i++;
-				digit++;
-				output->push_back(tmp);
-				continue;
-			}
+			emit($TokenType::Operator, text[i + 1] == L'>' && text[i + 2] == L'>' ? 3 : text[i + 1] == L'>' || text[i + 1] == L'=' ? 2 : 1);
+			continue;
 		}
-		if (input[i] == L'!')
+		if (text[i] == L'|' || text[i] == L'&' || text[i] == L'^')	//doubled for the boolean forms
 		{
-			if ((i + 1) < input.length() && input[i + 1] == L'=')
-			{
-				tmp.token.push_back(input[i]);
-				tmp.token.push_back(input[i + 1]);
-				tmp.type = $TokenType::Operator;
-				tmp.filename = filename;
-				tmp.digit = digit;
-				tmp.line = line;
-				i += 2;
-				digit += 2;
-				output->push_back(tmp);
-				continue;
-			}
-			else
-			{
-				tmp.token.push_back(input[i]);
-				tmp.type = $TokenType::Operator;
-				tmp.filename = filename;
-				tmp.digit = digit;
-				tmp.line = line;
-				i++;
-				digit++;
-				output->push_back(tmp);
-				continue;
-			}
+			emit($TokenType::Operator, text[i + 1] == text[i] ? 2 : 1);
+			continue;
 		}
-		if (input[i] == L'=')
+		if (text[i] == L'!' || text[i] == L'=')	//!=, ==
 		{
-			if ((i + 1) < input.length() && input[i + 1] == L'=')
-			{
-				tmp.token.push_back(input[i]);
-				tmp.token.push_back(input[i + 1]);
-				tmp.type = $TokenType::Operator;
-				tmp.filename = filename;
-				tmp.digit = digit;
-				tmp.line = line;
-				i += 2;
-				digit += 2;
-				output->push_back(tmp);
-				continue;
-			}
-			else
-			{
-				tmp.token.push_back(input[i]);
-				tmp.type = $TokenType::Operator;
-				tmp.filename = filename;
-				tmp.digit = digit;
-				tmp.line = line;
-				i++;
-				digit++;
-				output->push_back(tmp);
-				continue;
-			}
+			emit($TokenType::Operator, text[i + 1] == L'=' ? 2 : 1);
+			continue;
 		}
-		if (input[i] == L';')	//comment
+		if (text[i] == L';')	//comment
 		{
-			i++;
-			digit++;
-			while (input[i] != L'\n' && input[i] != L'\r')
-			{
-				i++;
-				digit++;
-			}
+			size_t j = scanner.find(i + 1, &CharacterMasks::lineEnd);
+			digit += j - i;
+			i = j;
 			continue;
 		}
-		if (input[i] == L'\'')	//single quote
+		if (text[i] == L'\'' || text[i] == L'\"')	//single or double quote
 		{
+			wchar_t quote = text[i];
+			size_t start = decoded.size();
+			Token tmp;
 			tmp.type = $TokenType::QuotedText;
-			tmp.filename = filename;
-			tmp.line = line;
-			tmp.digit = digit;
+			tmp.file = file;
+			tmp.line = (uint32_t)line;
+			tmp.digit = (uint32_t)digit;
 			i++;
 			digit++;
 			while (true)
 			{
-				if (i >= input.length())
+				if (i >= end)
 				{
-					throw TokenizerError("Unexpected end of file", tmp);
-					break;
+					throw TokenizerError("Unexpected end of file", source.resolve(tmp));
 				}
-				if (input[i] == L'\\')
+				if (text[i] == L'\\')
 				{
 					i++;
 					digit++;
-					if (i >= input.length())
+					if (i >= end)
 					{
-						throw TokenizerError("Unexpected end of file", tmp);
-						break;
+						throw TokenizerError("Unexpected end of file", source.resolve(tmp));
 					}
-					if (input[i] == L'a')
+					const wchar_t* simple = text[i] ? wcschr(escapes, text[i]) : nullptr;
+					if (simple)
 					{
-						tmp.token.push_back(L'\a');
+						decoded.push_back(escaped[simple - escapes]);
 						i++;
 						digit++;
 						continue;
 					}
-					if (input[i] == L'b')
+					if (text[i] >= L'0' && text[i] <= L'7')
 					{
-						tmp.token.push_back(L'\b');
-						i++;
-						digit++;
-						continue;
+						numericEscape(text, i, digit, decoded, 3);
 					}
-					if (input[i] == L'f')
+					if (text[i] == L'x' || text[i] == L'X')
 					{
-						tmp.token.push_back(L'\f');
 						i++;
 						digit++;
-						continue;
-					}
-					if (input[i] == L'n')
-					{
-						tmp.token.push_back(L'\n');
-						i++;
-						digit++;
-						continue;
-					}
-					if (input[i] == L'r')
-					{
-						tmp.token.push_back(L'\r');
-						i++;
-						digit++;
-						continue;
-					}
-					if (input[i] == L't')
-					{
-						tmp.token.push_back(L'\t');
-						i++;
-						digit++;
-						continue;
-					}
-					if (input[i] == L'v')
-					{
-						tmp.token.push_back(L'\v');
-						i++;
-						digit++;
-						continue;
-					}
-					if (input[i] == L'\\')
-					{
-						tmp.token.push_back(L'\\');
-						i++;
-						digit++;
-						continue;
-					}
-					if (input[i] == L'\'')
-					{
-						tmp.token.push_back(L'\'');
-						i++;
-						digit++;
-						continue;
-					}
-					if (input[i] == L'\"')
-					{
-						tmp.token.push_back(L'\"');
-						i++;
-						digit++;
-						continue;
-					}
-					if (input[i] == L'\?')
-					{
-						tmp.token.push_back(L'\?');
-						i++;
-						digit++;
-						continue;
-					}
-					if (input[i] >= L'0' && input[i] <= L'7')
-					{
-						wstring tmpString = L"";
-						while (input[i] >= L'0' && input[i] <= L'7')
-						{
-							tmpString.push_back(input[i]);
-							i++;
-							digit++;
-						}
-						basic_string<wchar_t>::size_type j = tmpString.length();
-						while (j > 0)
-						{
-							basic_string<wchar_t>::size_type k = 0;
-							uint64_t l = 0;
-							while (k < 16 && j > 0)
-							{
-								l = l | (stoull(&tmpString[j - 1], nullptr, 8)) << (3 * k);
-								//l = l | ((uint64_t)(tmpString[j - 1] - L'0') << 3 * k);
-								tmpString.pop_back();
-								j--;
-								k++;
-							}
-							uint32_t m = 1;
-							if (*(char*)&m)	//little-endian 0x1032547698ba----
-							{
-								for (basic_string<wchar_t>::size_type n = 0; (k * 3) > (sizeof(wchar_t) * 8 * n); n++)
-								{
-									tmp.token.push_back(((wchar_t*)&l)[n]);
-								}
-							}
-							else //big-endian 0x----ba9876543210
-							{
-								uint32_t o = 0;
-								o |= l << 56;
-								o |= (l & 0x00000000'0000ff00) << 40;
-								o |= (l & 0x00000000'00ff0000) << 24;
-								o |= (l & 0x00000000'ff000000) << 8;
-								o |= (l & 0x000000ff'00000000) >> 8;
-								o |= (l & 0x0000ff00'00000000) >> 24;
-								o |= (l & 0x00ff0000'00000000) >> 40;
-								o |= l >> 56;
-								for (basic_string<wchar_t>::size_type n = 0; (k * 3) > (sizeof(wchar_t) * 8 * n); n++)
-								{
-									tmp.token.push_back(((wchar_t*)&o)[n]);
-								}
-							}
-						}
-					}
-					if (input[i] == L'x' || input[i] == L'X')
-					{
-						i++;
-						digit++;
-						wstring tmpString = L"";
-						while ((input[i] >= L'0' && input[i] <= L'9') || (input[i] >= L'a' && input[i] <= L'f') || (input[i] >= L'A' && input[i] <= L'F'))
-						{
-							tmpString.push_back(input[i]);
-							i++;
-							digit++;
-						}
-						basic_string<wchar_t>::size_type j = tmpString.length();
-						while (j > 0)
-						{
-							basic_string<wchar_t>::size_type k = 0;
-							uint64_t l = 0;
-							while (k < 16 && j > 0)
-							{
-								//l = l | (_wtoll(&tmpString[j - 1]) << (4 * k));
-								l = l | (stoull(&tmpString[j - 1], nullptr, 16)) << (4 * k);
-								//l = l | ((uint64_t)(tmpString[j - 1] - L'0') << 3 * k);
-								tmpString.pop_back();
-								j--;
-								k++;
-							}
-							uint32_t m = 1;
-							if (*(char*)&m)	//little-endian 0x1032547698ba----
-							{
-								for (basic_string<wchar_t>::size_type n = 0; (k * 4) > (sizeof(wchar_t) * 8 * n); n++)
-								{
-									tmp.token.push_back(((wchar_t*)&l)[n]);
-								}
-							}
-							else //big-endian 0x----ba9876543210
-							{
-								uint32_t o = 0;
-								o |= l << 56;
-								o |= (l & 0x00000000'0000ff00) << 40;
-								o |= (l & 0x00000000'00ff0000) << 24;
-								o |= (l & 0x00000000'ff000000) << 8;
-								o |= (l & 0x000000ff'00000000) >> 8;
-								o |= (l & 0x0000ff00'00000000) >> 24;
-								o |= (l & 0x00ff0000'00000000) >> 40;
-								o |= l >> 56;
-								for (basic_string<wchar_t>::size_type n = 0; (k * 4) > (sizeof(wchar_t) * 8 * n); n++)
-								{
-									tmp.token.push_back(((wchar_t*)&o)[n]);
-								}
-							}
-						}
+						numericEscape(text, i, digit, decoded, 4);
 					}
 				}
-				if (input[i] == L'\'')
+				if (text[i] == quote)
 				{
 					i++;
 					digit++;
 					break;
 				}
-				tmp.token.push_back(input[i]);
+				decoded.push_back(text[i]);
 				i++;
 				digit++;
 			}
-			output->push_back(tmp);
-			continue;
-		}
-		if (input[i] == L'\"')	//double quote
-		{
-			tmp.type = $TokenType::QuotedText;
-			tmp.filename = filename;
-			tmp.line = line;
-			tmp.digit = digit;
-			i++;
-			digit++;
-			while (true)
+			for (size_t j = start; j < decoded.size(); j++)
 			{
-				if (i >= input.length())
-				{
-					throw TokenizerError("Unexpected end of file", tmp);
-					break;
-				}
-				if (input[i] == L'\\')
-				{
-					i++;
-					digit++;
-					if (i >= input.length())
-					{
-						throw TokenizerError("Unexpected end of file", tmp);
-						break;
-					}
-					if (input[i] == L'a')
-					{
-						tmp.token.push_back(L'\a');
-						i++;
-						digit++;
-						continue;
-					}
-					if (input[i] == L'b')
-					{
-						tmp.token.push_back(L'\b');
-						i++;
-						digit++;
-						continue;
-					}
-					if (input[i] == L'f')
-					{
-						tmp.token.push_back(L'\f');
-						i++;
-						digit++;
-						continue;
-					}
-					if (input[i] == L'n')
-					{
-						tmp.token.push_back(L'\n');
-						i++;
-						digit++;
-						continue;
-					}
-					if (input[i] == L'r')
-					{
-						tmp.token.push_back(L'\r');
-						i++;
-						digit++;
-						continue;
-					}
-					if (input[i] == L't')
-					{
-						tmp.token.push_back(L'\t');
-						i++;
-						digit++;
-						continue;
-					}
-					if (input[i] == L'v')
-					{
-						tmp.token.push_back(L'\v');
-						i++;
-						digit++;
-						continue;
-					}
-					if (input[i] == L'\\')
-					{
-						tmp.token.push_back(L'\\');
-						i++;
-						digit++;
-						continue;
-					}
-					if (input[i] == L'\'')
-					{
-						tmp.token.push_back(L'\'');
-						i++;
-						digit++;
-						continue;
-					}
-					if (input[i] == L'\"')
-					{
-						tmp.token.push_back(L'\"');
-						i++;
-						digit++;
-						continue;
-					}
-					if (input[i] == L'\?')
-					{
-						tmp.token.push_back(L'\?');
-						i++;
-						digit++;
-						continue;
-					}
-					if (input[i] >= L'0' && input[i] <= L'7')
-					{
-						wstring tmpString = L"";
-						while (input[i] >= L'0' && input[i] <= L'7')
-						{
-							tmpString.push_back(input[i]);
-							i++;
-							digit++;
-						}
-						basic_string<wchar_t>::size_type j = tmpString.length();
-						while (j > 0)
-						{
-							basic_string<wchar_t>::size_type k = 0;
-							uint64_t l = 0;
-							while (k < 16 && j > 0)
-							{
-								l = l | (stoull(&tmpString[j - 1], nullptr, 8)) << (3 * k);
-								//l = l | ((uint64_t)(tmpString[j - 1] - L'0') << 3 * k);
-								tmpString.pop_back();
-								j--;
-								k++;
-							}
-							uint32_t m = 1;
-							if (*(char*)&m)	//little-endian 0x1032547698ba----
-							{
-								for (basic_string<wchar_t>::size_type n = 0; (k * 3) > (sizeof(wchar_t) * 8 * n); n++)
-								{
-									tmp.token.push_back(((wchar_t*)&l)[n]);
-								}
-							}
-							else //big-endian 0x----ba9876543210
-							{
-								uint32_t o = 0;
-								o |= l << 56;
-								o |= (l & 0x00000000'0000ff00) << 40;
-								o |= (l & 0x00000000'00ff0000) << 24;
-								o |= (l & 0x00000000'ff000000) << 8;
-								o |= (l & 0x000000ff'00000000) >> 8;
-								o |= (l & 0x0000ff00'00000000) >> 24;
-								o |= (l & 0x00ff0000'00000000) >> 40;
-								o |= l >> 56;
-								for (basic_string<wchar_t>::size_type n = 0; (k * 3) > (sizeof(wchar_t) * 8 * n); n++)
-								{
-									tmp.token.push_back(((wchar_t*)&o)[n]);
-								}
-							}
-						}
-					}
-					if (input[i] == L'x' || input[i] == L'X')
-					{
-						i++;
-						digit++;
-						wstring tmpString = L"";
-						while ((input[i] >= L'0' && input[i] <= L'9') || (input[i] >= L'a' && input[i] <= L'f') || (input[i] >= L'A' && input[i] <= L'F'))
-						{
-							tmpString.push_back(input[i]);
-							i++;
-							digit++;
-						}
-						basic_string<wchar_t>::size_type j = tmpString.length();
-						while (j > 0)
-						{
-							basic_string<wchar_t>::size_type k = 0;
-							uint64_t l = 0;
-							while (k < 16 && j > 0)
-							{
-								//l = l | (_wtoll(&tmpString[j - 1]) << (4 * k));
-								l = l | (stoull(&tmpString[j - 1], nullptr, 16)) << (4 * k);
-								//l = l | ((uint64_t)(tmpString[j - 1] - L'0') << 3 * k);
-								tmpString.pop_back();
-								j--;
-								k++;
-							}
-							uint32_t m = 1;
-							if (*(char*)&m)	//little-endian 0x1032547698ba----
-							{
-								for (basic_string<wchar_t>::size_type n = 0; (k * 4) > (sizeof(wchar_t) * 8 * n); n++)
-								{
-									tmp.token.push_back(((wchar_t*)&l)[n]);
-								}
-							}
-							else //big-endian 0x----ba9876543210
-							{
-								uint32_t o = 0;
-								o |= l << 56;
-								o |= (l & 0x00000000'0000ff00) << 40;
-								o |= (l & 0x00000000'00ff0000) << 24;
-								o |= (l & 0x00000000'ff000000) << 8;
-								o |= (l & 0x000000ff'00000000) >> 8;
-								o |= (l & 0x0000ff00'00000000) >> 24;
-								o |= (l & 0x00ff0000'00000000) >> 40;
-								o |= l >> 56;
-								for (basic_string<wchar_t>::size_type n = 0; (k * 4) > (sizeof(wchar_t) * 8 * n); n++)
-								{
-									tmp.token.push_back(((wchar_t*)&o)[n]);
-								}
-							}
-						}
-					}
-				}
-				if (input[i] == L'\"')
-				{
-					i++;
-					digit++;
-					break;
-				}
-				tmp.token.push_back(input[i]);
-				i++;
-				digit++;
+				decoded[j] = towlower(decoded[j]);
 			}
-			output->push_back(tmp);
+			tmp.offset = (uint32_t)start;
+			tmp.length = (uint32_t)(decoded.size() - start);
+			quoted.push_back(output.size());
+			output.push_back(tmp);
 			continue;
 		}
-		if (input[i] == L' ' || input[i] == L'\t')	//space and tab
+		if (text[i] == L' ' || text[i] == L'\t')	//space and tab
 		{
-			i++;
-			digit++;
+			size_t j = scanner.skip(i, &CharacterMasks::blank);
+			digit += j - i;
+			i = j;
 			continue;
 		}
-		if (input[i] == L'\r')	//return
+		if (text[i] == L'\r')	//return
 		{
-			if ((i + 1) < input.length() && input[i + 1] == L'\n')
-			{
-				i += 2;
-				digit = 1;
-				line++;
-				continue;
-			}
-			else
-			{
-				i++;
-				digit = 1;
-				line++;
-				continue;
-			}
+			i += text[i + 1] == L'\n' ? 2 : 1;
+			digit = 1;
+			line++;
+			continue;
 		}
-		if (input[i] == L'\n')	//linefeed
+		if (text[i] == L'\n')	//linefeed
 		{
 			i++;
 			digit = 1;
 			line++;
 			continue;
 		}
-		if (true)	//others
+	}
+	size_t base = source.text.size();
+	source.text.append(decoded);
+	for (auto j : quoted)
+	{
+		output[j].offset += (uint32_t)base;
+	}
+	return output;
+}
+
+void Tokenizer::numericEscape(const wchar_t* input, size_t& i, size_t& digit, wstring& output, size_t bits)	//\ooo and \xhh: the digits, least significant first, packed into as many characters as they need
+{
+	wstring tmpString = L"";
+	while (bits == 3 ? (input[i] >= L'0' && input[i] <= L'7') : ((input[i] >= L'0' && input[i] <= L'9') || (input[i] >= L'a' && input[i] <= L'f') || (input[i] >= L'A' && input[i] <= L'F')))
+	{
+		tmpString.push_back(input[i]);
+		i++;
+		digit++;
+	}
+	basic_string<wchar_t>::size_type j = tmpString.length();
+	while (j > 0)
+	{
+		basic_string<wchar_t>::size_type k = 0;
+		uint64_t l = 0;
+		while (k < 16 && j > 0)
+		{
+			l = l | (stoull(&tmpString[j - 1], nullptr, 1 << bits)) << (bits * k);
+			tmpString.pop_back();
+			j--;
+			k++;
+		}
+		uint32_t m = 1;
+		if (*(char*)&m)	//little-endian 0x1032547698ba----
 		{
-			tmp.filename = filename;
-			tmp.line = line;
-			tmp.digit = digit;
-			while (i < input.length() && input[i] != L' ' && input[i] != L'\r' && input[i] != L'\n' && input[i] != L'\0' && input[i] != L'\t' && input[i] != L'+' && input[i] != L'-' && input[i] != L'*' && input[i] != L'/' && input[i] != L'%' && input[i] != L'|' && input[i] != L'&' && input[i] != L'^' && input[i] != L'~' && input[i] != L'<' && input[i] != L'>' && input[i] != L'!' && input[i] != L'=' && input[i] != L',' && input[i] != L'(' && input[i] != L')')	//not separator nor operand
+			for (basic_string<wchar_t>::size_type n = 0; (k * bits) > (sizeof(wchar_t) * 8 * n); n++)
 			{
-				if (input[i] == L':')
-				{
-					tmp.type = $TokenType::Label;
-					tmp.token.push_back(input[i]);
-					i++;
-					digit++;
-					break;
-				}
-				tmp.token.push_back(input[i]);
-				i++;
-				digit++;
+				output.push_back(((wchar_t*)&l)[n]);
+			}
+		}
+		else //big-endian 0x----ba9876543210
+		{
+			uint32_t o = 0;
+			o |= l << 56;
+			o |= (l & 0x00000000'0000ff00) << 40;
+			o |= (l & 0x00000000'00ff0000) << 24;
+			o |= (l & 0x00000000'ff000000) << 8;
+			o |= (l & 0x000000ff'00000000) >> 8;
+			o |= (l & 0x0000ff00'00000000) >> 24;
+			o |= (l & 0x00ff0000'00000000) >> 40;
+			o |= l >> 56;
+			for (basic_string<wchar_t>::size_type n = 0; (k * bits) > (sizeof(wchar_t) * 8 * n); n++)
+			{
+				output.push_back(((wchar_t*)&o)[n]);
 			}
-			output->push_back(tmp);
-			continue;
 		}
 	}
-	return output;
 }
\ No newline at end of file
@@ -0,0 +1,164 @@
+#pragma once
+#include <stdint.h>
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/*
+	Chrome trace-event recorder (chrome://tracing, ui.perfetto.dev).
+	Spans are stored as complete events ("X") and counters as "C" events; names must be string literals since only the pointer is kept.
+	Nothing is recorded unless a Trace is created, every hook takes a Trace* that may be null.
+*/
+class TraceEvent
+{
+public:
+	char phase = 'X';
+	const wchar_t* name = L"";
+	const wchar_t* category = L"";
+	double timestamp = 0;	//microseconds since the trace was created
+	double value = 0;	//duration for spans, value for counters
+};
+
+class Trace
+{
+public:
+	vector<TraceEvent> events;
+	Trace();
+	~Trace();
+	double now();
+	void complete(const wchar_t* name, const wchar_t* category, double start);
+	void counter(const wchar_t* name, double value);
+	void instant(const wchar_t* name, const wchar_t* category);
+	bool save(wstring filename);
+	void write(ostream& out);
+private:
+	chrono::steady_clock::time_point origin;
+};
+
+class TraceSpan
+{
+public:
+	TraceSpan(Trace* _trace, const wchar_t* _name, const wchar_t* _category);
+	~TraceSpan();
+private:
+	Trace* trace;
+	const wchar_t* name;
+	const wchar_t* category;
+	double start = 0;
+};
+
+Trace::Trace()
+{
+	origin = chrono::steady_clock::now();
+	events.reserve(0x10000);
+}
+
+Trace::~Trace()
+{
+}
+
+double Trace::now()
+{
+	return chrono::duration<double, micro>(chrono::steady_clock::now() - origin).count();
+}
+
+void Trace::complete(const wchar_t* name, const wchar_t* category, double start)
+{
+	TraceEvent event;
+	event.phase = 'X';
+	event.name = name;
+	event.category = category;
+	event.timestamp = start;
+	event.value = now() - start;
+	events.push_back(event);
+}
+
+void Trace::counter(const wchar_t* name, double value)
+{
+	TraceEvent event;
+	event.phase = 'C';
+	event.name = name;
+	event.category = L"counter";
+	event.timestamp = now();
+	event.value = value;
+	events.push_back(event);
+}
+
+void Trace::instant(const wchar_t* name, const wchar_t* category)
+{
+	TraceEvent event;
+	event.phase = 'i';
+	event.name = name;
+	event.category = category;
+	event.timestamp = now();
+	events.push_back(event);
+}
+
+bool Trace::save(wstring filename)
+{
+	ofstream ofs;
+	ofs.open(filename, ios_base::binary | ios_base::out);
+	if (ofs.fail())
+	{
+		return false;
+	}
+	write(ofs);
+	ofs.close();
+	return !ofs.fail();
+}
+
+void Trace::write(ostream& out)
+{
+	auto narrow = [&](const wchar_t* text) {
+		for (size_t i = 0; text[i] != L'\0'; i++)
+		{
+			out.put((text[i] == L'"' || text[i] == L'\\' || text[i] > 0x7e) ? '_' : (char)text[i]);
+		}
+	};
+	out << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+	for (size_t i = 0; i < events.size(); i++)
+	{
+		const TraceEvent& event = events[i];
+		out << "{\"ph\":\"" << event.phase << "\",\"pid\":1,\"tid\":1,\"name\":\"";
+		narrow(event.name);
+		out << "\",\"cat\":\"";
+		narrow(event.category);
+		out << "\",\"ts\":" << to_string(event.timestamp);
+		if (event.phase == 'X')
+		{
+			out << ",\"dur\":" << to_string(event.value);
+		}
+		else if (event.phase == 'C')
+		{
+			out << ",\"args\":{\"value\":" << to_string(event.value) << "}";
+		}
+		else if (event.phase == 'i')
+		{
+			out << ",\"s\":\"t\"";
+		}
+		out << (i + 1 < events.size() ? "},\n" : "}\n");
+	}
+	out << "]}\n";
+}
+
+TraceSpan::TraceSpan(Trace* _trace, const wchar_t* _name, const wchar_t* _category)
+{
+	trace = _trace;
+	name = _name;
+	category = _category;
+	if (trace)
+	{
+		start = trace->now();
+	}
+}
+
+TraceSpan::~TraceSpan()
+{
+	if (trace)
+	{
+		trace->complete(name, category, start);
+	}
+}
\ No newline at end of file
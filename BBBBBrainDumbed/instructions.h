@@ -1,7 +1,9 @@
 #pragma once
+#include <algorithm>
 #include <bitset>
-#include <map>
 #include <string>
+#include <string_view>
+#include <vector>
 
 using namespace std;
 
@@ -12,11 +14,11 @@ enum class InstructionType
 	mnemonic_expect_registername,
 	registername,
 	directive,
-	$operator,
 	unknownnumber,
 	knownnumber,
 	macro,
-	endoffile
+	endoffile,
+	endofmacro
 };
 
 enum class Associativity
@@ -25,6 +27,330 @@ enum class Associativity
 	right_associative,
 };
 
+enum class Directive : int64_t	//Instruction::value of directives
+{
+	binclude,
+	define,
+	ed,
+	enddata,
+	endmacro,
+	equ,
+	ldi16,
+	assertTicks,
+	include,
+	macro,
+	repeat,
+	endrepeat,
+	nopt,
+	endnopt,
+};
+
+enum class OperatorKind : uint8_t	//resolved by the tokenizer, so the parser never compares operator text
+{
+	none,
+	add,
+	subtract,
+	multiply,
+	divide,
+	modulo,
+	bitOr,
+	bitAnd,
+	bitXor,
+	bitNot,
+	shiftLeft,
+	shiftRight,
+	arithmeticShiftRight,
+	boolOr,
+	boolAnd,
+	boolXor,
+	boolNot,
+	less,
+	greater,
+	lessEqual,
+	greaterEqual,
+	equal,
+	notEqual,
+	comma,
+};
+
+class OperatorInfo
+{
+public:
+	const wchar_t* symbol;
+	int8_t precedence;	//higher binds tighter, -1 for none so it never continues an expression
+	Associativity associativity;
+};
+
+constexpr OperatorInfo operators[] =
+{
+	{ L"", -1, Associativity::left_associative },
+	{ L"+", 11, Associativity::left_associative },	//add, pos(13)
+	{ L"-", 11, Associativity::left_associative },	//sub, neg(13)
+	{ L"*", 12, Associativity::left_associative },	//mul
+	{ L"/", 12, Associativity::left_associative },	//div
+	{ L"%", 12, Associativity::left_associative },	//mod
+	{ L"|", 5, Associativity::left_associative },	//bitwise or
+	{ L"&", 7, Associativity::left_associative },	//bitwise and
+	{ L"^", 6, Associativity::left_associative },	//bitwise xor
+	{ L"~", 15, Associativity::right_associative },	//bitwise not
+	{ L"<<", 10, Associativity::left_associative },	//shift left
+	{ L">>", 10, Associativity::left_associative },	//logical shift right
+	{ L">>>", 10, Associativity::left_associative },	//arithmetic shift right
+	{ L"||", 2, Associativity::left_associative },	//bool or
+	{ L"&&", 4, Associativity::left_associative },	//bool and
+	{ L"^^", 3, Associativity::left_associative },	//bool xor
+	{ L"!", 15, Associativity::right_associative },	//bool not
+	{ L"<", 9, Associativity::left_associative },	//bool less than
+	{ L">", 9, Associativity::left_associative },	//bool greater than
+	{ L"<=", 9, Associativity::left_associative },	//bool less or equal
+	{ L">=", 9, Associativity::left_associative },	//bool greater or equal
+	{ L"==", 8, Associativity::left_associative },	//bool equal
+	{ L"!=", 8, Associativity::left_associative },	//bool not equal
+	{ L",", 1, Associativity::left_associative },
+};
+
+static_assert(sizeof(operators) / sizeof(operators[0]) == (size_t)OperatorKind::comma + 1, "operator table out of order");
+
+constexpr const OperatorInfo& operatorInfo(OperatorKind op)
+{
+	return operators[(size_t)op];
+}
+
+constexpr OperatorKind findOperator(wstring_view symbol)	//none for text that is not an operator, like a lone '='
+{
+	for (size_t j = 1; j < sizeof(operators) / sizeof(operators[0]); j++)
+	{
+		if (symbol == operators[j].symbol)
+		{
+			return (OperatorKind)j;
+		}
+	}
+	return OperatorKind::none;
+}
+
+enum class OperandKind : uint8_t
+{
+	none,
+	registername,	//low 3 bits of the opcode
+	nibble,	//low 4 bits
+	bit,	//low bit
+};
+
+enum OpcodeEffect : uint32_t
+{
+	readOp1 = 0x1,
+	readOp2 = 0x2,
+	writeOp1 = 0x4,
+	writeOp2 = 0x8,
+	readI = 0x10,
+	writeI = 0x20,
+	readJ = 0x40,
+	writeJ = 0x80,
+	readC = 0x100,
+	writeC = 0x200,
+	readHLVM = 0x400,
+	writeHL = 0x800,
+	writeM = 0x1000,
+	writeV = 0x2000,
+	accessesMemory = 0x4000,
+	branches = 0x8000,
+	variableTicks = 0x10000,
+};
+
+/*
+	The instruction set in one place, indexed by opcode.
+	The keyword table, the CPU's tick costs, block building, the static analyzer, the assembler's tick counter and the disassembler all read it, so adding or retiming an opcode is a one line change.
+	Only the semantics stay in BBBBBrainDumbed::operate.
+*/
+class OpcodeInfo
+{
+public:
+	const wchar_t* mnemonic;	//nullptr for reserved opcodes
+	OperandKind operand;
+	uint8_t ticks;	//wait.4 and wait.4e add their operand to this
+	uint8_t advanceI;	//how far the opcode steps I, 0 if it leaves or sets it
+	uint8_t advanceJ;
+	uint32_t effects;	//OpcodeEffect flags
+};
+
+constexpr OpcodeInfo isa[128] =
+{
+	{ L"op1", OperandKind::registername, 29, 0, 0, 0 },	//0
+	{ L"op1", OperandKind::registername, 29, 0, 0, 0 },	//1
+	{ L"op1", OperandKind::registername, 29, 0, 0, 0 },	//2
+	{ L"op1", OperandKind::registername, 29, 0, 0, 0 },	//3
+	{ L"op1", OperandKind::registername, 29, 0, 0, 0 },	//4
+	{ L"op1", OperandKind::registername, 29, 0, 0, 0 },	//5
+	{ L"op1", OperandKind::registername, 29, 0, 0, 0 },	//6
+	{ L"op1", OperandKind::registername, 29, 0, 0, 0 },	//7
+	{ L"op2", OperandKind::registername, 29, 0, 0, 0 },	//8
+	{ L"op2", OperandKind::registername, 29, 0, 0, 0 },	//9
+	{ L"op2", OperandKind::registername, 29, 0, 0, 0 },	//10
+	{ L"op2", OperandKind::registername, 29, 0, 0, 0 },	//11
+	{ L"op2", OperandKind::registername, 29, 0, 0, 0 },	//12
+	{ L"op2", OperandKind::registername, 29, 0, 0, 0 },	//13
+	{ L"op2", OperandKind::registername, 29, 0, 0, 0 },	//14
+	{ L"op2", OperandKind::registername, 29, 0, 0, 0 },	//15
+	{ L"mov.1", OperandKind::none, 29, 1, 0, readOp1 | readOp2 | writeOp1 | readI | writeI },	//16
+	{ L"not.1", OperandKind::none, 29, 1, 0, readOp1 | readOp2 | writeOp1 | readI | writeI },	//17
+	{ L"or.1", OperandKind::none, 29, 1, 0, readOp1 | readOp2 | writeOp1 | readI | writeI },	//18
+	{ L"and.1", OperandKind::none, 29, 1, 0, readOp1 | readOp2 | writeOp1 | readI | writeI },	//19
+	{ L"xor.1", OperandKind::none, 29, 1, 0, readOp1 | readOp2 | writeOp1 | readI | writeI },	//20
+	{ L"shl", OperandKind::none, 32, 0, 0, readOp1 | readOp2 | writeOp1 | readI },	//21
+	{ L"shr", OperandKind::none, 32, 0, 0, readOp1 | readOp2 | writeOp1 | readI },	//22
+	{ L"asr", OperandKind::none, 32, 0, 0, readOp1 | readOp2 | writeOp1 | readI },	//23
+	{ L"rol", OperandKind::none, 29, 0, 0, readOp1 | readOp2 | writeOp1 | readI },	//24
+	{ L"ror", OperandKind::none, 29, 0, 0, readOp1 | readOp2 | writeOp1 | readI },	//25
+	{ L"adc.1", OperandKind::none, 32, 1, 0, readOp1 | readOp2 | writeOp1 | readI | writeI | readC | writeC },	//26
+	{ L"sbb.1", OperandKind::none, 32, 1, 0, readOp1 | readOp2 | writeOp1 | readI | writeI | readC | writeC },	//27
+	{ L"inc.4", OperandKind::none, 31, 1, 0, readOp2 | writeOp1 | readI | writeI | writeC },	//28
+	{ L"inc.16", OperandKind::none, 34, 1, 0, readOp2 | writeOp1 | readI | writeI | writeC },	//29
+	{ L"dec.4", OperandKind::none, 31, 1, 0, readOp2 | writeOp1 | readI | writeI | writeC },	//30
+	{ L"dec.16", OperandKind::none, 34, 1, 0, readOp2 | writeOp1 | readI | writeI | writeC },	//31
+	{ L"mov.4", OperandKind::none, 29, 4, 0, readOp1 | readOp2 | writeOp1 | readI | writeI },	//32
+	{ L"not.4", OperandKind::none, 29, 4, 0, readOp1 | readOp2 | writeOp1 | readI | writeI },	//33
+	{ L"or.4", OperandKind::none, 29, 4, 0, readOp1 | readOp2 | writeOp1 | readI | writeI },	//34
+	{ L"and.4", OperandKind::none, 29, 4, 0, readOp1 | readOp2 | writeOp1 | readI | writeI },	//35
+	{ L"xor.4", OperandKind::none, 29, 4, 0, readOp1 | readOp2 | writeOp1 | readI | writeI },	//36
+	{ nullptr, OperandKind::none, 29, 0, 0, 0 },	//37
+	{ nullptr, OperandKind::none, 29, 0, 0, 0 },	//38
+	{ nullptr, OperandKind::none, 29, 0, 0, 0 },	//39
+	{ nullptr, OperandKind::none, 29, 0, 0, 0 },	//40
+	{ nullptr, OperandKind::none, 29, 0, 0, 0 },	//41
+	{ L"adc.4", OperandKind::none, 32, 4, 0, readOp1 | readOp2 | writeOp1 | readI | writeI | readC | writeC },	//42
+	{ L"sbb.4", OperandKind::none, 32, 4, 0, readOp1 | readOp2 | writeOp1 | readI | writeI | readC | writeC },	//43
+	{ L"mul.4", OperandKind::none, 31, 0, 0, readOp1 | readOp2 | readI | writeHL },	//44
+	{ L"muls.4", OperandKind::none, 31, 0, 0, readOp1 | readOp2 | readI | writeHL },	//45
+	{ L"div.4", OperandKind::none, 31, 0, 0, readOp1 | readOp2 | readI | writeHL },	//46
+	{ L"divs.4", OperandKind::none, 31, 0, 0, readOp1 | readOp2 | readI | writeHL },	//47
+	{ L"mov.16", OperandKind::none, 29, 0, 0, readOp2 | writeOp1 | readI },	//48
+	{ L"not.16", OperandKind::none, 29, 0, 0, readOp2 | writeOp1 | readI },	//49
+	{ L"or.16", OperandKind::none, 29, 0, 0, readOp1 | readOp2 | writeOp1 | readI },	//50
+	{ L"and.16", OperandKind::none, 29, 0, 0, readOp1 | readOp2 | writeOp1 | readI },	//51
+	{ L"xor.16", OperandKind::none, 29, 0, 0, readOp1 | readOp2 | writeOp1 | readI },	//52
+	{ L"mfh", OperandKind::none, 29, 0, 0, readHLVM | writeOp1 | readI },	//53
+	{ L"mfl", OperandKind::none, 29, 0, 0, readHLVM | writeOp1 | readI },	//54
+	{ L"clr", OperandKind::none, 29, 0, 0, writeOp1 },	//55
+	{ L"neg", OperandKind::none, 31, 0, 0, readOp2 | writeOp1 | readI },	//56
+	{ L"nop", OperandKind::none, 29, 0, 0, 0 },	//57
+	{ L"adc.16", OperandKind::none, 35, 0, 0, readOp1 | readOp2 | writeOp1 | readI | readC | writeC },	//58
+	{ L"sbb.16", OperandKind::none, 35, 0, 0, readOp1 | readOp2 | writeOp1 | readI | readC | writeC },	//59
+	{ L"mul.16", OperandKind::none, 31, 0, 0, readOp1 | readOp2 | readI | writeHL },	//60
+	{ L"muls.16", OperandKind::none, 31, 0, 0, readOp1 | readOp2 | readI | writeHL },	//61
+	{ L"div.16", OperandKind::none, 31, 0, 0, readOp1 | readOp2 | readI | writeHL },	//62
+	{ L"divs.16", OperandKind::none, 31, 0, 0, readOp1 | readOp2 | readI | writeHL },	//63
+	{ L"ldi.4", OperandKind::nibble, 31, 4, 0, readOp1 | writeOp1 | readI | writeI },	//64
+	{ L"ldi.4", OperandKind::nibble, 31, 4, 0, readOp1 | writeOp1 | readI | writeI },	//65
+	{ L"ldi.4", OperandKind::nibble, 31, 4, 0, readOp1 | writeOp1 | readI | writeI },	//66
+	{ L"ldi.4", OperandKind::nibble, 31, 4, 0, readOp1 | writeOp1 | readI | writeI },	//67
+	{ L"ldi.4", OperandKind::nibble, 31, 4, 0, readOp1 | writeOp1 | readI | writeI },	//68
+	{ L"ldi.4", OperandKind::nibble, 31, 4, 0, readOp1 | writeOp1 | readI | writeI },	//69
+	{ L"ldi.4", OperandKind::nibble, 31, 4, 0, readOp1 | writeOp1 | readI | writeI },	//70
+	{ L"ldi.4", OperandKind::nibble, 31, 4, 0, readOp1 | writeOp1 | readI | writeI },	//71
+	{ L"ldi.4", OperandKind::nibble, 31, 4, 0, readOp1 | writeOp1 | readI | writeI },	//72
+	{ L"ldi.4", OperandKind::nibble, 31, 4, 0, readOp1 | writeOp1 | readI | writeI },	//73
+	{ L"ldi.4", OperandKind::nibble, 31, 4, 0, readOp1 | writeOp1 | readI | writeI },	//74
+	{ L"ldi.4", OperandKind::nibble, 31, 4, 0, readOp1 | writeOp1 | readI | writeI },	//75
+	{ L"ldi.4", OperandKind::nibble, 31, 4, 0, readOp1 | writeOp1 | readI | writeI },	//76
+	{ L"ldi.4", OperandKind::nibble, 31, 4, 0, readOp1 | writeOp1 | readI | writeI },	//77
+	{ L"ldi.4", OperandKind::nibble, 31, 4, 0, readOp1 | writeOp1 | readI | writeI },	//78
+	{ L"ldi.4", OperandKind::nibble, 31, 4, 0, readOp1 | writeOp1 | readI | writeI },	//79
+	{ L"ldr.1", OperandKind::none, 31, 0, 1, readOp1 | readOp2 | writeOp1 | readI | readJ | writeJ | accessesMemory },	//80
+	{ L"ldri.1", OperandKind::none, 35, 0, 1, readOp1 | readOp2 | writeOp1 | writeOp2 | readI | readJ | writeJ | accessesMemory },	//81
+	{ L"ldrd.1", OperandKind::none, 35, 0, 1, readOp1 | readOp2 | writeOp1 | writeOp2 | readI | readJ | writeJ | accessesMemory },	//82
+	{ L"str.1", OperandKind::none, 31, 0, 1, readOp1 | readOp2 | readI | readJ | writeJ | accessesMemory },	//83
+	{ L"stri.1", OperandKind::none, 35, 0, 1, readOp1 | readOp2 | writeOp2 | readI | readJ | writeJ | accessesMemory },	//84
+	{ L"strd.1", OperandKind::none, 35, 0, 1, readOp1 | readOp2 | writeOp2 | readI | readJ | writeJ | accessesMemory },	//85
+	{ L"cli", OperandKind::none, 29, 0, 0, writeI },	//86
+	{ L"inci", OperandKind::none, 29, 1, 0, readI | writeI },	//87
+	{ L"add4i", OperandKind::none, 29, 4, 0, readI | writeI },	//88
+	{ L"mfi", OperandKind::none, 29, 0, 0, readI | writeOp1 },	//89
+	{ L"mti", OperandKind::none, 29, 0, 0, readOp2 | writeI },	//90
+	{ L"clj", OperandKind::none, 29, 0, 0, writeJ },	//91
+	{ L"incj", OperandKind::none, 29, 0, 1, readJ | writeJ },	//92
+	{ L"add4j", OperandKind::none, 29, 0, 4, readJ | writeJ },	//93
+	{ L"mfj", OperandKind::none, 29, 0, 0, readJ | readI | writeOp1 },	//94
+	{ L"mtj", OperandKind::none, 29, 0, 0, readOp2 | readI | writeJ },	//95
+	{ L"ldr.4", OperandKind::none, 46, 0, 4, readOp1 | readOp2 | writeOp1 | readI | readJ | writeJ | accessesMemory },	//96
+	{ L"ldri.4", OperandKind::none, 49, 0, 4, readOp1 | readOp2 | writeOp1 | writeOp2 | readI | readJ | writeJ | accessesMemory },	//97
+	{ L"ldrd.4", OperandKind::none, 50, 0, 4, readOp1 | readOp2 | writeOp1 | writeOp2 | readI | readJ | writeJ | accessesMemory },	//98
+	{ L"str.4", OperandKind::none, 46, 0, 4, readOp1 | readOp2 | readI | readJ | writeJ | accessesMemory },	//99
+	{ L"stri.4", OperandKind::none, 49, 0, 4, readOp1 | readOp2 | writeOp2 | readI | readJ | writeJ | accessesMemory },	//100
+	{ L"strd.4", OperandKind::none, 50, 0, 4, readOp1 | readOp2 | writeOp2 | readI | readJ | writeJ | accessesMemory },	//101
+	{ L"clc", OperandKind::none, 29, 0, 0, writeC },	//102
+	{ L"sec", OperandKind::none, 29, 0, 0, writeC },	//103
+	{ L"mfc", OperandKind::none, 29, 0, 0, readOp1 | readI | readC | writeOp1 },	//104
+	{ L"clm", OperandKind::none, 29, 0, 0, writeM },	//105
+	{ L"sem", OperandKind::none, 29, 0, 0, writeM },	//106
+	{ L"mfm", OperandKind::none, 29, 0, 0, readOp1 | readI | readHLVM | writeOp1 },	//107
+	{ L"mfv", OperandKind::none, 29, 0, 0, readHLVM | writeOp1 | readI },	//108
+	{ L"mtv", OperandKind::none, 29, 0, 0, readOp1 | readI | writeV },	//109
+	{ L"flp", OperandKind::none, 29, 0, 0, readOp1 | writeOp1 },	//110
+	{ L"swp", OperandKind::none, 29, 0, 0, readOp1 | readOp2 | writeOp1 | writeOp2 },	//111
+	{ L"ldr.16", OperandKind::none, 106, 0, 0, readOp2 | writeOp1 | readI | readJ | accessesMemory },	//112
+	{ L"ldri.16", OperandKind::none, 109, 0, 0, readOp2 | writeOp1 | writeOp2 | readI | readJ | accessesMemory },	//113
+	{ L"ldrd.16", OperandKind::none, 110, 0, 0, readOp2 | writeOp1 | writeOp2 | readI | readJ | accessesMemory },	//114
+	{ L"str.16", OperandKind::none, 106, 0, 0, readOp1 | readOp2 | readI | readJ | accessesMemory },	//115
+	{ L"stri.16", OperandKind::none, 109, 0, 0, readOp1 | readOp2 | writeOp2 | readI | readJ | accessesMemory },	//116
+	{ L"strd.16", OperandKind::none, 110, 0, 0, readOp1 | readOp2 | writeOp2 | readI | readJ | accessesMemory },	//117
+	{ L"bcc", OperandKind::none, 29, 0, 0, readC | readOp2 | readI | branches },	//118
+	{ L"bccr", OperandKind::none, 30, 0, 0, readC | readOp2 | readI | writeOp2 | branches },	//119
+	{ L"bz", OperandKind::none, 29, 0, 0, readOp1 | readOp2 | readI | branches },	//120
+	{ L"bzr", OperandKind::none, 30, 0, 0, readOp1 | readOp2 | readI | writeOp2 | branches },	//121
+	{ L"bn", OperandKind::none, 29, 0, 0, readOp1 | readOp2 | readI | branches },	//122
+	{ L"bnr", OperandKind::none, 30, 0, 0, readOp1 | readOp2 | readI | writeOp2 | branches },	//123
+	{ L"wait.4", OperandKind::none, 30, 0, 0, readOp1 | readI | variableTicks },	//124
+	{ L"wait.4e", OperandKind::none, 46, 0, 0, readOp1 | readI | variableTicks },	//125
+	{ L"ldi.1", OperandKind::bit, 29, 1, 0, readOp1 | writeOp1 | readI | writeI },	//126
+	{ L"ldi.1", OperandKind::bit, 29, 1, 0, readOp1 | writeOp1 | readI | writeI }	//127
+};
+
+constexpr const wchar_t* registerNames[8] = { L"a", L"b", L"d", L"e", L"f", L"g", L"k", L"p" };
+
+constexpr bool sameMnemonic(const wchar_t* lhs, const wchar_t* rhs)
+{
+	while (*lhs && *lhs == *rhs)
+	{
+		lhs++;
+		rhs++;
+	}
+	return *lhs == *rhs;
+}
+
+constexpr int16_t findOpcode(const wchar_t* mnemonic)	//first opcode of the mnemonic, -1 if there is none
+{
+	for (int16_t j = 0; j < 128; j++)
+	{
+		if (isa[j].mnemonic && sameMnemonic(isa[j].mnemonic, mnemonic))
+		{
+			return j;
+		}
+	}
+	return -1;
+}
+
+static_assert(findOpcode(L"op2") == 8 && findOpcode(L"ldi.4") == 64 && findOpcode(L"nop") == 57 && findOpcode(L"ldi.1") == 126, "opcode table out of order");
+
+wstring disassemble(uint8_t opcode)
+{
+	const OpcodeInfo& info = isa[opcode & 0x7f];
+	if (!info.mnemonic)
+	{
+		return L"reserved " + to_wstring(opcode & 0x7f);
+	}
+	switch (info.operand)
+	{
+	case OperandKind::registername:
+		return wstring(info.mnemonic) + L" " + registerNames[opcode & 0x7];
+	case OperandKind::nibble:
+		return wstring(info.mnemonic) + L" " + to_wstring(opcode & 0xf);
+	case OperandKind::bit:
+		return wstring(info.mnemonic) + L" " + to_wstring(opcode & 0x1);
+	default:
+		return info.mnemonic;
+	}
+}
+
 class Instruction
 {
 public:
@@ -87,202 +413,280 @@ Instruction::~Instruction()
 {
 }
 
+constexpr uint32_t hashName(wstring_view name)	//FNV-1a over the characters
+{
+	uint32_t hash = 0x811c9dc5;
+	for (wchar_t c : name)
+	{
+		hash = (hash ^ (uint32_t)c) * 0x01000193;
+	}
+	return hash;
+}
+
+/*
+	Mnemonics, register names, directives and the parser's generated markers never change, so they are placed with a two level perfect hash when the table is built.
+	The low bits of the name's hash pick a bucket, and the bucket's seed scatters its names to slots no other name uses; a lookup is one hash, one slot and one compare.
+*/
+class KeywordTable
+{
+public:
+	KeywordTable();
+	~KeywordTable();
+	const Instruction* find(wstring_view name) const;
+private:
+	static constexpr size_t bucketCount = 64;
+	static constexpr size_t slotCount = 256;
+	vector<pair<wstring, Instruction>> keywords;
+	uint32_t seeds[bucketCount] = {};
+	uint8_t slots[slotCount];	//index into keywords, 0xff when empty
+	static size_t slot(uint32_t hash, uint32_t seed);
+	void add(wstring name, Instruction value);
+};
+
+/*
+	Labels, defines, macros and identifiers used before they are defined.
+	Symbols are kept in order of first appearance, so a slot number stays valid for the life of the table and compiled expressions can refer to it.
+	Names are found through open addressing with linear probing over a power of two index that is kept at most half full; nothing is ever removed, so there are no tombstones.
+*/
+class SymbolTable
+{
+public:
+	SymbolTable();
+	~SymbolTable();
+	Instruction* find(wstring_view name);
+	const Instruction* find(wstring_view name) const;
+	const Instruction* find(wstring_view name, size_t scope) const;	//only among the first scope symbols, what was visible when size() was scope
+	size_t slot(wstring_view name);	//adds name as an unknownnumber if it is new
+	Instruction& at(size_t slot);
+	wstring_view name(size_t slot) const;
+	void assign(wstring_view name, Instruction value);	//inserts or overwrites
+	size_t size() const;
+private:
+	vector<pair<wstring, Instruction>> symbols;
+	vector<uint32_t> hashes;	//of symbols, so probing and growing compare names only on a hash match
+	vector<uint32_t> index;	//slot + 1, 0 when empty
+	size_t probe(wstring_view name, uint32_t hash) const;	//the index entry holding name, or the empty one it belongs in
+};
+
 class Instructions
 {
 public:
-	map<wstring, Instruction> inst;
+	SymbolTable symbols;
 	Instructions();
 	~Instructions();
+	const Instruction* find(wstring_view name) const;	//keywords first, symbols can never shadow them
+	const Instruction* find(wstring_view name, size_t scope) const;
+	static const KeywordTable& keywords();
 
 private:
 
 };
 
+KeywordTable::KeywordTable()
+{
+	for (size_t j = 0; j < 128; j++)
+	{
+		if (!isa[j].mnemonic || findOpcode(isa[j].mnemonic) != (int16_t)j)
+		{
+			continue;
+		}
+		InstructionType itype = isa[j].operand == OperandKind::none ? InstructionType::mnemonic : isa[j].operand == OperandKind::registername ? InstructionType::mnemonic_expect_registername : InstructionType::mnemonic_expect_number;
+		add(isa[j].mnemonic, Instruction((uint8_t)j, itype));
+	}
+	for (size_t j = 0; j < 8; j++)
+	{
+		add(registerNames[j], Instruction((uint8_t)j, InstructionType::registername));
+	}
+
+	add(L"binclude", Instruction(InstructionType::directive, (int64_t)Directive::binclude));
+	add(L"define", Instruction(InstructionType::directive, (int64_t)Directive::define));
+	add(L"ed", Instruction(InstructionType::directive, (int64_t)Directive::ed));
+	add(L"enddata", Instruction(InstructionType::directive, (int64_t)Directive::enddata));
+	add(L"endmacro", Instruction(InstructionType::directive, (int64_t)Directive::endmacro));
+	add(L"equ", Instruction(InstructionType::directive, (int64_t)Directive::equ));
+	add(L"ldi.16", Instruction(InstructionType::directive, (int64_t)Directive::ldi16));
+	add(L"assert_ticks", Instruction(InstructionType::directive, (int64_t)Directive::assertTicks));
+	add(L"include", Instruction(InstructionType::directive, (int64_t)Directive::include));
+	add(L"macro", Instruction(InstructionType::directive, (int64_t)Directive::macro));
+	add(L"repeat", Instruction(InstructionType::directive, (int64_t)Directive::repeat));
+	add(L"endrepeat", Instruction(InstructionType::directive, (int64_t)Directive::endrepeat));
+	add(L"nopt", Instruction(InstructionType::directive, (int64_t)Directive::nopt));
+	add(L"endnopt", Instruction(InstructionType::directive, (int64_t)Directive::endnopt));
+
+	add(L" endoffile", Instruction(InstructionType::endoffile));
+	add(L" endmacro", Instruction(InstructionType::endofmacro));
+
+	vector<vector<uint8_t>> buckets(bucketCount);
+	for (size_t j = 0; j < keywords.size(); j++)
+	{
+		buckets[hashName(keywords[j].first) % bucketCount].push_back((uint8_t)j);
+	}
+	vector<size_t> order(bucketCount);
+	for (size_t j = 0; j < bucketCount; j++)
+	{
+		order[j] = j;
+	}
+	stable_sort(order.begin(), order.end(), [&](size_t lhs, size_t rhs) {return buckets[lhs].size() > buckets[rhs].size(); });	//crowded buckets first, while most slots are free
+	fill(slots, slots + slotCount, 0xff);
+	for (size_t b : order)
+	{
+		for (uint32_t seed = 0;; seed++)
+		{
+			bool fits = true;
+			for (size_t k = 0; k < buckets[b].size() && fits; k++)
+			{
+				size_t s = slot(hashName(keywords[buckets[b][k]].first), seed);
+				fits = slots[s] == 0xff;
+				if (fits)
+				{
+					slots[s] = buckets[b][k];
+				}
+			}
+			if (fits)
+			{
+				seeds[b] = seed;
+				break;
+			}
+			for (size_t k = 0; k < buckets[b].size(); k++)	//undo the partial placement
+			{
+				size_t s = slot(hashName(keywords[buckets[b][k]].first), seed);
+				if (slots[s] == buckets[b][k])
+				{
+					slots[s] = 0xff;
+				}
+			}
+		}
+	}
+}
+
+KeywordTable::~KeywordTable()
+{
+}
+
+size_t KeywordTable::slot(uint32_t hash, uint32_t seed)
+{
+	return ((hash ^ seed) * 0x9e3779b1u) >> 24;	//the top 8 bits, slotCount is 256
+}
+
+void KeywordTable::add(wstring name, Instruction value)
+{
+	keywords.push_back(make_pair(move(name), value));
+}
+
+const Instruction* KeywordTable::find(wstring_view name) const
+{
+	uint32_t hash = hashName(name);
+	uint8_t j = slots[slot(hash, seeds[hash % bucketCount])];
+	return j != 0xff && keywords[j].first == name ? &keywords[j].second : nullptr;
+}
+
+SymbolTable::SymbolTable()
+{
+}
+
+SymbolTable::~SymbolTable()
+{
+}
+
+size_t SymbolTable::probe(wstring_view name, uint32_t hash) const
+{
+	size_t mask = index.size() - 1;
+	size_t j = hash & mask;
+	while (index[j] && (hashes[index[j] - 1] != hash || symbols[index[j] - 1].first != name))
+	{
+		j = (j + 1) & mask;
+	}
+	return j;
+}
+
+Instruction* SymbolTable::find(wstring_view name)
+{
+	if (index.empty())
+	{
+		return nullptr;
+	}
+	uint32_t j = index[probe(name, hashName(name))];
+	return j ? &symbols[j - 1].second : nullptr;
+}
+
+const Instruction* SymbolTable::find(wstring_view name) const
+{
+	return const_cast<SymbolTable*>(this)->find(name);
+}
+
+const Instruction* SymbolTable::find(wstring_view name, size_t scope) const
+{
+	if (index.empty())
+	{
+		return nullptr;
+	}
+	uint32_t j = index[probe(name, hashName(name))];
+	return j && j <= scope ? &symbols[j - 1].second : nullptr;
+}
+
+size_t SymbolTable::slot(wstring_view name)
+{
+	if ((symbols.size() + 1) * 2 > index.size())
+	{
+		index.assign(max((size_t)64, index.size() * 2), 0);
+		for (size_t j = 0; j < symbols.size(); j++)
+		{
+			index[probe(symbols[j].first, hashes[j])] = (uint32_t)j + 1;
+		}
+	}
+	uint32_t hash = hashName(name);
+	size_t j = probe(name, hash);
+	if (!index[j])
+	{
+		symbols.push_back(make_pair(wstring(name), Instruction(InstructionType::unknownnumber)));
+		hashes.push_back(hash);
+		index[j] = (uint32_t)symbols.size();
+	}
+	return index[j] - 1;
+}
+
+Instruction& SymbolTable::at(size_t slot)
+{
+	return symbols[slot].second;
+}
+
+void SymbolTable::assign(wstring_view name, Instruction value)
+{
+	at(slot(name)) = value;
+}
+
+wstring_view SymbolTable::name(size_t slot) const
+{
+	return symbols[slot].first;
+}
+
+size_t SymbolTable::size() const
+{
+	return symbols.size();
+}
+
 Instructions::Instructions()
 {
-	inst.insert(make_pair(L"op1 A", Instruction(0)));
-	inst.insert(make_pair(L"op1 B", Instruction(1)));
-	inst.insert(make_pair(L"op1 D", Instruction(2)));
-	inst.insert(make_pair(L"op1 E", Instruction(3)));
-	inst.insert(make_pair(L"op1 F", Instruction(4)));
-	inst.insert(make_pair(L"op1 G", Instruction(5)));
-	inst.insert(make_pair(L"op1 K", Instruction(6)));
-	inst.insert(make_pair(L"op1 P", Instruction(7)));
-	inst.insert(make_pair(L"op2 A", Instruction(8)));
-	inst.insert(make_pair(L"op2 B", Instruction(9)));
-	inst.insert(make_pair(L"op2 D", Instruction(10)));
-	inst.insert(make_pair(L"op2 E", Instruction(11)));
-	inst.insert(make_pair(L"op2 F", Instruction(12)));
-	inst.insert(make_pair(L"op2 G", Instruction(13)));
-	inst.insert(make_pair(L"op2 K", Instruction(14)));
-	inst.insert(make_pair(L"op2 P", Instruction(15)));
-	inst.insert(make_pair(L"mov.1", Instruction(16)));
-	inst.insert(make_pair(L"not.1", Instruction(17)));
-	inst.insert(make_pair(L"or.1", Instruction(18)));
-	inst.insert(make_pair(L"and.1", Instruction(19)));
-	inst.insert(make_pair(L"xor.1", Instruction(20)));
-	inst.insert(make_pair(L"shl", Instruction(21)));
-	inst.insert(make_pair(L"shr", Instruction(22)));
-	inst.insert(make_pair(L"asr", Instruction(23)));
-	inst.insert(make_pair(L"rol", Instruction(24)));
-	inst.insert(make_pair(L"ror", Instruction(25)));
-	inst.insert(make_pair(L"adc.1", Instruction(26)));
-	inst.insert(make_pair(L"sbb.1", Instruction(27)));
-	inst.insert(make_pair(L"inc.4", Instruction(28)));
-	inst.insert(make_pair(L"inc.16", Instruction(29)));
-	inst.insert(make_pair(L"dec.4", Instruction(30)));
-	inst.insert(make_pair(L"dec.16", Instruction(31)));
-	inst.insert(make_pair(L"mov.4", Instruction(32)));
-	inst.insert(make_pair(L"not.4", Instruction(33)));
-	inst.insert(make_pair(L"or.4", Instruction(34)));
-	inst.insert(make_pair(L"and.4", Instruction(35)));
-	inst.insert(make_pair(L"xor.4", Instruction(36)));
-	//inst.insert(make_pair(L"", Instruction(37)));
-	//inst.insert(make_pair(L"", Instruction(38)));
-	//inst.insert(make_pair(L"", Instruction(39)));
-	//inst.insert(make_pair(L"", Instruction(40)));
-	//inst.insert(make_pair(L"", Instruction(41)));
-	inst.insert(make_pair(L"adc.4", Instruction(42)));
-	inst.insert(make_pair(L"sbb.4", Instruction(43)));
-	inst.insert(make_pair(L"mul.4", Instruction(44)));
-	inst.insert(make_pair(L"muls.4", Instruction(45)));
-	inst.insert(make_pair(L"div.4", Instruction(46)));
-	inst.insert(make_pair(L"divs.4", Instruction(47)));
-	inst.insert(make_pair(L"mov.16", Instruction(48)));
-	inst.insert(make_pair(L"not.16", Instruction(49)));
-	inst.insert(make_pair(L"or.16", Instruction(50)));
-	inst.insert(make_pair(L"and.16", Instruction(51)));
-	inst.insert(make_pair(L"xor.16", Instruction(52)));
-	inst.insert(make_pair(L"mfh", Instruction(53)));
-	inst.insert(make_pair(L"mfl", Instruction(54)));
-	inst.insert(make_pair(L"clr", Instruction(55)));
-	inst.insert(make_pair(L"neg", Instruction(56)));
-	inst.insert(make_pair(L"nop", Instruction(57)));
-	inst.insert(make_pair(L"adc.16", Instruction(58)));
-	inst.insert(make_pair(L"sbb.16", Instruction(59)));
-	inst.insert(make_pair(L"mul.16", Instruction(60)));
-	inst.insert(make_pair(L"muls.16", Instruction(61)));
-	inst.insert(make_pair(L"div.16", Instruction(62)));
-	inst.insert(make_pair(L"divs.16", Instruction(63)));
-	inst.insert(make_pair(L"ldi.4 0", Instruction(64)));
-	inst.insert(make_pair(L"ldi.4 1", Instruction(65)));
-	inst.insert(make_pair(L"ldi.4 2", Instruction(66)));
-	inst.insert(make_pair(L"ldi.4 3", Instruction(67)));
-	inst.insert(make_pair(L"ldi.4 4", Instruction(68)));
-	inst.insert(make_pair(L"ldi.4 5", Instruction(69)));
-	inst.insert(make_pair(L"ldi.4 6", Instruction(70)));
-	inst.insert(make_pair(L"ldi.4 7", Instruction(71)));
-	inst.insert(make_pair(L"ldi.4 8", Instruction(72)));
-	inst.insert(make_pair(L"ldi.4 9", Instruction(73)));
-	inst.insert(make_pair(L"ldi.4 10", Instruction(74)));
-	inst.insert(make_pair(L"ldi.4 11", Instruction(75)));
-	inst.insert(make_pair(L"ldi.4 12", Instruction(76)));
-	inst.insert(make_pair(L"ldi.4 13", Instruction(77)));
-	inst.insert(make_pair(L"ldi.4 14", Instruction(78)));
-	inst.insert(make_pair(L"ldi.4 15", Instruction(79)));
-	inst.insert(make_pair(L"ldr.1", Instruction(80)));
-	inst.insert(make_pair(L"ldri.1", Instruction(81)));
-	inst.insert(make_pair(L"ldrd.1", Instruction(82)));
-	inst.insert(make_pair(L"str.1", Instruction(83)));
-	inst.insert(make_pair(L"stri.1", Instruction(84)));
-	inst.insert(make_pair(L"strd.1", Instruction(85)));
-	inst.insert(make_pair(L"cli", Instruction(86)));
-	inst.insert(make_pair(L"inci", Instruction(87)));
-	inst.insert(make_pair(L"add4i", Instruction(88)));
-	inst.insert(make_pair(L"mfi", Instruction(89)));
-	inst.insert(make_pair(L"mti", Instruction(90)));
-	inst.insert(make_pair(L"clj", Instruction(91)));
-	inst.insert(make_pair(L"incj", Instruction(92)));
-	inst.insert(make_pair(L"add4j", Instruction(93)));
-	inst.insert(make_pair(L"mfj", Instruction(94)));
-	inst.insert(make_pair(L"mtj", Instruction(95)));
-	inst.insert(make_pair(L"ldr.4", Instruction(96)));
-	inst.insert(make_pair(L"ldri.4", Instruction(97)));
-	inst.insert(make_pair(L"ldrd.4", Instruction(98)));
-	inst.insert(make_pair(L"str.4", Instruction(99)));
-	inst.insert(make_pair(L"stri.4", Instruction(100)));
-	inst.insert(make_pair(L"strd.4", Instruction(101)));
-	inst.insert(make_pair(L"clc", Instruction(102)));
-	inst.insert(make_pair(L"sec", Instruction(103)));
-	inst.insert(make_pair(L"mfc", Instruction(104)));
-	inst.insert(make_pair(L"clm", Instruction(105)));
-	inst.insert(make_pair(L"sem", Instruction(106)));
-	inst.insert(make_pair(L"mfm", Instruction(107)));
-	inst.insert(make_pair(L"mfv", Instruction(108)));
-	inst.insert(make_pair(L"mtv", Instruction(109)));
-	inst.insert(make_pair(L"flp", Instruction(110)));
-	inst.insert(make_pair(L"swp", Instruction(111)));
-	inst.insert(make_pair(L"ldr.16", Instruction(112)));
-	inst.insert(make_pair(L"ldri.16", Instruction(113)));
-	inst.insert(make_pair(L"ldrd.16", Instruction(114)));
-	inst.insert(make_pair(L"str.16", Instruction(115)));
-	inst.insert(make_pair(L"stri.16", Instruction(116)));
-	inst.insert(make_pair(L"strd.16", Instruction(117)));
-	inst.insert(make_pair(L"bcc", Instruction(118)));
-	inst.insert(make_pair(L"bccr", Instruction(119)));
-	inst.insert(make_pair(L"bz", Instruction(120)));
-	inst.insert(make_pair(L"bzr", Instruction(121)));
-	inst.insert(make_pair(L"bn", Instruction(122)));
-	inst.insert(make_pair(L"bnr", Instruction(123)));
-	inst.insert(make_pair(L"wait.4", Instruction(124)));
-	inst.insert(make_pair(L"wait.4e", Instruction(125)));
-	inst.insert(make_pair(L"ldi.1 0", Instruction(126)));
-	inst.insert(make_pair(L"ldi.1 1", Instruction(127)));
-	
-	inst.insert(make_pair(L"op1", Instruction(0, InstructionType::mnemonic_expect_registername)));
-	inst.insert(make_pair(L"op2", Instruction(8, InstructionType::mnemonic_expect_registername)));
-
-	inst.insert(make_pair(L"ldi.4", Instruction(64, InstructionType::mnemonic_expect_number)));
-	inst.insert(make_pair(L"ldi.1", Instruction(126, InstructionType::mnemonic_expect_number)));
-
-	inst.insert(make_pair(L"a", Instruction(0, InstructionType::registername)));
-	inst.insert(make_pair(L"b", Instruction(1, InstructionType::registername)));
-	inst.insert(make_pair(L"d", Instruction(2, InstructionType::registername)));
-	inst.insert(make_pair(L"e", Instruction(3, InstructionType::registername)));
-	inst.insert(make_pair(L"f", Instruction(4, InstructionType::registername)));
-	inst.insert(make_pair(L"g", Instruction(5, InstructionType::registername)));
-	inst.insert(make_pair(L"k", Instruction(6, InstructionType::registername)));
-	inst.insert(make_pair(L"p", Instruction(7, InstructionType::registername)));
-
-	inst.insert(make_pair(L"binclude", Instruction(InstructionType::directive)));
-	inst.insert(make_pair(L"define", Instruction(InstructionType::directive)));
-	inst.insert(make_pair(L"ed", Instruction(InstructionType::directive)));
-	inst.insert(make_pair(L"enddata", Instruction(InstructionType::directive)));
-	inst.insert(make_pair(L"endmacro", Instruction(InstructionType::directive)));
-	inst.insert(make_pair(L"equ", Instruction(InstructionType::directive)));
-	inst.insert(make_pair(L"ldi.16", Instruction(InstructionType::directive)));
-	inst.insert(make_pair(L"include", Instruction(InstructionType::directive)));
-	inst.insert(make_pair(L"macro", Instruction(InstructionType::directive)));
-	inst.insert(make_pair(L"repeat", Instruction(InstructionType::directive)));
-
-	inst.insert(make_pair(L"+", Instruction(InstructionType::$operator, 11)));	//add, pos(13)
-	inst.insert(make_pair(L"-", Instruction(InstructionType::$operator, 11)));	//sub, neg(13)
-	inst.insert(make_pair(L"*", Instruction(InstructionType::$operator, 12)));	//mul
-	inst.insert(make_pair(L"/", Instruction(InstructionType::$operator, 12)));	//div
-	inst.insert(make_pair(L"%", Instruction(InstructionType::$operator, 12)));	//mod
-	//inst.insert(make_pair(L"**", Instruction(InstructionType::$operator, 14, associativity::right_associative)));	//pow
-	inst.insert(make_pair(L"|", Instruction(InstructionType::$operator, 5)));	//bitwise or
-	inst.insert(make_pair(L"&", Instruction(InstructionType::$operator, 7)));	//bitwise and
-	inst.insert(make_pair(L"^", Instruction(InstructionType::$operator, 6)));	//bitwise xor
-	inst.insert(make_pair(L"~", Instruction(InstructionType::$operator, 15, Associativity::right_associative)));	//bitwise not
-	inst.insert(make_pair(L"<<", Instruction(InstructionType::$operator, 10)));	//shift left
-	inst.insert(make_pair(L">>", Instruction(InstructionType::$operator, 10)));	//logical shift right
-	inst.insert(make_pair(L">>>", Instruction(InstructionType::$operator, 10)));	//arithmetic shift right
-	inst.insert(make_pair(L"||", Instruction(InstructionType::$operator, 2)));	//bool or
-	inst.insert(make_pair(L"&&", Instruction(InstructionType::$operator, 4)));	//bool and
-	inst.insert(make_pair(L"^^", Instruction(InstructionType::$operator, 3)));	//bool xor
-	inst.insert(make_pair(L"!", Instruction(InstructionType::$operator, 15, Associativity::right_associative)));	//bool not
-	inst.insert(make_pair(L"<", Instruction(InstructionType::$operator, 9)));	//bool less than
-	inst.insert(make_pair(L">", Instruction(InstructionType::$operator, 9)));	//bool greater than
-	inst.insert(make_pair(L"<=", Instruction(InstructionType::$operator, 9)));	//bool less or equal
-	inst.insert(make_pair(L">=", Instruction(InstructionType::$operator, 9)));	//bool greater or equal
-	inst.insert(make_pair(L"==", Instruction(InstructionType::$operator, 8)));	//bool equal
-	inst.insert(make_pair(L"!=", Instruction(InstructionType::$operator, 8)));	//bool not equal
-	inst.insert(make_pair(L",", Instruction(InstructionType::$operator, 1)));	//bool not equal
-
-	inst.insert(make_pair(L" endoffile", Instruction(InstructionType::endoffile)));
 }
 
 Instructions::~Instructions()
 {
+}
+
+const KeywordTable& Instructions::keywords()
+{
+	static const KeywordTable table;
+	return table;
+}
+
+const Instruction* Instructions::find(wstring_view name) const
+{
+	const Instruction* keyword = keywords().find(name);
+	return keyword ? keyword : symbols.find(name);
+}
+
+const Instruction* Instructions::find(wstring_view name, size_t scope) const
+{
+	const Instruction* keyword = keywords().find(name);
+	return keyword ? keyword : symbols.find(name, scope);
 }
\ No newline at end of file
@@ -3,17 +3,9 @@ macro VCPYNTSCSPR2
 cli clj op1 A ldi.16 sprdata
 op1 B ldi.16 0xE040
 op1 D op2 A ldri.16 op2 B stri.16
+repeat 11
 op2 A ldri.16 op2 B stri.16
-op2 A ldri.16 op2 B stri.16
-op2 A ldri.16 op2 B stri.16
-op2 A ldri.16 op2 B stri.16
-op2 A ldri.16 op2 B stri.16
-op2 A ldri.16 op2 B stri.16
-op2 A ldri.16 op2 B stri.16
-op2 A ldri.16 op2 B stri.16
-op2 A ldri.16 op2 B stri.16
-op2 A ldri.16 op2 B stri.16
-op2 A ldri.16 op2 B stri.16
+endrepeat
 endmacro
 macro VCPYNTSCALL2
 cli clj op1 E clr
@@ -5,13 +5,90 @@
 #include <Windows.h>
 
 #include "Parser.h"
+#include "HotReload.h"
+#include "Linker.h"
+#include "Analyzer.h"
+#include "AssemblerBenchmark.h"
 #include "BBBBBrainDumbed.h"
+#include "Metrics.h"
+#include "Profiler.h"
+#include "Trace.h"
 
 using namespace std;
 
 int wmain(int argc, wchar_t* argv[], wchar_t* envp[]) {
 	wstring exepath, filepath;
 	basic_ifstream<wchar_t> ifs;
+	bool profile = false, metrics = false, metricsJson = false, fusionStats = false, blocks = false, analyze = false, watch = false, peephole = false, relax = false;
+	wstring tracepath, listingpath;
+	vector<wstring> modules;	//linked after the main file, each assembled on its own
+	for (int i = 2; i < argc; i++)
+	{
+		if (wstring(argv[i]) == L"--profile")
+		{
+			profile = true;
+		}
+		else if (wstring(argv[i]) == L"--metrics")
+		{
+			metrics = true;
+		}
+		else if (wstring(argv[i]) == L"--metrics-json")
+		{
+			metrics = true;
+			metricsJson = true;
+		}
+		else if (wstring(argv[i]) == L"--fusion-stats")
+		{
+			fusionStats = true;
+		}
+		else if (wstring(argv[i]) == L"--blocks")
+		{
+			blocks = true;
+		}
+		else if (wstring(argv[i]) == L"--analyze")
+		{
+			analyze = true;
+		}
+		else if (wstring(argv[i]) == L"--watch")	//run until killed, reassembling and patching the ROM when a source file changes
+		{
+			watch = true;
+		}
+		else if (wstring(argv[i]) == L"--peephole")	//drop redundant op1, op2, cli and clj outside nopt regions
+		{
+			peephole = true;
+		}
+		else if (wstring(argv[i]) == L"--relax")	//emit each ldi.16 as the shortest sequence for its value, reassembling until labels settle
+		{
+			relax = true;
+		}
+		else if (wstring(argv[i]) == L"--trace" && i + 1 < argc)
+		{
+			tracepath = argv[++i];
+		}
+		else if (wstring(argv[i]) == L"--listing" && i + 1 < argc)
+		{
+			listingpath = argv[++i];
+		}
+		else if (wstring(argv[i]) == L"--module" && i + 1 < argc)
+		{
+			modules.push_back(argv[++i]);
+		}
+	}
+	if (argc >= 2 && wstring(argv[1]) == L"--bench-assembler")	//--bench-assembler [scale]: time the assembler on generated sources and exit
+	{
+		AssemblerBenchmark benchmark((filesystem::temp_directory_path() / L"bbbbbraindumbedbench").wstring(), argc >= 3 ? wcstoul(argv[2], nullptr, 10) : 1);	//lowercase, the tokenizer folds the include paths the scenarios write
+		try
+		{
+			AssemblerBenchmark::report(benchmark.run(), wcout);
+		}
+		catch (const exception& e)
+		{
+			wcout << L"benchmark failed\n" << e.what() << endl;
+			return 4;
+		}
+		return 0;
+	}
+	Trace* trace = tracepath.empty() ? nullptr : new Trace();
 	if (argc >= 2)
 	{
 		ifs.open(argv[1]);
@@ -26,15 +103,54 @@ int wmain(int argc, wchar_t* argv[], wchar_t* envp[]) {
 	{
 		return 1;
 	}
-	istreambuf_iterator<wchar_t> ifsbegin(ifs), ifsend;
-	wstring finput(ifsbegin, ifsend);
 	ifs.close();
-	list<Token>* tokens = Tokenizer::tokenize(finput, filepath);
-	vector<bool> ROM;
-	Parser parser(tokens, filepath);
+	BitBuffer ROM;
+	HotReload assembly(filepath);
+	assembly.trace = trace;
+	assembly.peephole = peephole;
+	assembly.relax = relax;
+	if (!modules.empty() && watch)
+	{
+		wcout << L"--watch is not supported with --module, ignored" << endl;
+		watch = false;
+	}
+	if (!modules.empty() && peephole)
+	{
+		wcout << L"--peephole is not supported with --module, ignored" << endl;
+	}
+	if (!modules.empty() && relax)
+	{
+		wcout << L"--relax is not supported with --module, ignored" << endl;
+	}
+	if (!modules.empty() && !listingpath.empty())
+	{
+		wcout << L"--listing is not supported with --module, ignored" << endl;
+	}
 	try
 	{
-		ROM = parser.parse();
+		if (modules.empty())
+		{
+			ROM = assembly.assemble();
+		}
+		else
+		{
+			modules.insert(modules.begin(), filepath);
+			Linker linker;
+			for (auto& i : Linker::build(modules, true))
+			{
+				linker.add(move(i));
+			}
+			ROM = linker.link();
+			if (ROM.size() > 0x8000)
+			{
+				throw out_of_range("Input is too large.");
+			}
+		}
+	}
+	catch (const LinkerError& e)
+	{
+		wcout << L"Linker error in " << e.module << (e.symbol.empty() ? L"" : L" symbol:" + e.symbol) << endl << e.what() << endl;
+		return 5;
 	}
 	catch (const ParserError& e)
 	{
@@ -46,18 +162,129 @@ int wmain(int argc, wchar_t* argv[], wchar_t* envp[]) {
 		wcout << L"Parser error\n" << e.what() << endl;
 		return 4;
 	}
+	if (peephole && assembly.parser)
+	{
+		wcout << L"peephole: removed " << assembly.parser->peepholeRemoved << L" instructions, " << assembly.parser->peepholeTicks << L" ticks per pass over them" << endl;
+	}
+	if (relax && assembly.parser)
+	{
+		wcout << L"relax: shortened " << assembly.parser->relaxedLoads << L" loads by " << assembly.parser->relaxedBits << L" bits, " << assembly.parser->relaxedTicks << L" ticks per pass over them, in " << assembly.parser->relaxation.passes << L" passes" << (assembly.parser->relax ? L"" : L", gave up") << endl;
+	}
+	if (!listingpath.empty() && assembly.parser)	//a linked ROM has no single parser to list
+	{
+		basic_ofstream<wchar_t> ofs;
+		ofs.open(listingpath);
+		if (ofs.fail())
+		{
+			wcout << L"failed to write listing " << listingpath << endl;
+		}
+		else
+		{
+			assembly.parser->listing(ROM, ofs);
+			ofs.close();
+		}
+	}
 	BBBBBrainDumbed b;
-	b.memory.bakeRom(ROM);
+	b.memory.bakeRom(move(ROM));
+	b.fusionStatistics = fusionStats;
+	b.blockChaining = blocks;
+	if (analyze)
+	{
+		Analyzer analyzer(b.memory);
+		analyzer.analyze();
+		analyzer.report(wcout);
+	}
+	Profiler* profiler = profile ? new Profiler() : nullptr;
+	Metrics* registry = metrics ? new Metrics() : nullptr;
 	LARGE_INTEGER qpc0, qpc1, qpf;
 	QueryPerformanceFrequency(&qpf);
 	QueryPerformanceCounter(&qpc0);
-	for (size_t i = 0; i < 6000; i++)
+	size_t ticks = 0;
+	chrono::steady_clock::time_point lastPoll = chrono::steady_clock::now();
+	for (size_t i = 0; i < 6000 || watch; i++)
 	{
+		if (watch && chrono::steady_clock::now() - lastPoll >= chrono::milliseconds(100))
+		{
+			lastPoll = chrono::steady_clock::now();
+			Reassembly result = assembly.reassemble(b.memory);
+			if (result.changed)
+			{
+				if (result.assembled && !result.patched)
+				{
+					b.reset();
+					b.memory.bakeRom(move(result.image));
+				}
+				wcout << HotReload::describe(result) << endl;
+			}
+		}
+		double frameStart = trace ? trace->now() : 0;
+		auto hostStart = registry ? chrono::steady_clock::now() : chrono::steady_clock::time_point();
+		size_t instructionStart = b.instructionCount, irqStart = b.irqCount;
 		b.P = 0;
-		b.execute(6105, false);
+		if (profiler)
+		{
+			profiler->begin();
+		}
+		size_t overshoot = b.execute(6105, false);
+		if (profiler)
+		{
+			profiler->end((uint32_t)i, 0, 6105 + overshoot);
+		}
+		if (registry)
+		{
+			registry->recordFrame(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - hostStart).count(), 6105 + overshoot, overshoot, b.instructionCount - instructionStart, b.irqCount - irqStart);
+			registry->dumpIfDue(wcout, metricsJson);
+		}
+		if (trace)
+		{
+			ticks += 6105 + overshoot;
+			trace->complete(L"execute", L"cpu", frameStart);
+			trace->counter(L"guest ticks", (double)ticks);
+		}
 	}
 	QueryPerformanceCounter(&qpc1);
 	wcout << L"P=" << b.P << endl;
 	wcout << (double)(qpc1.QuadPart - qpc0.QuadPart) / qpf.QuadPart << endl;
+	if (profiler)
+	{
+		profiler->report(wcout);
+		delete profiler;
+	}
+	if (registry)
+	{
+		MetricsSnapshot snapshot = registry->snapshot();
+		if (metricsJson)
+		{
+			snapshot.writeJson(wcout);
+		}
+		else
+		{
+			snapshot.write(wcout);
+		}
+		delete registry;
+	}
+	if (fusionStats)
+	{
+		wcout << L"fusion candidates (count, dispatches saved):" << endl;
+		for (auto& j : b.fusionCandidates(20))
+		{
+			size_t length = j.first >> 28;
+			for (size_t k = 0; k < length; k++)
+			{
+				uint8_t opcode = (j.first >> (7 * (length - 1 - k))) & 0x7f;
+				wcout << (k ? L"; " : L"") << disassemble(opcode);
+			}
+			wcout << L"\t" << j.second << L"\t" << j.second * (length - 1) << endl;
+		}
+	}
+	if (trace)
+	{
+		trace->counter(L"host seconds", (double)(qpc1.QuadPart - qpc0.QuadPart) / qpf.QuadPart);
+		if (!trace->save(tracepath))
+		{
+			wcout << L"failed to write trace " << tracepath << endl;
+		}
+		delete trace;
+	}
 	return 0;
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include <gl/GL.h>
 
 #include <iostream>
+#include <sstream>
 
 using namespace std;
 
@@ -13,6 +14,11 @@ using namespace std;
 
 #include "../BBBBBrainDumbed/BBBBBrainDumbed.h"
 #include "../BBBBBrainDumbed/Parser.h"
+#include "../BBBBBrainDumbed/HotReload.h"
+#include "../BBBBBrainDumbed/Metrics.h"
+#include "../BBBBBrainDumbed/Pacer.h"
+#include "../BBBBBrainDumbed/Profiler.h"
+#include "../BBBBBrainDumbed/Trace.h"
 
 void (APIENTRY* glGenBuffers)(GLsizei n, GLuint* buffers);
 void (APIENTRY* glBindBuffer)(GLenum target, GLuint buffer);
@@ -22,6 +28,12 @@ void (APIENTRY* glVertexAttribPointer)(GLuint index, GLint size, GLenum type, GL
 void (APIENTRY* glDisableVertexAttribArray)(GLuint index);
 
 static BBBBBrainDumbed* bbbbbraindumbed = NULL;
+static HotReload* assembly = NULL;	//watches the open assembly's files
+static Profiler* profiler = NULL;
+static Trace* trace = NULL;
+static Metrics metrics;
+static Pacer pacer;
+static size_t frame = 0;
 
 static const GLfloat vertData[] = {
     0.0,0.0,
@@ -85,6 +97,12 @@ int OpenAssembly(LPWSTR file)
     if (bbbbbraindumbed)
     {
         delete bbbbbraindumbed;
+        bbbbbraindumbed = NULL;
+    }
+    if (assembly)
+    {
+        delete assembly;
+        assembly = NULL;
     }
     wstring exepath, filepath;
     basic_ifstream<wchar_t> ifs;
@@ -93,39 +111,107 @@ int OpenAssembly(LPWSTR file)
     {
         return 1;
     }
-    istreambuf_iterator<wchar_t> ifsbegin(ifs), ifsend;
-    wstring finput(ifsbegin, ifsend);
     ifs.close();
-    list<Token>* tokens = Tokenizer::tokenize(finput, filepath);
-    vector<bool> ROM;
-    Parser parser(tokens, filepath);
+    filepath = file;
+    BitBuffer ROM;
+    HotReload* opened = new HotReload(filepath);
+    opened->trace = trace;
     try
     {
-        ROM = parser.parse();
+        ROM = opened->assemble();
     }
     catch (const ParserError& e)
     {
         wcout << L"Parser error at token:" << e.token.token << L" filename:" << e.token.filename << L" line:" << e.token.line << L" digit:" << e.token.digit << endl << e.what() << endl;
+        delete opened;
         return 2;
     }
     catch (const runtime_error& e)
     {
         wcout << L"Parser error\n" << e.what() << endl;
+        delete opened;
         return 3;
     }
+    assembly = opened;
     bbbbbraindumbed = new BBBBBrainDumbed();
-    bbbbbraindumbed->memory.bakeRom(ROM);
-    LARGE_INTEGER qpc0, qpc1, qpf;
-    QueryPerformanceFrequency(&qpf);
-    QueryPerformanceCounter(&qpc0);
-    for (size_t i = 0; i < 342*262*60*60; i++)
+    bbbbbraindumbed->memory.bakeRom(move(ROM));
+    frame = 0;
+    pacer.reset();
+    return 0;
+}
+
+void RunFrame(HWND hwnd)
+{
+    if (assembly && frame % 6 == 0)	//about every 100 ms, edits are patched into the running ROM
     {
+        assembly->trace = trace;	//recording may have been toggled since the last frame
+        Reassembly result = assembly->reassemble(bbbbbraindumbed->memory);
+        if (result.changed)
+        {
+            if (result.assembled && !result.patched)
+            {
+                bbbbbraindumbed->reset();
+                bbbbbraindumbed->memory.bakeRom(move(result.image));
+            }
+            OutputDebugStringW((HotReload::describe(result) + L"\n").c_str());
+        }
+    }
+    double frameStart = trace ? trace->now() : 0, scanlineStart = 0;
+    size_t frameTicks = 0, frameOvershoot = 0, scanlineTicks = 0, instructionStart = bbbbbraindumbed->instructionCount, irqStart = bbbbbraindumbed->irqCount;
+    chrono::steady_clock::time_point hostStart = chrono::steady_clock::now();
+    for (size_t i = 0; i < 342 * 262; i++)
+    {
+        if (i % 342 == 0)
+        {
+            scanlineTicks = 0;
+            if (profiler)
+            {
+                profiler->begin();
+            }
+            if (trace)
+            {
+                scanlineStart = trace->now();
+            }
+        }
         bbbbbraindumbed->P = 0;
-        bbbbbraindumbed->execute(71, false);
+        size_t slice = (size_t)((i + 1) * Pacer::ticksPerFrame / (342 * 262)) - (size_t)(i * Pacer::ticksPerFrame / (342 * 262));	//about 43, so a frame is one 60 Hz frame of the native clock
+        size_t overshoot = bbbbbraindumbed->execute(slice, false);
+        frameTicks += slice + overshoot;
+        scanlineTicks += slice + overshoot;	//every slice's overshoot, not just the last one's
+        frameOvershoot += overshoot;
+        if (i % 342 == 341)
+        {
+            if (profiler)
+            {
+                profiler->end((uint32_t)frame, (uint32_t)(i / 342), scanlineTicks);
+            }
+            if (trace)
+            {
+                trace->complete(L"execute", L"cpu", scanlineStart);
+            }
+        }
     }
-    QueryPerformanceCounter(&qpc1);
-    OutputDebugStringW(to_wstring((double)(qpc1.QuadPart - qpc0.QuadPart) / qpf.QuadPart).c_str());
-    return 0;
+    metrics.recordFrame(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - hostStart).count(), frameTicks, frameOvershoot, bbbbbraindumbed->instructionCount - instructionStart, bbbbbraindumbed->irqCount - irqStart);
+    wstringstream dump;
+    if (metrics.dumpIfDue(dump, false))
+    {
+        pacer.statistics.write(dump);
+        OutputDebugStringW(dump.str().c_str());
+    }
+    if (trace)
+    {
+        trace->complete(L"frame", L"host", frameStart);
+        trace->counter(L"guest ticks", (double)metrics.guestTicks.load(memory_order_relaxed));
+    }
+    {
+        TraceSpan span(trace, L"pace", L"host");
+        pacer.frame(frameTicks);
+    }
+    if (pacer.present())
+    {
+        InvalidateRect(hwnd, NULL, FALSE);
+    }
+    frame++;
 }
 
 HCURSOR hcArrow;
@@ -134,6 +220,7 @@ LRESULT CALLBACK WindowProcedure(_In_ HWND hwnd, _In_ UINT uMsg, _In_ WPARAM wPa
 {
     HDC hdc;
     HGLRC hglrc;
+    PAINTSTRUCT ps;
     PIXELFORMATDESCRIPTOR pfd = { sizeof(PIXELFORMATDESCRIPTOR), 1, PFD_DRAW_TO_WINDOW | PFD_SUPPORT_OPENGL | PFD_DOUBLEBUFFER, PFD_TYPE_RGBA, 24 };
     pfd.iLayerType = PFD_MAIN_PLANE;
     int iCpf;
@@ -162,6 +249,48 @@ LRESULT CALLBACK WindowProcedure(_In_ HWND hwnd, _In_ UINT uMsg, _In_ WPARAM wPa
                 }
                 break;
             }
+            case 3:
+                if (profiler)
+                {
+                    wstringstream report;
+                    profiler->report(report);
+                    OutputDebugStringW(report.str().c_str());
+                    delete profiler;
+                    profiler = NULL;
+                }
+                else
+                {
+                    profiler = new Profiler();
+                }
+                CheckMenuItem(GetMenu(hwnd), 3, profiler ? MF_CHECKED : MF_UNCHECKED);
+                break;
+            case 4:
+                if (trace)
+                {
+                    if (!trace->save(L"trace.json"))
+                    {
+                        OutputDebugStringW(L"failed to write trace.json");
+                    }
+                    delete trace;
+                    trace = NULL;
+                }
+                else
+                {
+                    trace = new Trace();
+                }
+                CheckMenuItem(GetMenu(hwnd), 4, trace ? MF_CHECKED : MF_UNCHECKED);
+                break;
+            case 5:
+            {
+                wstringstream dump;
+                metrics.snapshot().writeJson(dump);
+                OutputDebugStringW(dump.str().c_str());
+                break;
+            }
+            case 6:
+                pacer.turbo = !pacer.turbo;
+                CheckMenuItem(GetMenu(hwnd), 6, pacer.turbo ? MF_CHECKED : MF_UNCHECKED);
+                break;
             default:
                 break;
             }
@@ -176,7 +305,7 @@ LRESULT CALLBACK WindowProcedure(_In_ HWND hwnd, _In_ UINT uMsg, _In_ WPARAM wPa
         PostQuitMessage(0);
         break;
     case WM_PAINT:
-        hdc = GetDC(hwnd);
+        hdc = BeginPaint(hwnd, &ps);	//validates the window, or WM_PAINT stays pending and the message loop never runs a frame
         iCpf = ChoosePixelFormat(hdc, &pfd);
         if (iCpf == 0)
         {
@@ -191,6 +320,7 @@ LRESULT CALLBACK WindowProcedure(_In_ HWND hwnd, _In_ UINT uMsg, _In_ WPARAM wPa
         if (!hglrc)
         {
             PostQuitMessage(GetLastError());
+            EndPaint(hwnd, &ps);
             break;
         }
         bRet = wglMakeCurrent(hdc, hglrc);
@@ -202,11 +332,14 @@ LRESULT CALLBACK WindowProcedure(_In_ HWND hwnd, _In_ UINT uMsg, _In_ WPARAM wPa
         {
             PostQuitMessage(GetLastError());
         }
-        disp();
-        SwapBuffers(hdc);
+        {
+            TraceSpan span(trace, L"render", L"video");
+            disp();
+            SwapBuffers(hdc);
+        }
         wglMakeCurrent(NULL, NULL);
         wglDeleteContext(hglrc);
-        ReleaseDC(hwnd, hdc);
+        EndPaint(hwnd, &ps);
         break;
     default:
         return DefWindowProcW(hwnd, uMsg, wParam, lParam);
@@ -247,11 +380,18 @@ int WINAPI wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
 
     HMENU menuMain = CreateMenu();
     HMENU menuFileParent = CreatePopupMenu();
+    HMENU menuDebugParent = CreatePopupMenu();
 
     AppendMenuW(menuFileParent, MF_GRAYED, 1, L"Open ROM Image");
     AppendMenuW(menuFileParent, 0, 2, L"Open Assembly File");
 
+    AppendMenuW(menuDebugParent, MF_UNCHECKED, 3, L"Profile Scanlines");
+    AppendMenuW(menuDebugParent, MF_UNCHECKED, 4, L"Record Trace");
+    AppendMenuW(menuDebugParent, 0, 5, L"Dump Metrics");
+    AppendMenuW(menuDebugParent, MF_UNCHECKED, 6, L"Turbo");
+
     AppendMenuW(menuMain, MF_POPUP, (UINT_PTR)menuFileParent, L"File");
+    AppendMenuW(menuMain, MF_POPUP, (UINT_PTR)menuDebugParent, L"Debug");
     if (!SetMenu(hwndMain, menuMain))
     {
         return -2;
@@ -261,17 +401,30 @@ int WINAPI wWinMain(_In_ HINSTANCE hInstance, _In_opt_ HINSTANCE hPrevInstance,
     UpdateWindow(hwndMain);
 
     // Start the message loop. 
+    // Run a frame whenever no message is waiting; the pacer sleeps off the rest of the frame time.
 
-    while ((bRet = GetMessage(&msg, NULL, 0, 0)) != 0)
+    while (true)
     {
-        if (bRet == -1)
+        if (!bbbbbraindumbed || PeekMessageW(&msg, NULL, 0, 0, PM_NOREMOVE))
         {
-            // handle the error and possibly exit
+            bRet = GetMessage(&msg, NULL, 0, 0);
+            if (bRet == 0)
+            {
+                break;
+            }
+            if (bRet == -1)
+            {
+                // handle the error and possibly exit
+            }
+            else
+            {
+                TranslateMessage(&msg);
+                DispatchMessage(&msg);
+            }
         }
         else
         {
-            TranslateMessage(&msg);
-            DispatchMessage(&msg);
+            RunFrame(hwndMain);
         }
     }
 